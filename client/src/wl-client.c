@@ -78,6 +78,7 @@ toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 
 	//xdg_surface_set_window_geometry(ctx->xdgsurf, 0, 0, 600, 800);
 	wl_surface_attach(ctx->surf, ctx->buf, 0, 0);
+	wl_surface_damage(ctx->surf, 0, 0, ctx->w, ctx->h);
 	wl_surface_commit(ctx->surf);
 }
 
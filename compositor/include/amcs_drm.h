@@ -4,25 +4,116 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// number of dumb buffers in the swapchain of every device, 2 or 3
+#define AMCS_DRM_NBUFS 3
+
 typedef struct amcs_drm_card amcs_drm_card;
 typedef struct amcs_drm_dev amcs_drm_dev_list;
 typedef struct amcs_drm_dev amcs_drm_dev;
 
-struct amcs_drm_dev {
+// overlay and cursor planes used by a single device
+#define AMCS_DRM_MAX_PLANES 8
+
+struct amcs_drm_fb {
 	uint8_t *buf;
-	uint32_t conn_id, enc_id, crtc_id, fb_id;
+	uint32_t fb_id;
+	uint32_t fb_id_alpha;	//same memory as ARGB8888, overlay buffers only
+	uint32_t size, handle;
+};
+
+/*
+ * Swapchain buffer states:
+ * front -- currently scanned out,
+ * pending -- page flip requested, but not completed yet,
+ * queued -- ready buffer, waiting for pending flip to complete,
+ * back -- buffer for drawing.
+ * Index is -1 if there is no such buffer.
+ */
+struct amcs_drm_chain {
+	struct amcs_drm_fb fbs[AMCS_DRM_NBUFS];
+	int front, pending, queued, back;
 	uint32_t w, h;
-	uint32_t pitch, size, handle;
+	uint32_t pitch;
+};
+
+enum amcs_drm_plane_prop {
+	PLANE_FB_ID = 0,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_NPROPS,
+};
+
+/*
+ * Hardware plane. Overlay and cursor buffers are allocated on first
+ * use, *chain* size is the largest image the plane can show.
+ */
+struct amcs_drm_plane {
+	uint32_t id;			//0 for legacy primary plane
+	int type;			//DRM_PLANE_TYPE_*
+	bool argb;			//can scan out ARGB8888
+	uint32_t props[PLANE_NPROPS];
+	struct amcs_drm_chain chain;
+
+	// state for the next commit, the latest buffer of *chain* is shown
+	// at x, y of the CRTC, it's w x h part at the buffer origin
+	bool on;
+	bool alpha;			//blend the buffer as ARGB8888
+	int x, y, w, h;
+};
+
+/* Called when flip completes, *sec* and *usec* is presentation time */
+typedef void (*amcs_drm_flip_cb)(amcs_drm_dev *dev, unsigned int sec,
+		unsigned int usec, void *opaq);
+
+/*
+ * Output device, CRTC with single connector. Atomic devices have
+ * overlay and cursor planes, a commit may update any of them and leave
+ * the primary one as is.
+ */
+struct amcs_drm_dev {
+	struct amcs_drm_plane primary;
+	struct amcs_drm_plane planes[AMCS_DRM_MAX_PLANES];
+	int nplanes;
+	bool atomic;
+	bool flip_pending, flip_queued;
+	bool frame_lost;		// flip failed, screen misses a frame
+
+	uint32_t conn_id, enc_id, crtc_id;
+	uint32_t w, h;
+	uint32_t pitch;
 	drmModeModeInfo mode;
+	// atomic modesetting properties
+	uint32_t conn_crtc_prop, crtc_mode_prop, crtc_active_prop;
+	uint32_t mode_blob;
+	// plane showing the pointer, one of *planes* on atomic devices and
+	// *legacy_cursor* otherwise, NULL if the CRTC has no cursor
+	struct amcs_drm_plane *cursor;
+	struct amcs_drm_plane legacy_cursor;
+	int cursor_hx, cursor_hy;	//hotspot of the shown image
+
+	amcs_drm_flip_cb flip_cb;
+	void *flip_opaq;
 
 	amcs_drm_dev_list *next;
 };
 
+struct amcs_orpc;
+struct wl_event_source;
 struct amcs_drm_card {
 	const char *path;
 	int fd;
+	bool atomic;			//atomic modesetting is supported
+	struct wl_event_source *source;	// DRM events, managed by caller
 
 	amcs_drm_dev_list *list;
 };
@@ -30,4 +121,30 @@ struct amcs_drm_card {
 amcs_drm_card *amcs_drm_init(struct amcs_orpc *orpc, const char *path);
 void amcs_drm_free(amcs_drm_card *card);
 
+/* Read pending DRM events from card fd, call flip handlers */
+int amcs_drm_handle_events(amcs_drm_card *card);
+
+/* Index of the primary buffer for drawing, -1 if all buffers are busy */
+int amcs_drm_dev_get_back(amcs_drm_dev *dev);
+/* Same for the plane, -1 if buffers can't be allocated too */
+int amcs_drm_plane_get_back(amcs_drm_card *card, struct amcs_drm_plane *plane);
+/*
+ * Schedule back buffers and plane state for presentation, legacy
+ * devices need the primary back buffer.
+ */
+int amcs_drm_dev_present(amcs_drm_card *card, amcs_drm_dev *dev);
+/* Check plane state of the next commit without applying it */
+bool amcs_drm_dev_test(amcs_drm_card *card, amcs_drm_dev *dev);
+/*
+ * Pointer image, *w* x *h* premultiplied ARGB8888 pixels with hotspot
+ * at *hx*, *hy*, NULL hides the pointer. Fails if the device has no
+ * cursor plane or the image doesn't fit it. Legacy devices show the
+ * change at once, atomic ones with the next present.
+ */
+int amcs_drm_dev_set_cursor(amcs_drm_card *card, amcs_drm_dev *dev,
+		const uint32_t *img, int w, int h, int hx, int hy);
+/* Move the pointer hotspot to *x*, *y* of the CRTC, same rules */
+int amcs_drm_dev_move_cursor(amcs_drm_card *card, amcs_drm_dev *dev,
+		int x, int y);
+
 #endif // _AMCS_DRM_H
@@ -0,0 +1,62 @@
+#ifndef _AMCS_BINDINGS_H
+#define _AMCS_BINDINGS_H
+
+#include <stdint.h>
+
+/*
+ * Compositor key bindings, compiled into a hash table keyed by keysym
+ * and KB_* modifier mask. They are read from AMCS_BINDINGS file, then
+ * $XDG_CONFIG_HOME/amcs/bindings or ~/.config/amcs/bindings, built-in
+ * defaults are used if there is none in the default locations. A file
+ * named by AMCS_BINDINGS must be readable. SIGHUP reloads the file, the
+ * old table is kept if it can't be read.
+ *
+ * One binding per line, '#' starts a comment:
+ *
+ *	Win+Shift+q	kill_client
+ *	Win+Return	spawn xfce4-terminal
+ *	Win+h		focus left
+ *	Win+1		workspace 1
+ *
+ * Modifiers are Shift, Ctrl, Alt and Win, keys are xkb keysym names.
+ */
+struct amcs_compositor;
+struct wl_event_loop;
+
+typedef int (*amcs_binding_fn)(struct amcs_compositor *ctx, int key, void *opaq);
+
+enum binding_arg {
+	BIND_ARG_NONE = 0,
+	BIND_ARG_INT,			// positive number
+	BIND_ARG_DIR,			// left, down, up, right: WS_*
+	BIND_ARG_STRING,		// the rest of the line
+};
+
+struct amcs_action {
+	const char *name;
+	amcs_binding_fn fn;
+	enum binding_arg arg;
+};
+
+struct amcs_binding {
+	uint32_t keysym;
+	uint32_t modifiers;		// KB_*
+	const struct amcs_action *action;	// NULL in a free slot
+	void *opaq;			// argument, owned by the table
+};
+
+/*
+ * *actions* and *defaults* must outlive the module, *defaults* are
+ * bindings in the file format.
+ */
+int amcs_bindings_init(struct wl_event_loop *loop,
+		const struct amcs_action *actions, int nactions,
+		const char *defaults);
+void amcs_bindings_finalize(void);
+/* Read the file again */
+int amcs_bindings_reload(void);
+
+/* NULL if the key isn't bound, *keysym* is lower case for latin letters */
+const struct amcs_binding *amcs_bindings_find(uint32_t keysym, uint32_t modifiers);
+
+#endif // _AMCS_BINDINGS_H
@@ -0,0 +1,82 @@
+#ifndef _AMCS_BLIT_H
+#define _AMCS_BLIT_H
+
+#include <stdint.h>
+
+/*
+ * Row blitting kernels. All pixels are 32 bit, premultiplied ARGB/XRGB.
+ * Implementation is chosen once by amcs_blit_init() according to CPU
+ * features (AVX2, SSE2 or plain C), AMCS_BLIT environment variable
+ * may be used to force one of them ("avx2", "sse2", "scalar").
+ */
+struct amcs_blit_ops {
+	const char *name;
+	// dst = src
+	void (*copy)(uint32_t *dst, const uint32_t *src, int n);
+	// dst = src OVER dst
+	void (*blend)(uint32_t *dst, const uint32_t *src, int n);
+	// dst = src OVER bg, dst isn't read
+	void (*blend_solid)(uint32_t *dst, const uint32_t *src, int n, uint32_t bg);
+	// dst = src, non-temporal stores, dst isn't pulled into the cache
+	void (*stream)(uint32_t *dst, const uint32_t *src, int n);
+	// rotated copy of a small tile, see amcs_blit_transform()
+	void (*rotate)(uint8_t *dst, int dst_pitch, const uint8_t *src,
+			long sx_step, long sy_step, int w, int h);
+	// dst[i] = average of 2x2 block at src[2 * i], rows are *pitch* apart
+	void (*box2)(uint32_t *dst, const uint8_t *src, int pitch, int n);
+	// dst[i] = s0[i] + (s1[i] - s0[i]) * f / 256
+	void (*lerp_v)(uint32_t *dst, const uint32_t *s0, const uint32_t *s1,
+			int n, uint32_t f);
+	// dst[i] = row[p] + (row[p + 1] - row[p]) * f / 256, where p and f
+	// are integer and fraction parts of 16.16 *pos[i]*
+	void (*lerp_h)(uint32_t *dst, const uint32_t *row, const int32_t *pos, int n);
+	// dst[i] = row[idx[i]]
+	void (*gather)(uint32_t *dst, const uint32_t *row, const int32_t *idx, int n);
+};
+
+extern struct amcs_blit_ops amcs_blit;
+
+enum blit_op {
+	BLIT_COPY = 0,
+	BLIT_BLEND,
+	BLIT_BLEND_SOLID,
+};
+
+/* Filter for non-integer scale ratios */
+enum scale_filter {
+	SCALE_BILINEAR = 0,
+	SCALE_NEAREST,
+};
+
+void amcs_blit_init(void);
+
+/* pitches are in bytes */
+void amcs_blit_rect(uint8_t *dst, int dst_pitch,
+		const uint8_t *src, int src_pitch,
+		int w, int h, enum blit_op op, uint32_t bg);
+/*
+ * Copy to write-combined or uncached memory (scanout buffers), all
+ * stores are visible when it returns.
+ */
+void amcs_blit_stream_rect(uint8_t *dst, int dst_pitch,
+		const uint8_t *src, int src_pitch, int w, int h);
+void amcs_blit_fill(uint8_t *dst, int dst_pitch, int w, int h, uint32_t color);
+/*
+ * Copy with rotation or mirroring: pixel (x, y) of *dst* is taken from
+ * src + y * sy_step + x * sx_step, steps are in bytes. Rotated images
+ * are walked by small tiles, so both sides stay in the cache.
+ */
+void amcs_blit_transform(uint8_t *dst, int dst_pitch, const uint8_t *src,
+		long sx_step, long sy_step, int w, int h);
+/*
+ * Resample *sw* x *sh* image into *dw* x *dh* one, only *w* x *h* part
+ * at (x, y) of the destination is drawn. Integer downscale averages
+ * pixel blocks, integer upscale replicates pixels, other ratios use
+ * *filter*.
+ */
+void amcs_blit_scale(uint8_t *dst, int dst_pitch, int dw, int dh,
+		int x, int y, int w, int h,
+		const uint8_t *src, int src_pitch, int sw, int sh,
+		enum scale_filter filter);
+
+#endif // _AMCS_BLIT_H
@@ -0,0 +1,29 @@
+#ifndef _AMCS_FORMAT_H
+#define _AMCS_FORMAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Client shm formats. Compositor draws premultiplied ARGB8888/XRGB8888
+ * only, other formats are converted row by row when the buffer is
+ * copied. Converter of every format is chosen once by amcs_format_init()
+ * with the same instruction set as the blitter.
+ */
+typedef void (*amcs_convert_fn)(uint32_t *dst, const uint8_t *src, int n);
+
+struct amcs_format {
+	uint32_t format;	//enum wl_shm_format
+	const char *name;
+	int bpp;		//bytes per pixel
+	bool alpha;		//converted to ARGB8888, XRGB8888 otherwise
+	amcs_convert_fn convert;	//NULL if the format is drawn as is
+};
+
+/* Call after amcs_blit_init() */
+void amcs_format_init(void);
+/* NULL if the format isn't supported */
+const struct amcs_format *amcs_format_get(uint32_t format);
+const struct amcs_format *amcs_format_list(int *n);
+
+#endif // _AMCS_FORMAT_H
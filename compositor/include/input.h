@@ -0,0 +1,79 @@
+#ifndef _AMCS_INPUT_H
+#define _AMCS_INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libinput.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "seat.h"
+
+/*
+ * amcs_input -- libinput reader thread. It owns the libinput context and
+ * the xkb state: events are dispatched and keys are translated there,
+ * compact records are passed to the main thread through a single
+ * producer, single consumer ring. The main loop is woken by an eventfd,
+ * see amcs_input_fd().
+ */
+#define INPUT_RING_SIZE 1024		// power of two
+
+enum input_ev_type {
+	INPUT_DEVICE_ADDED = 0,
+	INPUT_KEY,
+	INPUT_MODIFIERS,		// xkb state changed without a key
+	INPUT_MOTION,
+	INPUT_MOTION_ABSOLUTE,
+	INPUT_BUTTON,
+	INPUT_AXIS,
+};
+
+struct amcs_input_event {
+	uint16_t type;
+	uint16_t dev;			// devices are numbered as they are added
+	uint64_t time_usec;		// kernel timestamp
+	uint64_t read_usec;		// taken from libinput, see amcs_lat_now()
+	union {
+		struct {
+			char *name;	// freed by the consumer
+			int caps;	// WL_SEAT_CAPABILITY_*
+		} device;
+		struct {
+			uint32_t key;	// evdev code
+			struct amcs_key_info ki;
+		} key;
+		struct keyboard_modifiers_state mods;
+		struct {
+			double dx, dy;
+		} motion;
+		struct {
+			double x, y;	// fraction of the output size
+		} abs;
+		struct {
+			uint32_t button;
+			uint32_t state;	// enum libinput_button_state
+		} button;
+		struct {
+			int mask;	// bit per enum libinput_pointer_axis
+			double value[2];
+		} axis;
+	};
+};
+
+struct amcs_input;
+
+/* Thread is started at once, asynchronous signals are blocked in it */
+struct amcs_input *amcs_input_new(struct libinput *li, struct xkb_keymap *keymap);
+/* Stops and joins the thread, *li* is left to the caller */
+void amcs_input_free(struct amcs_input *in);
+
+/* Readable when records are queued, read it with amcs_input_drain() */
+int amcs_input_fd(struct amcs_input *in);
+void amcs_input_drain(struct amcs_input *in);
+/* Takes the oldest record, false if the ring is empty */
+bool amcs_input_pop(struct amcs_input *in, struct amcs_input_event *ev);
+
+/* Switch to the next xkb layout, INPUT_MODIFIERS record follows */
+void amcs_input_layout_next(struct amcs_input *in);
+
+#endif // _AMCS_INPUT_H
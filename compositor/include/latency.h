@@ -0,0 +1,67 @@
+#ifndef _AMCS_LATENCY_H
+#define _AMCS_LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Input latency histograms, one set per input device. Every event is
+ * timed at four points: kernel timestamp, libinput dispatch on the input
+ * thread, queueing of the wayland event and wl_display_flush_clients().
+ * Histograms are updated by the main thread only, they are
+ * dumped to stderr on LAT_DUMP_SIGNAL (kill -RTMIN <pid>).
+ *
+ * Buckets are log-linear like HdrHistogram: values are exact below
+ * 2 * LAT_SUB microseconds, then every power of two is split into
+ * LAT_SUB buckets, so the relative error is below 1 / LAT_SUB.
+ */
+#define LAT_DUMP_SIGNAL SIGRTMIN
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_NBUCKETS ((33 - LAT_SUB_BITS) * LAT_SUB)
+
+enum lat_stage {
+	LAT_KERNEL = 0,		// event timestamp to libinput dispatch
+	LAT_DISPATCH,		// dispatch to wayland event queueing, includes
+				// the input thread to main loop handoff
+	LAT_FLUSH,		// queueing to the write to clients
+	LAT_TOTAL,		// event timestamp to the write
+	LAT_NSTAGES,
+};
+
+struct amcs_hist {
+	uint64_t count, sum, max;	// microseconds
+	uint32_t buckets[LAT_NBUCKETS];
+};
+
+struct amcs_lat_dev;
+
+/* Timestamps of a single event, microseconds of CLOCK_MONOTONIC */
+struct amcs_lat_sample {
+	struct amcs_lat_dev *dev;	// NULL if the event isn't measured
+	uint64_t kernel, dispatch, queued;
+};
+
+void amcs_hist_add(struct amcs_hist *h, uint64_t usec);
+/* Smallest value with *q* fraction of samples at or below it */
+uint64_t amcs_hist_quantile(const struct amcs_hist *h, double q);
+
+/* Histograms of a new input device, kept until amcs_lat_finalize() */
+struct amcs_lat_dev *amcs_lat_dev_new(const char *name);
+/* CLOCK_MONOTONIC, microseconds */
+uint64_t amcs_lat_now(void);
+/* Event was taken from libinput at *dispatch_usec* */
+void amcs_lat_event(struct amcs_lat_sample *s, struct amcs_lat_dev *dev,
+		uint64_t kernel_usec, uint64_t dispatch_usec);
+/* Wayland event for *s* is queued, it's timed at the next flush */
+void amcs_lat_queued(const struct amcs_lat_sample *s);
+/* Call after wl_display_flush_clients() */
+void amcs_lat_flushed(void);
+void amcs_lat_dump(FILE *f);
+
+struct wl_event_loop;
+/* Call before threads are spawned, the dump signal is blocked */
+int amcs_lat_init(struct wl_event_loop *loop);
+void amcs_lat_finalize(void);
+
+#endif // _AMCS_LATENCY_H
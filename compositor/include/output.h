@@ -2,23 +2,106 @@
 #define _OUTPUT_H_FLURUJBH
 
 #include <stdbool.h>
+#include <time.h>
+#include <wayland-server-core.h>
 
+#include "amcs_drm.h"
+#include "region.h"
 #include "vector.h"
 //TODO: refactor amcs_output and amcs_win relation
 #include "window.h"
 
+#define OUTPUT_BG_COLOR 0x00000000
+
+/*
+ * Retained draw list entry, one per visible window of the shown
+ * workspace, in painting order. Output coordinates.
+ */
+struct amcs_draw {
+	struct amcs_win *win;
+	const struct amcs_buf *buf;
+	struct amcs_rect box;	//window content on the output
+	int src_x, src_y;	//*box* origin in the buffer
+	struct amcs_region opaque;	//opaque part of *box*, drawn without blending
+	// scanned out by an overlay or cursor plane, not composed
+	struct amcs_drm_plane *plane;
+};
+
+struct amcs_workers;
 struct amcs_output {
 	int w, h;
 	bool isactive;
 	pvector cards;
 	pvector screens; //struct amcs_screen *
+	struct amcs_workspace *ws;	//workspace shown on the output
+	vector scene;			//struct amcs_draw
+	bool scene_dirty;		//rebuild scene before the next repaint
+
+	int scale;			//output pixels per surface unit
+	int transform;			//wl_output.transform of every screen
+	int repaint_window;		//ms, repaint start before vblank
+	bool shadowfb;			//compose in cached memory
+	struct amcs_workers *workers;	//parallel composition, may be NULL
+
+	// pointer image, premultiplied ARGB8888, hotspot *hx*, *hy* is at
+	// *x*, *y* of the output
+	struct {
+		uint32_t *img;
+		int w, h, hx, hy;
+		int x, y;
+		bool visible;
+	} cursor;
+
+	// new layout waits for clients, screens show the old frame
+	bool frozen;
+	int configure_timeout;		//ms, max freeze duration
+	struct wl_event_source *freeze_timer;
+	struct wl_signal frame_sig;	//repaint starts, data is amcs_screen
+	struct wl_signal present_sig;	//frame is on screen, data is amcs_screen
+};
+
+enum screen_repaint_state {
+	REPAINT_IDLE = 0,	// nothing to draw, no frame on the fly
+	REPAINT_SCHEDULED,	// repaint timer or idle source is armed
+	REPAINT_AWAITING_FLIP,	// frame is submitted, waiting for page flip
 };
 
 struct amcs_screen {
-	int x, y;		//relative screen offset
-	int w, h;
-	int pitch;
-	uint8_t *buf;
+	int x, y;		//screen position in output layout
+	int w, h;		//layout size, rotated by *transform*
+	int pitch;		//of *buf*
+	uint8_t *buf;		//drawing target, valid during repaint
+	// cached copy of the screen, damaged parts are streamed to the
+	// scanout buffer, which is often write-combined
+	uint8_t *shadow;
+	// rotated screens are always drawn into the shadow and rotated
+	// while it's copied into the scanout buffer
+	int transform;
+	int fb_pitch;
+	bool planes_dirty;	//scene is changed, assign planes again
+	bool hw_cursor;		//pointer is on the cursor plane, not composed
+	bool cursor_dirty;	//cursor plane is changed, commit it
+
+	struct amcs_output *out;
+	amcs_drm_card *card;
+	amcs_drm_dev *dev;
+
+	// frame scheduling
+	enum screen_repaint_state state;
+	struct wl_event_source *timer;
+	struct wl_event_source *idle;
+	struct wl_event_source *vblank_timer;	//fake flip for empty frames
+	struct timespec last_present;	//CLOCK_MONOTONIC
+	int64_t refresh_nsec;
+	bool frame_requested;		//repaint even without damage
+
+	// wl_callback resources, done is sent after the frame is presented
+	struct wl_list frame_cbs;
+
+	// not drawn yet damage, screen coordinates
+	struct amcs_region damage;
+	// damage missed by every swapchain buffer since it was drawn
+	struct amcs_region fb_damage[AMCS_DRM_NBUFS];
 };
 
 struct amcs_output *amcs_output_new();
@@ -33,7 +116,35 @@ int amcs_output_release(struct amcs_output *out);
 //send updated info to wl_output object
 void amcs_output_send_info(struct amcs_output *out, struct wl_resource *resource);
 int amcs_output_update_region(struct amcs_output *out, struct amcs_win *w);
+void amcs_output_damage(struct amcs_output *out, const struct amcs_rect *r);
 void amcs_output_clear(struct amcs_output *out);
+/*
+ * Stop presenting new frames until thaw or configure timeout, damage is
+ * accumulated and shown at once. Frame callbacks are still fired.
+ */
+void amcs_output_freeze(struct amcs_output *out);
+void amcs_output_thaw(struct amcs_output *out);
+/* Run repaint cycle on every screen, even without damage */
+void amcs_output_schedule_repaint(struct amcs_output *out);
+/* Client of *win* waits for frame callbacks, run repaint cycle on every
+ * screen showing the window, even without damage */
+void amcs_output_schedule_frame(struct amcs_output *out, struct amcs_win *win);
+/* Part of the window on the screen, screen coordinates */
+bool amcs_screen_win_clip(struct amcs_screen *screen, struct amcs_win *win,
+		struct amcs_rect *clip);
+void amcs_output_set_workspace(struct amcs_output *out, struct amcs_workspace *ws);
+/* Window tree of the shown workspace is changed */
+void amcs_output_invalidate_scene(struct amcs_output *out);
+/* Topmost window at *x*, *y* of the output, NULL if none */
+struct amcs_win *amcs_output_win_at(struct amcs_output *out, int x, int y);
+/*
+ * Pointer image is shown by cursor planes, composed on screens without
+ * them. *img* is copied, NULL hides the pointer.
+ */
+void amcs_output_set_cursor(struct amcs_output *out, const uint32_t *img,
+		int w, int h, int hx, int hy);
+/* Move the pointer hotspot, cursor planes are moved without repaint */
+void amcs_output_move_cursor(struct amcs_output *out, int x, int y);
 
 struct amcs_compositor;
 int output_init(struct amcs_compositor *ctx);
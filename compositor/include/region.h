@@ -0,0 +1,62 @@
+#ifndef _AMCS_REGION_H
+#define _AMCS_REGION_H
+
+#include <stdbool.h>
+
+#include "vector.h"
+
+/*
+ * amcs_rect -- simple axis aligned rectangle
+ * amcs_region -- set of rectangles, used for damage tracking.
+ * Rectangles may overlap, region is collapsed to its bounding box
+ * when it becomes too fragmented.
+ */
+struct amcs_rect {
+	int x, y;
+	int w, h;
+};
+
+#define REGION_MAXRECTS 16
+
+struct amcs_region {
+	vector rects;	//struct amcs_rect
+};
+
+static inline bool
+amcs_rect_empty(const struct amcs_rect *r)
+{
+	return r->w <= 0 || r->h <= 0;
+}
+
+bool amcs_rect_intersect(const struct amcs_rect *a, const struct amcs_rect *b,
+		struct amcs_rect *out);
+void amcs_rect_union(const struct amcs_rect *a, const struct amcs_rect *b,
+		struct amcs_rect *out);
+
+void amcs_region_init(struct amcs_region *r);
+void amcs_region_fini(struct amcs_region *r);
+void amcs_region_clear(struct amcs_region *r);
+bool amcs_region_empty(const struct amcs_region *r);
+int amcs_region_nrects(const struct amcs_region *r);
+struct amcs_rect *amcs_region_rects(const struct amcs_region *r);
+
+void amcs_region_add(struct amcs_region *r, int x, int y, int w, int h);
+void amcs_region_add_rect(struct amcs_region *r, const struct amcs_rect *rect);
+void amcs_region_add_region(struct amcs_region *r, const struct amcs_region *src);
+/* Clip every rectangle by *clip*, drop empty ones */
+void amcs_region_intersect_rect(struct amcs_region *r, const struct amcs_rect *clip);
+void amcs_region_subtract_rect(struct amcs_region *r, const struct amcs_rect *cut);
+/* Exact union, rectangles of *r* stay disjoint and are never collapsed */
+void amcs_region_union_rect(struct amcs_region *r, const struct amcs_rect *rect);
+void amcs_region_copy(struct amcs_region *dst, const struct amcs_region *src);
+void amcs_region_translate(struct amcs_region *r, int dx, int dy);
+void amcs_region_extents(const struct amcs_region *r, struct amcs_rect *out);
+/* Sum of rectangle areas, overlapped parts are counted several times */
+long amcs_region_area(const struct amcs_region *r);
+
+#define amcs_region_for_each(i, rect, region)				\
+	for (i = 0, rect = amcs_region_rects(region);			\
+	     i < amcs_region_nrects(region);				\
+	     i++, rect++)
+
+#endif // _AMCS_REGION_H
@@ -5,6 +5,8 @@
 #include <libudev.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "latency.h"
+#include "vector.h"
 #include "wl-server.h"
 
 enum KB_MODS {
@@ -29,20 +31,45 @@ struct amcs_key_info {
 	struct keyboard_modifiers_state mods;
 };
 
+struct amcs_input;
+
 struct amcs_seat {
 	struct libinput *input;
 	struct udev *udev;
 
 	struct xkb_context *xkb;
 	struct xkb_keymap *keymap;
-	struct xkb_state *kbstate;
+	// libinput and xkb state are used by the input thread only
+	struct amcs_input *in;
+	// as of the last record taken from the input thread
+	struct keyboard_modifiers_state mods;
+	pvector lat_devs;		// struct amcs_lat_dev *, by device number
 
 	// keymap, saved into anon file, useful for sending keymap to wayland clients
 	int f_keymap;
 	int f_keymap_sz;
 
-	int ifd;			// libinput file descriptor
 	int capabilities;
+
+	// surface of the current window, gets key events; keyboard of its
+	// client and modifiers sent to it are cached
+	struct amcs_surface *kb_focus;
+	struct wl_resource *kb_res;
+	struct keyboard_modifiers_state kb_mods;
+
+	// pointer position, output coordinates
+	double px, py;
+	// surface under the pointer, gets pointer events
+	struct amcs_surface *focus;
+	uint32_t enter_serial;
+	int nbuttons;			// pressed, focus is kept while any is
+	// motion since the last frame is sent once at the repaint start
+	bool motion_pending;
+	uint32_t motion_time;		// of the latest motion event
+	struct amcs_lat_sample motion_lat;	// of the first one
+	// wl_pointer.set_cursor surface, NULL if the built-in image is shown
+	struct amcs_surface *cursor;
+	int hot_x, hot_y;		// surface coordinates
 };
 
 int seat_init(struct amcs_compositor *ctx);
@@ -50,4 +77,13 @@ int seat_finalize(struct amcs_compositor *ctx);
 
 int keyboard_layout_toggle(struct amcs_compositor *ctx);
 
+/* Keyboard focus follows the current window, enter/leave on change only */
+void seat_keyboard_focus(struct amcs_compositor *ctx);
+/* Send pointer motion coalesced since the last frame */
+void seat_pointer_flush(struct amcs_compositor *ctx);
+/* Surface without a window is committed, *image* is its new content */
+void seat_cursor_commit(struct amcs_surface *surf);
+/* Surface is destroyed, drop pointer references to it */
+void seat_surface_gone(struct amcs_surface *surf);
+
 #endif
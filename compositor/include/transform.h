@@ -0,0 +1,44 @@
+#ifndef _AMCS_TRANSFORM_H
+#define _AMCS_TRANSFORM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "region.h"
+
+/*
+ * wl_output.transform values, used for both buffer transform of
+ * surfaces and transform of screens. Transform maps an image of
+ * *w* x *h* size (surface, screen) into its rotated or mirrored copy
+ * (client buffer, scanout buffer).
+ */
+static inline bool
+amcs_transform_swaps(int transform)
+{
+	// 90 and 270 degrees, mirrored or not
+	return transform & 1;
+}
+
+/* Size of the transformed image */
+static inline void
+amcs_transform_size(int transform, int w, int h, int *tw, int *th)
+{
+	*tw = amcs_transform_swaps(transform) ? h : w;
+	*th = amcs_transform_swaps(transform) ? w : h;
+}
+
+/* Transform of the transformed image back into the original one */
+int amcs_transform_invert(int transform);
+void amcs_transform_point(int transform, int w, int h, int x, int y,
+		int *tx, int *ty);
+void amcs_transform_rect(int transform, int w, int h,
+		const struct amcs_rect *r, struct amcs_rect *out);
+/*
+ * Source address and steps for amcs_blit_transform(), which fills *r*
+ * part of the original image from the transformed one at *src*.
+ */
+const uint8_t *amcs_transform_src(int transform, int w, int h,
+		const struct amcs_rect *r, const uint8_t *src, int pitch,
+		long *sx_step, long *sy_step);
+
+#endif // _AMCS_TRANSFORM_H
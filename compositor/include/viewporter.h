@@ -0,0 +1,14 @@
+#ifndef VIEWPORTER_H_
+#define VIEWPORTER_H_
+
+struct amcs_compositor;
+struct amcs_surface;
+
+int viewporter_init(struct amcs_compositor *ctx);
+int viewporter_finalize(struct amcs_compositor *ctx);
+/* Unset viewport state of a new surface */
+void viewporter_surface_init(struct amcs_surface *surf);
+/* Detach viewport of *surf*, it's about to be destroyed */
+void viewporter_surface_gone(struct amcs_surface *surf);
+
+#endif
@@ -1,8 +1,10 @@
 #ifndef _AWC_WINDOWS_H
 #define _AWC_WINDOWS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "region.h"
 #include "vector.h"
 /*
  * amcs_workspace -- single compositor workspace with it's own output position
@@ -20,9 +22,21 @@ enum win_objtype {
 	WT_WORKSPACE = 2,
 };
 
+/*
+ * Layout invalidation flags, geometry is recomputed lazily by
+ * amcs_workspace_update() only for dirty subtrees.
+ * WIN_DIRTY_GEOM -- window box changed / container children must be
+ *   placed again,
+ * WIN_DIRTY_CHILD -- some descendant is dirty.
+ */
+#define WIN_DIRTY_GEOM  (1 << 0)
+#define WIN_DIRTY_CHILD (1 << 1)
+
 struct amcs_workspace {
 	enum win_objtype type;
 	struct amcs_container *parent;	//unused
+	unsigned int dirty;
+	int txn;		//layout transaction nesting depth
 	// offsets for multi monitor systems
 	int w, h;
 	int x, y;
@@ -31,6 +45,7 @@ struct amcs_workspace {
 	struct amcs_win *current;
 	struct amcs_output *out;
 	char *name;
+	int nconfiguring;	//windows waiting for client redraw
 };
 
 enum container_type {
@@ -42,33 +57,59 @@ enum container_type {
 struct amcs_container {
 	enum win_objtype type;
 	struct amcs_container *parent;
+	unsigned int dirty;
 	int w, h;
 	int x, y;
 
 	enum container_type wt;
 	pvector subwins; // struct amcs_win *
-	struct amcs_workspace *ws; // NOTE: Valid only for root wtree
+	struct amcs_workspace *ws; // NULL for detached containers
 };
 
+/*
+ * Window content: either compositor owned copy in *dt*, or client
+ * wl_shm_buffer read in place (*shm* is set, *dt* is NULL).
+ */
 struct amcs_buf {
 	uint32_t *dt;
+	void *shm;		//struct wl_shm_buffer *
 	int format;
 	int h, w;
+	int stride;		//bytes
 	int sz;
 };
 
-/* Notify callback for window resize */
+static inline bool
+amcs_buf_attached(const struct amcs_buf *b)
+{
+	return b->dt != NULL || b->shm != NULL;
+}
+
+/*
+ * Notify callback for window resize. Returns WIN_UPD_CONFIGURE if the
+ * client is asked to redraw the window for new geometry, the new layout
+ * isn't shown until amcs_win_configured() or timeout.
+ */
+#define WIN_UPD_CONFIGURE 1
 typedef int (*win_update_cb)(struct amcs_win *w, void *opaq);
 #define AMCS_WIN(v) ((struct amcs_win *)v)
 struct amcs_win {
 	enum win_objtype type;
 	struct amcs_container *parent;
+	unsigned int dirty;
 
 	//window coordinates
 	int w, h;
 	int x, y;
 
+	struct amcs_workspace *ws;	//NULL if window isn't in a tree
+	int draw_idx;			//entry in output scene, -1 if none
+
 	struct amcs_buf buf;
+	// damaged part of *buf* since the last blit, buffer coordinates
+	struct amcs_region damage;
+	// part of *buf* the client promises to be opaque, buffer coordinates
+	struct amcs_region opaque;
 
 	// wayland specific stuff, store information about visible region
 	// of window buffer
@@ -79,6 +120,7 @@ struct amcs_win {
 
 	void *opaq;	//TODO: getter/setter ???
 	win_update_cb upd_cb;
+	bool configuring;	//waits for client buffer of new size
 };
 
 /* Workspace */
@@ -97,8 +139,21 @@ enum ws_lookup_dir {
 void amcs_workspace_focus_next(struct amcs_workspace *ws, enum ws_lookup_dir direction);
 void amcs_workspace_win_move(struct amcs_workspace *ws, enum ws_lookup_dir direction);
 void amcs_workspace_redraw(struct amcs_workspace *ws);
+/* Place dirty windows, send them configure and damage changed areas */
 void amcs_workspace_update(struct amcs_workspace *ws);
+/* Stop waiting for clients to redraw, late acks are ignored */
+void amcs_workspace_configure_expire(struct amcs_workspace *ws);
+/*
+ * Layout transaction: tree changes between begin and commit are applied
+ * by a single layout pass at the outermost commit. Transactions nest,
+ * geometry isn't updated inside of them.
+ */
+void amcs_workspace_begin(struct amcs_workspace *ws);
+void amcs_workspace_commit(struct amcs_workspace *ws);
 void amcs_workspace_debug(struct amcs_workspace *ws);
+typedef int (*win_pass_cb)(struct amcs_win *w, void *opaq);
+/* call *cb* for every container and window of the workspace */
+int amcs_workspace_pass(struct amcs_workspace *ws, win_pass_cb cb, void *opaq);
 
 struct amcs_win *amcs_workspace_new_win(struct amcs_workspace *ws, void *opaq,
 		win_update_cb upd);
@@ -112,7 +167,12 @@ static inline void *amcs_win_get_opaq(struct amcs_win *w)
 	assert(w);
 	return w->opaq;
 }
+struct amcs_workspace *amcs_win_get_workspace(struct amcs_win *w);
 int amcs_win_commit(struct amcs_win *w);
+/* Client committed content for the last configure */
+void amcs_win_configured(struct amcs_win *w);
+void amcs_win_damage(struct amcs_win *w, int x, int y, int width, int height);
+void amcs_win_damage_all(struct amcs_win *w);
 //TODO: change current window, free empty containers (except root)
 int amcs_win_orphain(struct amcs_win *w);
 //int amcs_win_resize(struct amcs_win *w,);
@@ -1,6 +1,8 @@
 #ifndef WL_SERVER_H_
 #define WL_SERVER_H_
 
+#include "blit.h"
+#include "region.h"
 #include "window.h"
 #include "vector.h"
 
@@ -18,6 +20,20 @@ struct amcs_client {
 	struct wl_list link;
 };
 
+/* Client wl_buffer, reference is dropped when the buffer is destroyed */
+struct amcs_buffer_ref {
+	struct wl_resource *res;
+	struct wl_listener destroy_listener;
+	// optional, called when the client destroys referenced buffer
+	void (*destroy_cb)(struct amcs_buffer_ref *ref);
+};
+
+/* wp_viewport state, source is in wl_fixed_t, sizes are -1 if unset */
+struct amcs_viewport {
+	int32_t src_x, src_y, src_w, src_h;
+	int dst_w, dst_h;
+};
+
 struct amcs_surface {
 	struct wl_resource *res;
 	struct wl_resource *xdgres;
@@ -31,14 +47,51 @@ struct amcs_surface {
 
 	struct amcs_win *aw;
 	struct {
-		struct wl_shm_buffer *buf;
+		struct amcs_buffer_ref buf;
+		bool newbuf;		//wl_surface.attach since last commit
 		int w, h;
 		int x, y;
 		int upd_source;
 		int xdg_serial;
+		// damage since last commit, wl_surface.damage (surface
+		// coordinates) and wl_surface.damage_buffer (buffer coordinates)
+		struct amcs_region damage;
+		struct amcs_region buf_damage;
+		struct wl_list frame_cbs;	//wl_callback resources
+		// wl_surface.set_opaque_region / set_input_region
+		struct amcs_region opaque;
+		struct amcs_region input;
+		bool opaque_set, input_set;
+		bool input_all;
+		int scale;		//wl_surface.set_buffer_scale
+		int transform;		//wl_surface.set_buffer_transform
+		struct amcs_viewport vp;
 	} pending;
+	int scale, transform;	//of the committed buffer
+	struct amcs_viewport vp;
+	struct wl_resource *viewport;	//wp_viewport, NULL if none
+	// committed buffer part shown by the surface, buffer pixels in
+	// surface orientation, and surface size in surface units
+	struct amcs_rect crop;
+	int vw, vh;
+	// format of the last copied buffer, NULL if it was read in place
+	const struct amcs_format *fmt;
+	// scratch images for buffer copy: converted pixels and transformed
+	// image before scaling, kept between commits as damage is partial
+	struct amcs_buf conv, stage;
+	// content of a surface without window, cursor image for example,
+	// converted and scaled to output pixels
+	struct amcs_buf image;
 	struct wl_array surf_states;
-	struct wl_resource *redraw_cb;	//client callback for surface redraw
+	uint32_t acked_serial;	//last xdg_surface.ack_configure
+	// buffer read in place by the compositor, zero-copy mode only
+	struct amcs_buffer_ref buffer;
+	// committed wl_surface.frame callbacks, waiting for the next frame
+	struct wl_list frame_cbs;
+	// committed input region, surface coordinates, whole surface if
+	// *input_all* is set
+	struct amcs_region input;
+	bool input_all;
 
 	struct wl_list link;
 };
@@ -49,6 +102,7 @@ struct global_resources {
 	struct wl_global *seat;
 	struct wl_global *devman;
 	struct wl_global *output;
+	struct wl_global *viewporter;
 };
 
 struct amcs_compositor {
@@ -70,9 +124,13 @@ struct amcs_compositor {
 	pvector workspaces;		//struct amcs_workspace *
 	struct amcs_output *output;
 	int cur_workspace;
+	// compose straight from client shm buffers instead of copying
+	bool shm_zerocopy;
+	// filter for non-integer buffer to window scaling
+	enum scale_filter scale_filter;
 
-	struct wl_listener redraw_listener;
-	struct wl_signal redraw_sig;
+	struct wl_listener redraw_listener;	//output frame_sig listener
+	struct wl_listener present_listener;	//output present_sig listener
 };
 
 extern struct amcs_compositor compositor_ctx;
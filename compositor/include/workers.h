@@ -0,0 +1,21 @@
+#ifndef _AMCS_WORKERS_H
+#define _AMCS_WORKERS_H
+
+/*
+ * amcs_workers -- fixed pool of threads for data parallel jobs.
+ * Jobs are identified by index, the calling thread takes part in
+ * execution and amcs_workers_run() returns when all jobs are done.
+ */
+struct amcs_workers;
+
+typedef void (*amcs_job_fn)(int idx, void *opaq);
+
+/* *nthreads* is the total number of threads, including the caller */
+struct amcs_workers *amcs_workers_new(int nthreads);
+void amcs_workers_free(struct amcs_workers *w);
+int amcs_workers_nthreads(struct amcs_workers *w);
+
+void amcs_workers_run(struct amcs_workers *w, amcs_job_fn fn, void *opaq,
+		int njobs);
+
+#endif // _AMCS_WORKERS_H
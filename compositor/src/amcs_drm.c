@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include <drm_fourcc.h>
+
 #include "macro.h"
 #include "orpc.h"
 #include "amcs_drm.h"
@@ -35,16 +37,37 @@ dumb_is_supported(int fd)
 	return 1;
 }
 
+static void
+drm_destroy_fb(int fd, struct amcs_drm_fb *fb)
+{
+	struct drm_mode_destroy_dumb dreq;
+
+	if (fb->buf && fb->buf != MAP_FAILED)
+		munmap(fb->buf, fb->size);
+	if (fb->fb_id)
+		drmModeRmFB(fd, fb->fb_id);
+	if (fb->fb_id_alpha)
+		drmModeRmFB(fd, fb->fb_id_alpha);
+	if (fb->handle) {
+		memset(&dreq, 0, sizeof(dreq));
+		dreq.handle = fb->handle;
+		drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	}
+	memset(fb, 0, sizeof(*fb));
+}
+
 static int
-drm_setFB(int fd, amcs_drm_dev *dev)
+drm_create_fb(int fd, struct amcs_drm_chain *chain, struct amcs_drm_fb *fb,
+		bool alpha)
 {
 	struct drm_mode_create_dumb creq;
 	struct drm_mode_map_dumb mreq;
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 
 	// get settings, and FB id
 	memset(&creq, 0, sizeof (struct drm_mode_create_dumb));
-	creq.width = dev->w;
-	creq.height = dev->h;
+	creq.width = chain->w;
+	creq.height = chain->h;
 	creq.bpp = BPP;
 
 	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
@@ -52,45 +75,615 @@ drm_setFB(int fd, amcs_drm_dev *dev)
 		return 1;
 	}
 
-	dev->pitch = creq.pitch;
-	dev->size = creq.size;
-	dev->handle = creq.handle;
+	chain->pitch = creq.pitch;
+	fb->size = creq.size;
+	fb->handle = creq.handle;
 
-	if (drmModeAddFB(fd, dev->w, dev->h, DEPTH, BPP, dev->pitch,
-			 dev->handle, &dev->fb_id)) {
+	if (drmModeAddFB(fd, chain->w, chain->h, DEPTH, BPP, chain->pitch,
+			 fb->handle, &fb->fb_id)) {
 		warning("error adding frame buffer");
 		return 1;
 	}
-
+	if (alpha) {
+		handles[0] = fb->handle;
+		pitches[0] = chain->pitch;
+		if (drmModeAddFB2(fd, chain->w, chain->h, DRM_FORMAT_ARGB8888,
+				  handles, pitches, offsets, &fb->fb_id_alpha, 0)) {
+			warning("error adding ARGB frame buffer");
+			return 1;
+		}
+	}
 
 	// get settings, and map buffer
 	memset(&mreq, 0, sizeof (struct drm_mode_map_dumb));
-	mreq.handle = dev->handle;
+	mreq.handle = fb->handle;
 
 	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) {
 		warning("error getting map dumb");
 		return 1;
 	}
 
-	dev->buf = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	fb->buf = mmap(NULL, fb->size, PROT_READ | PROT_WRITE, MAP_SHARED,
 			fd, mreq.offset);
-	if (dev->buf == MAP_FAILED) {
+	if (fb->buf == MAP_FAILED) {
 		warning("error mapping buffer");
 		return 1;
 	}
+	return 0;
+}
+
+static int
+chain_alloc(int fd, struct amcs_drm_chain *chain, bool alpha)
+{
+	int i;
+
+	for (i = 0; i < AMCS_DRM_NBUFS; i++) {
+		if (drm_create_fb(fd, chain, &chain->fbs[i], alpha) != 0)
+			return 1;
+	}
+	chain->front = chain->pending = chain->queued = chain->back = -1;
+	return 0;
+}
+
+static void
+chain_free(int fd, struct amcs_drm_chain *chain)
+{
+	int i;
+
+	for (i = 0; i < AMCS_DRM_NBUFS; i++)
+		drm_destroy_fb(fd, &chain->fbs[i]);
+}
+
+static inline bool
+chain_allocated(const struct amcs_drm_chain *chain)
+{
+	return chain->fbs[0].fb_id != 0;
+}
+
+static int
+chain_get_back(struct amcs_drm_chain *chain)
+{
+	int i;
+
+	if (chain->back != -1)
+		return chain->back;
+	for (i = 0; i < AMCS_DRM_NBUFS; i++) {
+		if (i == chain->front || i == chain->pending || i == chain->queued)
+			continue;
+		chain->back = i;
+		return i;
+	}
+	return -1;
+}
+
+/* Buffer shown after the last commit, -1 if nothing is drawn yet */
+static int
+chain_latest(const struct amcs_drm_chain *chain)
+{
+	if (chain->queued != -1)
+		return chain->queued;
+	if (chain->pending != -1)
+		return chain->pending;
+	return chain->front;
+}
 
-	if (drmModeSetCrtc(fd, dev->crtc_id, dev->fb_id, 0, 0,
-			   &dev->conn_id, 1, &dev->mode)) {
+/* Back buffer goes into the next commit, queued one if *queue* is set */
+static void
+chain_submit(struct amcs_drm_chain *chain, bool queue)
+{
+	if (chain->back == -1)
+		return;
+	if (queue)
+		chain->queued = chain->back;
+	else
+		chain->pending = chain->back;
+	chain->back = -1;
+}
+
+static void
+chain_flipped(struct amcs_drm_chain *chain)
+{
+	if (chain->pending != -1)
+		chain->front = chain->pending;
+	chain->pending = chain->queued;
+	chain->queued = -1;
+}
+
+/*
+ * Commit failed, old buffer stays on screen and the frame is lost. The
+ * dropped buffer has the latest content, it becomes the back one again.
+ */
+static void
+chain_drop(struct amcs_drm_chain *chain)
+{
+	if (chain->back == -1)
+		chain->back = chain->pending;
+	chain->pending = -1;
+}
+
+static void
+drm_free_dev(int fd, amcs_drm_dev *dev)
+{
+	int i;
+
+	chain_free(fd, &dev->primary.chain);
+	for (i = 0; i < dev->nplanes; i++)
+		chain_free(fd, &dev->planes[i].chain);
+	chain_free(fd, &dev->legacy_cursor.chain);
+	if (dev->mode_blob)
+		drmModeDestroyPropertyBlob(fd, dev->mode_blob);
+	free(dev);
+}
+
+static void
+plane_add(drmModeAtomicReq *req, amcs_drm_dev *dev, struct amcs_drm_plane *p)
+{
+	const struct amcs_drm_fb *fb;
+	uint32_t *props = p->props;
+	int idx;
+
+	idx = chain_latest(&p->chain);
+	// test commits may come before the first drawing
+	if (idx == -1 && p->chain.back != -1)
+		idx = p->chain.back;
+	if (!p->on || idx == -1) {
+		drmModeAtomicAddProperty(req, p->id, props[PLANE_FB_ID], 0);
+		drmModeAtomicAddProperty(req, p->id, props[PLANE_CRTC_ID], 0);
+		return;
+	}
+	fb = &p->chain.fbs[idx];
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_FB_ID],
+			p->alpha ? fb->fb_id_alpha : fb->fb_id);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_CRTC_ID], dev->crtc_id);
+	// source is 16.16 fixed point
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_SRC_X], 0);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_SRC_Y], 0);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_SRC_W],
+			(uint64_t)p->w << 16);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_SRC_H],
+			(uint64_t)p->h << 16);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_CRTC_X], p->x);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_CRTC_Y], p->y);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_CRTC_W], p->w);
+	drmModeAtomicAddProperty(req, p->id, props[PLANE_CRTC_H], p->h);
+}
+
+/* Atomic commit of the whole plane state of the device */
+static int
+drm_commit(int fd, amcs_drm_dev *dev, uint32_t flags)
+{
+	drmModeAtomicReq *req;
+	int i, ret;
+
+	if ((req = drmModeAtomicAlloc()) == NULL)
+		return -ENOMEM;
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+		drmModeAtomicAddProperty(req, dev->conn_id,
+				dev->conn_crtc_prop, dev->crtc_id);
+		drmModeAtomicAddProperty(req, dev->crtc_id,
+				dev->crtc_mode_prop, dev->mode_blob);
+		drmModeAtomicAddProperty(req, dev->crtc_id,
+				dev->crtc_active_prop, 1);
+	}
+	plane_add(req, dev, &dev->primary);
+	for (i = 0; i < dev->nplanes; i++)
+		plane_add(req, dev, &dev->planes[i]);
+	ret = drmModeAtomicCommit(fd, req, flags, dev);
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+/* Allocate swapchain and scan out the first buffer */
+static int
+drm_setFB(int fd, amcs_drm_dev *dev)
+{
+	struct amcs_drm_chain *chain = &dev->primary.chain;
+
+	chain->w = dev->w;
+	chain->h = dev->h;
+	if (chain_alloc(fd, chain, false) != 0)
+		return 1;
+	dev->pitch = chain->pitch;
+	chain->front = 0;
+	dev->primary.on = true;
+	dev->primary.w = dev->w;
+	dev->primary.h = dev->h;
+
+	if (dev->atomic) {
+		if (drmModeCreatePropertyBlob(fd, &dev->mode, sizeof(dev->mode),
+				&dev->mode_blob) ||
+		    drm_commit(fd, dev, DRM_MODE_ATOMIC_ALLOW_MODESET)) {
+			warning("error setting mode");
+			return 1;
+		}
+		return 0;
+	}
+	if (drmModeSetCrtc(fd, dev->crtc_id, chain->fbs[chain->front].fb_id,
+			   0, 0, &dev->conn_id, 1, &dev->mode)) {
 		warning("error setting crtc");
 		return 1;
 	}
 	return 0;
 }
 
+static void
+dev_submit(amcs_drm_dev *dev, bool queue)
+{
+	int i;
+
+	chain_submit(&dev->primary.chain, queue);
+	for (i = 0; i < dev->nplanes; i++)
+		chain_submit(&dev->planes[i].chain, queue);
+}
+
+static void
+dev_flipped(amcs_drm_dev *dev)
+{
+	int i;
+
+	chain_flipped(&dev->primary.chain);
+	for (i = 0; i < dev->nplanes; i++)
+		chain_flipped(&dev->planes[i].chain);
+}
+
+/* Submitted buffers are pending, request the flip */
+static int
+drm_page_flip(int fd, amcs_drm_dev *dev)
+{
+	struct amcs_drm_chain *chain = &dev->primary.chain;
+	int i, ret;
+
+	if (dev->atomic)
+		ret = drm_commit(fd, dev, DRM_MODE_PAGE_FLIP_EVENT |
+				DRM_MODE_ATOMIC_NONBLOCK);
+	else
+		ret = drmModePageFlip(fd, dev->crtc_id,
+				chain->fbs[chain->pending].fb_id,
+				DRM_MODE_PAGE_FLIP_EVENT, dev);
+	if (ret) {
+		warning("page flip error: %s", strerror(errno));
+		dev->frame_lost = true;
+		chain_drop(chain);
+		for (i = 0; i < dev->nplanes; i++)
+			chain_drop(&dev->planes[i].chain);
+		return 1;
+	}
+	dev->flip_pending = true;
+	return 0;
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence, unsigned int sec,
+		unsigned int usec, void *data)
+{
+	amcs_drm_dev *dev = data;
+
+	assert(dev && dev->flip_pending);
+	dev->flip_pending = false;
+	dev_flipped(dev);
+	// triple buffering, next frame is ready already
+	if (dev->flip_queued) {
+		dev->flip_queued = false;
+		drm_page_flip(fd, dev);
+	}
+	if (dev->flip_cb)
+		dev->flip_cb(dev, sec, usec, dev->flip_opaq);
+}
+
+int
+amcs_drm_handle_events(amcs_drm_card *card)
+{
+	drmEventContext ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.version = 2;
+	ev.page_flip_handler = page_flip_handler;
+	return drmHandleEvent(card->fd, &ev);
+}
+
+int
+amcs_drm_dev_get_back(amcs_drm_dev *dev)
+{
+	return chain_get_back(&dev->primary.chain);
+}
+
+int
+amcs_drm_plane_get_back(amcs_drm_card *card, struct amcs_drm_plane *plane)
+{
+	if (!chain_allocated(&plane->chain) &&
+	    chain_alloc(card->fd, &plane->chain, plane->argb) != 0) {
+		chain_free(card->fd, &plane->chain);
+		return -1;
+	}
+	return chain_get_back(&plane->chain);
+}
+
+int
+amcs_drm_dev_present(amcs_drm_card *card, amcs_drm_dev *dev)
+{
+	assert((dev->atomic || dev->primary.chain.back != -1) &&
+			"nothing to present");
+	if (dev->flip_pending) {
+		// flip in progress, wait for it
+		dev_submit(dev, true);
+		dev->flip_queued = true;
+		return 0;
+	}
+	dev_submit(dev, false);
+	// old buffers are still scanned out, frame is lost
+	return drm_page_flip(card->fd, dev);
+}
+
+bool
+amcs_drm_dev_test(amcs_drm_card *card, amcs_drm_dev *dev)
+{
+	struct amcs_drm_plane *p;
+	int i;
+
+	if (!dev->atomic)
+		return false;
+	for (i = 0; i < dev->nplanes; i++) {
+		p = &dev->planes[i];
+		if (p->on && chain_latest(&p->chain) == -1 &&
+		    amcs_drm_plane_get_back(card, p) == -1)
+			return false;
+	}
+	return drm_commit(card->fd, dev, DRM_MODE_ATOMIC_TEST_ONLY) == 0;
+}
+
+int
+amcs_drm_dev_set_cursor(amcs_drm_card *card, amcs_drm_dev *dev,
+		const uint32_t *img, int w, int h, int hx, int hy)
+{
+	struct amcs_drm_plane *p = dev->cursor;
+	struct amcs_drm_fb *fb;
+	int i, back;
+
+	if (p == NULL)
+		return 1;
+	if (img == NULL) {
+		p->on = false;
+		if (!dev->atomic)
+			drmModeSetCursor(card->fd, dev->crtc_id, 0, 0, 0);
+		return 0;
+	}
+	if (w > p->chain.w || h > p->chain.h ||
+	    (back = amcs_drm_plane_get_back(card, p)) == -1)
+		return 1;
+	// image is in the top left corner, the rest is transparent
+	fb = &p->chain.fbs[back];
+	memset(fb->buf, 0, fb->size);
+	for (i = 0; i < h; i++)
+		memcpy(fb->buf + i * p->chain.pitch, img + i * w, w * 4);
+	if (!dev->atomic) {
+		if (drmModeSetCursor2(card->fd, dev->crtc_id, fb->handle,
+				p->chain.w, p->chain.h, hx, hy)) {
+			warning("can't set cursor: %s", strerror(errno));
+			return 1;
+		}
+		// legacy cursor is updated at once, not on flip
+		p->chain.front = back;
+		p->chain.back = -1;
+	}
+	p->x += dev->cursor_hx - hx;
+	p->y += dev->cursor_hy - hy;
+	dev->cursor_hx = hx;
+	dev->cursor_hy = hy;
+	p->on = true;
+	p->alpha = true;
+	p->w = p->chain.w;
+	p->h = p->chain.h;
+	return 0;
+}
+
+int
+amcs_drm_dev_move_cursor(amcs_drm_card *card, amcs_drm_dev *dev,
+		int x, int y)
+{
+	struct amcs_drm_plane *p = dev->cursor;
+
+	if (p == NULL)
+		return 1;
+	// plane position is the image corner
+	p->x = x - dev->cursor_hx;
+	p->y = y - dev->cursor_hy;
+	if (!dev->atomic && p->on)
+		return drmModeMoveCursor(card->fd, dev->crtc_id, p->x, p->y);
+	return 0;
+}
+
+static uint32_t
+get_prop_id(int fd, uint32_t obj, uint32_t type, const char *name,
+		uint64_t *value)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	uint32_t i, id = 0;
+
+	if ((props = drmModeObjectGetProperties(fd, obj, type)) == NULL)
+		return 0;
+	for (i = 0; i < props->count_props && id == 0; i++) {
+		if ((prop = drmModeGetProperty(fd, props->props[i])) == NULL)
+			continue;
+		if (STREQ(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+static const char *plane_prop_names[PLANE_NPROPS] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+
+static bool
+plane_has_format(const drmModePlane *plane, uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < plane->count_formats; i++) {
+		if (plane->formats[i] == format)
+			return true;
+	}
+	return false;
+}
+
+/* Plane is taken by another device of the card */
+static bool
+plane_is_used(amcs_drm_card *card, uint32_t id)
+{
+	amcs_drm_dev *dev;
+	int i;
+
+	for (dev = card->list; dev != NULL; dev = dev->next) {
+		if (dev->primary.id == id)
+			return true;
+		for (i = 0; i < dev->nplanes; i++) {
+			if (dev->planes[i].id == id)
+				return true;
+		}
+	}
+	return false;
+}
+
+static bool
+plane_init(int fd, struct amcs_drm_plane *p, const drmModePlane *plane,
+		uint64_t type)
+{
+	int i;
+
+	memset(p, 0, sizeof(*p));
+	p->id = plane->plane_id;
+	p->type = type;
+	p->argb = plane_has_format(plane, DRM_FORMAT_ARGB8888);
+	for (i = 0; i < PLANE_NPROPS; i++) {
+		p->props[i] = get_prop_id(fd, p->id, DRM_MODE_OBJECT_PLANE,
+				plane_prop_names[i], NULL);
+		if (p->props[i] == 0)
+			return false;
+	}
+	p->chain.front = p->chain.pending = -1;
+	p->chain.queued = p->chain.back = -1;
+	return true;
+}
+
+/*
+ * Find planes of the device CRTC: the primary one and overlays above
+ * it. The first ARGB cursor plane shows the pointer, other cursor
+ * planes are usable by small windows.
+ */
+static bool
+drm_init_planes(amcs_drm_card *card, amcs_drm_dev *dev, int crtc_idx)
+{
+	drmModePlaneRes *res;
+	drmModePlane *plane;
+	struct amcs_drm_plane *p;
+	uint64_t type, val, cw = 64, ch = 64;
+	int64_t zpos, primary_zpos = -1, zposes[AMCS_DRM_MAX_PLANES];
+	uint32_t i;
+	int j, n;
+
+	if ((res = drmModeGetPlaneResources(card->fd)) == NULL)
+		return false;
+	drmGetCap(card->fd, DRM_CAP_CURSOR_WIDTH, &cw);
+	drmGetCap(card->fd, DRM_CAP_CURSOR_HEIGHT, &ch);
+	for (i = 0; i < res->count_planes; i++) {
+		if (plane_is_used(card, res->planes[i]) ||
+		    (plane = drmModeGetPlane(card->fd, res->planes[i])) == NULL)
+			continue;
+		if (!(plane->possible_crtcs & (1 << crtc_idx)) ||
+		    !plane_has_format(plane, DRM_FORMAT_XRGB8888) ||
+		    !get_prop_id(card->fd, plane->plane_id,
+			    DRM_MODE_OBJECT_PLANE, "type", &type))
+			goto next;
+		// -1 if the driver doesn't tell
+		zpos = get_prop_id(card->fd, plane->plane_id,
+				DRM_MODE_OBJECT_PLANE, "zpos", &val) ? (int64_t)val : -1;
+		if (type == DRM_PLANE_TYPE_PRIMARY && dev->primary.id == 0) {
+			if (plane_init(card->fd, &dev->primary, plane, type))
+				primary_zpos = zpos;
+			else
+				dev->primary.id = 0;
+		} else if (type != DRM_PLANE_TYPE_PRIMARY &&
+		    dev->nplanes < AMCS_DRM_MAX_PLANES) {
+			p = &dev->planes[dev->nplanes];
+			if (plane_init(card->fd, p, plane, type)) {
+				zposes[dev->nplanes++] = zpos;
+				// buffers are allocated on first use
+				p->chain.w = type == DRM_PLANE_TYPE_CURSOR ? cw : dev->w;
+				p->chain.h = type == DRM_PLANE_TYPE_CURSOR ? ch : dev->h;
+			}
+		}
+next:
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(res);
+	if (dev->primary.id == 0) {
+		dev->nplanes = 0;
+		return false;
+	}
+	// windows are on top, planes below the primary one are useless
+	for (j = n = 0; j < dev->nplanes; j++) {
+		if (zposes[j] != -1 && primary_zpos != -1 &&
+		    zposes[j] <= primary_zpos)
+			continue;
+		dev->planes[n++] = dev->planes[j];
+	}
+	dev->nplanes = n;
+	for (j = 0; j < n && dev->cursor == NULL; j++) {
+		if (dev->planes[j].type == DRM_PLANE_TYPE_CURSOR &&
+		    dev->planes[j].argb)
+			dev->cursor = &dev->planes[j];
+	}
+	return true;
+}
+
+/* Legacy cursor, drmModeSetCursor2() takes a dumb buffer handle */
+static void
+drm_init_legacy_cursor(amcs_drm_card *card, amcs_drm_dev *dev)
+{
+	struct amcs_drm_plane *p = &dev->legacy_cursor;
+	uint64_t cw = 64, ch = 64;
+
+	drmGetCap(card->fd, DRM_CAP_CURSOR_WIDTH, &cw);
+	drmGetCap(card->fd, DRM_CAP_CURSOR_HEIGHT, &ch);
+	memset(p, 0, sizeof(*p));
+	p->type = DRM_PLANE_TYPE_CURSOR;
+	p->argb = true;
+	p->chain.w = cw;
+	p->chain.h = ch;
+	p->chain.front = p->chain.pending = -1;
+	p->chain.queued = p->chain.back = -1;
+	dev->cursor = p;
+}
+
+/* Find properties for atomic modesetting, false if something is missing */
+static bool
+drm_init_atomic(amcs_drm_card *card, amcs_drm_dev *dev, int crtc_idx)
+{
+	int fd = card->fd;
+
+	dev->conn_crtc_prop = get_prop_id(fd, dev->conn_id,
+			DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL);
+	dev->crtc_mode_prop = get_prop_id(fd, dev->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL);
+	dev->crtc_active_prop = get_prop_id(fd, dev->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "ACTIVE", NULL);
+	if (!dev->conn_crtc_prop || !dev->crtc_mode_prop ||
+	    !dev->crtc_active_prop)
+		return false;
+	return drm_init_planes(card, dev, crtc_idx);
+}
+
 amcs_drm_card*
 amcs_drm_init(struct amcs_orpc *orpc, const char *path)
 {
-	int i;
+	int i, crtc_idx;
 	int fd;
 
 	amcs_drm_card *card;
@@ -123,8 +716,13 @@ amcs_drm_init(struct amcs_orpc *orpc, const char *path)
 	}
 
 	card = xmalloc(sizeof (amcs_drm_card));
+	memset(card, 0, sizeof (amcs_drm_card));
 	card->path = path;
 	card->fd = fd;
+	card->atomic = getenv("AMCS_DRM_LEGACY") == NULL &&
+		drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0 &&
+		drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+	debug("%s modesetting", card->atomic ? "atomic" : "legacy");
 
 	debug("Count connectors: %d", res->count_connectors);
 
@@ -143,6 +741,7 @@ amcs_drm_init(struct amcs_orpc *orpc, const char *path)
 			goto free_connector;
 
 		drmdev = xmalloc(sizeof (amcs_drm_dev));
+		memset(drmdev, 0, sizeof (amcs_drm_dev));
 		drmdev->next = dev_list;
 		dev_list = card->list = drmdev;
 
@@ -154,10 +753,21 @@ amcs_drm_init(struct amcs_orpc *orpc, const char *path)
 		dev_list->w = conn->modes[0].hdisplay;
 		dev_list->h = conn->modes[0].vdisplay;
 
+		for (crtc_idx = 0; crtc_idx < res->count_crtcs; crtc_idx++) {
+			if (res->crtcs[crtc_idx] == enc->crtc_id)
+				break;
+		}
+		dev_list->atomic = card->atomic &&
+			crtc_idx < res->count_crtcs &&
+			drm_init_atomic(card, dev_list, crtc_idx);
+		if (!dev_list->atomic)
+			drm_init_legacy_cursor(card, dev_list);
+
 		if (drm_setFB(fd, dev_list) != 0) {
-			dev_list = drmdev->next;
-			free(drmdev);
+			card->list = drmdev->next;
+			drm_free_dev(fd, drmdev);
 			drmModeFreeEncoder(enc);
+			drmModeFreeConnector(conn);
 			goto cleanup;
 		}
 
@@ -165,8 +775,9 @@ amcs_drm_init(struct amcs_orpc *orpc, const char *path)
 		debug("    enc id: %d", dev_list->enc_id);
 		debug("    crtc id: %d", dev_list->crtc_id);
 		debug("    mode: %dx%d", dev_list->w, dev_list->h);
-		debug("    pitch: %d, size: %d, handle: %d",
-		      dev_list->pitch, dev_list->size, dev_list->handle);
+		debug("    pitch: %d, buffers: %d",
+		      dev_list->pitch, AMCS_DRM_NBUFS);
+		debug("    planes: %d", dev_list->nplanes);
 
 		drmModeFreeEncoder(enc);
 free_connector:
@@ -181,10 +792,9 @@ free_connector:
 cleanup:
 	drmModeFreeResources(res);
 	for (dev_list = card->list; dev_list != NULL;) {
-		munmap(dev_list->buf, dev_list->size);
 		dev = dev_list;
 		dev_list = dev_list->next;
-		free(dev);
+		drm_free_dev(card->fd, dev);
 	}
 	close(card->fd);
 	free(card);
@@ -195,18 +805,12 @@ void
 amcs_drm_free(amcs_drm_card *card)
 {
 	amcs_drm_dev *dev, *dev_list;
-	struct drm_mode_destroy_dumb dreq;
 
 	assert(card);
 	for (dev_list = card->list; dev_list != NULL;) {
-		munmap(dev_list->buf, dev_list->size);
-		drmModeRmFB(card->fd, dev_list->fb_id);
-		dreq.handle = dev_list->handle;
-		drmIoctl(card->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-
 		dev = dev_list;
 		dev_list = dev_list->next;
-		free(dev);
+		drm_free_dev(card->fd, dev);
 	}
 
 	close(card->fd);
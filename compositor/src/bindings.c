@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <wayland-server-core.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "bindings.h"
+#include "macro.h"
+#include "seat.h"
+#include "vector.h"
+#include "window.h"
+
+#define TABLE_MIN_BITS 4
+
+/* Open addressing with linear probing, at most half full */
+struct bindings_table {
+	struct amcs_binding *slots;
+	int bits;			// log2 of the size
+	int n;
+};
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} mod_names[] = {
+	{"shift", KB_SHIFT},
+	{"ctrl", KB_CTRL},
+	{"alt", KB_ALT},
+	{"win", KB_WIN},
+};
+
+static const struct {
+	const char *name;
+	enum ws_lookup_dir dir;
+} dir_names[] = {
+	{"left", WS_LEFT},
+	{"down", WS_DOWN},
+	{"up", WS_UP},
+	{"right", WS_RIGHT},
+};
+
+static struct bindings_table table;
+static const struct amcs_action *bind_actions;
+static int bind_nactions;
+static const char *bind_defaults;
+static struct wl_event_source *bind_signal;
+
+static uint32_t
+bind_slot(const struct bindings_table *t, uint32_t keysym, uint32_t modifiers)
+{
+	// Fibonacci hashing, top bits are the best mixed ones
+	return ((keysym << 4 | modifiers) * 2654435769u) >> (32 - t->bits);
+}
+
+static struct amcs_binding *
+table_lookup(const struct bindings_table *t, uint32_t keysym, uint32_t modifiers)
+{
+	uint32_t i, mask = (1u << t->bits) - 1;
+	struct amcs_binding *b;
+
+	for (i = bind_slot(t, keysym, modifiers); ; i = (i + 1) & mask) {
+		b = &t->slots[i];
+		if (b->action == NULL ||
+		    (b->keysym == keysym && b->modifiers == modifiers))
+			return b;
+	}
+}
+
+static void
+binding_clear(struct amcs_binding *b)
+{
+	if (b->action && b->action->arg == BIND_ARG_STRING)
+		free(b->opaq);
+	b->action = NULL;
+	b->opaq = NULL;
+}
+
+static void
+table_free(struct bindings_table *t)
+{
+	int i;
+
+	for (i = 0; t->slots && i < (1 << t->bits); i++)
+		binding_clear(&t->slots[i]);
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+/* *list* items are moved into the table */
+static void
+table_build(struct bindings_table *t, vector *list)
+{
+	struct amcs_binding *src, *b;
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	t->bits = TABLE_MIN_BITS;
+	while ((1 << t->bits) < 2 * vector_len(list))
+		t->bits++;
+	t->slots = xmalloc(sizeof(*t->slots) << t->bits);
+	memset(t->slots, 0, sizeof(*t->slots) << t->bits);
+	src = vector_data(list);
+	for (i = 0; i < vector_len(list); i++) {
+		b = table_lookup(t, src[i].keysym, src[i].modifiers);
+		// later lines win
+		if (b->action)
+			binding_clear(b);
+		else
+			t->n++;
+		*b = src[i];
+	}
+	vector_clear(list);
+}
+
+static bool
+parse_keys(char *keys, struct amcs_binding *b)
+{
+	char *name, *next;
+	int i;
+
+	b->modifiers = 0;
+	for (name = keys; (next = strchr(name, '+')) != NULL; name = next + 1) {
+		*next = '\0';
+		for (i = 0; i < ARRSZ(mod_names); i++) {
+			if (strcasecmp(name, mod_names[i].name) == 0)
+				break;
+		}
+		if (i == ARRSZ(mod_names))
+			return false;
+		b->modifiers |= mod_names[i].mask;
+	}
+	b->keysym = xkb_keysym_from_name(name, XKB_KEYSYM_NO_FLAGS);
+	if (b->keysym == XKB_KEY_NoSymbol)
+		b->keysym = xkb_keysym_from_name(name, XKB_KEYSYM_CASE_INSENSITIVE);
+	// same as amcs_compositor_handle_key() does
+	if (b->keysym < 0x7f && isupper(b->keysym))
+		b->keysym = tolower(b->keysym);
+	return b->keysym != XKB_KEY_NoSymbol;
+}
+
+static bool
+parse_arg(char *arg, struct amcs_binding *b)
+{
+	char *end;
+	long n;
+	int i;
+
+	switch (b->action->arg) {
+	case BIND_ARG_NONE:
+		return *arg == '\0';
+	case BIND_ARG_INT:
+		n = strtol(arg, &end, 10);
+		if (end == arg || *end != '\0' || n <= 0 || n > INT_MAX)
+			return false;
+		b->opaq = (void *)(intptr_t)n;
+		return true;
+	case BIND_ARG_DIR:
+		for (i = 0; i < ARRSZ(dir_names); i++) {
+			if (strcasecmp(arg, dir_names[i].name) == 0) {
+				b->opaq = (void *)(intptr_t)dir_names[i].dir;
+				return true;
+			}
+		}
+		return false;
+	case BIND_ARG_STRING:
+		if (*arg == '\0')
+			return false;
+		b->opaq = strdup(arg);
+		return true;
+	}
+	return false;
+}
+
+/* 1 if *line* has a binding, 0 if it's empty, -1 on error */
+static int
+parse_line(char *line, struct amcs_binding *b)
+{
+	char *keys, *action, *arg, *p;
+	int i;
+
+	if ((p = strchr(line, '#')) != NULL)
+		*p = '\0';
+	keys = line + strspn(line, " \t\r\n");
+	if (*keys == '\0')
+		return 0;
+	action = keys + strcspn(keys, " \t\r\n");
+	if (*action != '\0')
+		*action++ = '\0';
+	action += strspn(action, " \t\r\n");
+	arg = action + strcspn(action, " \t\r\n");
+	if (*arg != '\0')
+		*arg++ = '\0';
+	arg += strspn(arg, " \t\r\n");
+	// trailing blanks of the argument
+	for (p = arg + strlen(arg); p > arg && isspace(p[-1]); p--)
+		p[-1] = '\0';
+
+	memset(b, 0, sizeof(*b));
+	if (!parse_keys(keys, b))
+		return -1;
+	for (i = 0; i < bind_nactions; i++) {
+		if (STREQ(action, bind_actions[i].name))
+			b->action = &bind_actions[i];
+	}
+	if (b->action == NULL || !parse_arg(arg, b))
+		return -1;
+	return 1;
+}
+
+static void
+bindings_parse(FILE *f, const char *src, struct bindings_table *t)
+{
+	struct amcs_binding b;
+	char *line = NULL;
+	size_t sz = 0;
+	vector list;
+	int lineno = 0;
+
+	vector_init(&list, sizeof(struct amcs_binding), xrealloc);
+	while (getline(&line, &sz, f) != -1) {
+		lineno++;
+		switch (parse_line(line, &b)) {
+		case 1:
+			vector_push(&list, &b);
+			break;
+		case -1:
+			warning("%s:%d: bad binding, skipped", src, lineno);
+			break;
+		}
+	}
+	free(line);
+	table_build(t, &list);
+	vector_free(&list);
+	debug("%d bindings from %s", t->n, src);
+}
+
+static FILE *
+bindings_open(char *path, size_t sz)
+{
+	const char *env;
+
+	if ((env = getenv("AMCS_BINDINGS")) != NULL)
+		snprintf(path, sz, "%s", env);
+	else if ((env = getenv("XDG_CONFIG_HOME")) != NULL && *env)
+		snprintf(path, sz, "%s/amcs/bindings", env);
+	else if ((env = getenv("HOME")) != NULL)
+		snprintf(path, sz, "%s/.config/amcs/bindings", env);
+	else
+		return NULL;
+	return fopen(path, "r");
+}
+
+int
+amcs_bindings_reload(void)
+{
+	struct bindings_table t;
+	char path[PATH_MAX];
+	FILE *f;
+	int err;
+
+	path[0] = '\0';
+	f = bindings_open(path, sizeof(path));
+	err = errno;
+	if (f != NULL) {
+		bindings_parse(f, path, &t);
+		fclose(f);
+	} else if (getenv("AMCS_BINDINGS") == NULL &&
+		   (path[0] == '\0' || err == ENOENT)) {
+		// only the default locations may be missing
+		f = fmemopen((void *)bind_defaults, strlen(bind_defaults), "r");
+		if (f == NULL)
+			return 1;
+		bindings_parse(f, "defaults", &t);
+		fclose(f);
+	} else {
+		warning("can't read %s: %s, bindings are kept", path, strerror(err));
+		return 1;
+	}
+	table_free(&table);
+	table = t;
+	return 0;
+}
+
+static int
+bindings_signal(int signum, void *data)
+{
+	amcs_bindings_reload();
+	return 0;
+}
+
+int
+amcs_bindings_init(struct wl_event_loop *loop,
+		const struct amcs_action *actions, int nactions,
+		const char *defaults)
+{
+	bind_actions = actions;
+	bind_nactions = nactions;
+	bind_defaults = defaults;
+	if (amcs_bindings_reload() != 0)
+		return 1;
+	// signalfd, threads spawned later have it blocked
+	bind_signal = wl_event_loop_add_signal(loop, SIGHUP,
+			bindings_signal, NULL);
+	if (bind_signal == NULL) {
+		// not fatal, bindings are loaded already
+		warning("can't watch SIGHUP, bindings won't be reloaded");
+	}
+	return 0;
+}
+
+void
+amcs_bindings_finalize(void)
+{
+	if (bind_signal)
+		wl_event_source_remove(bind_signal);
+	bind_signal = NULL;
+	table_free(&table);
+}
+
+const struct amcs_binding *
+amcs_bindings_find(uint32_t keysym, uint32_t modifiers)
+{
+	const struct amcs_binding *b;
+
+	if (table.n == 0)
+		return NULL;
+	b = table_lookup(&table, keysym, modifiers);
+	return b->action ? b : NULL;
+}
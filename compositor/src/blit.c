@@ -0,0 +1,883 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blit.h"
+#include "macro.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define ALPHA_MASK 0xff000000u
+
+/*
+ * Scalar kernels, also used for row tails of SIMD ones.
+ */
+
+/* per channel saturated addition of two packed pixels */
+static inline uint32_t
+px_add_sat(uint32_t a, uint32_t b)
+{
+	uint32_t rb, ag;
+
+	rb = (a & 0x00ff00ff) + (b & 0x00ff00ff);
+	rb |= 0x01000100 - ((rb >> 8) & 0x00ff00ff);
+	ag = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff);
+	ag |= 0x01000100 - ((ag >> 8) & 0x00ff00ff);
+	return (rb & 0x00ff00ff) | ((ag & 0x00ff00ff) << 8);
+}
+
+/* d * a / 255 for every channel of *d* */
+static inline uint32_t
+px_mul(uint32_t d, uint32_t a)
+{
+	uint32_t rb, ag;
+
+	rb = (d & 0x00ff00ff) * a + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	ag = ((d >> 8) & 0x00ff00ff) * a + 0x00800080;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	return rb | ag;
+}
+
+static inline uint32_t
+px_over(uint32_t s, uint32_t d)
+{
+	uint32_t ia;
+
+	ia = 255 - (s >> 24);
+	if (ia == 0)
+		return s;
+	return px_add_sat(s, px_mul(d, ia));
+}
+
+static void
+scalar_copy(uint32_t *dst, const uint32_t *src, int n)
+{
+	memcpy(dst, src, n * sizeof(*dst));
+}
+
+static void
+scalar_blend(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = px_over(src[i], dst[i]);
+}
+
+static void
+scalar_blend_solid(uint32_t *dst, const uint32_t *src, int n, uint32_t bg)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = px_over(src[i], bg);
+}
+
+/* without streaming stores plain copy is the best we can do */
+#define scalar_stream scalar_copy
+
+static void
+scalar_rotate(uint8_t *dst, int dst_pitch, const uint8_t *src,
+		long sx_step, long sy_step, int w, int h)
+{
+	const uint8_t *s;
+	uint32_t *d;
+	int x, y;
+
+	for (y = 0; y < h; y++, dst += dst_pitch, src += sy_step) {
+		d = (uint32_t *)dst;
+		for (x = 0, s = src; x < w; x++, s += sx_step)
+			d[x] = *(const uint32_t *)s;
+	}
+}
+
+/* (a + b + c + d) / 4 for every channel, rounded */
+static inline uint32_t
+px_avg4(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	uint32_t rb, ag;
+
+	rb = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) +
+		(d & 0x00ff00ff) + 0x00020002;
+	ag = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+		((c >> 8) & 0x00ff00ff) + ((d >> 8) & 0x00ff00ff) + 0x00020002;
+	return ((rb >> 2) & 0x00ff00ff) | ((ag << 6) & 0xff00ff00);
+}
+
+static void
+scalar_box2(uint32_t *dst, const uint8_t *src, int pitch, int n)
+{
+	const uint32_t *s0 = (const uint32_t *)src;
+	const uint32_t *s1 = (const uint32_t *)(src + pitch);
+	int i;
+
+	for (i = 0; i < n; i++, s0 += 2, s1 += 2)
+		dst[i] = px_avg4(s0[0], s0[1], s1[0], s1[1]);
+}
+
+/* a + (b - a) * f / 256 for every channel, 0 <= f <= 256 */
+static inline uint32_t
+px_lerp(uint32_t a, uint32_t b, uint32_t f)
+{
+	uint32_t rb, ag;
+
+	rb = (((a & 0x00ff00ff) * (256 - f) + (b & 0x00ff00ff) * f) >> 8) & 0x00ff00ff;
+	ag = (((a >> 8) & 0x00ff00ff) * (256 - f) + ((b >> 8) & 0x00ff00ff) * f) & 0xff00ff00;
+	return rb | ag;
+}
+
+static void
+scalar_lerp_v(uint32_t *dst, const uint32_t *s0, const uint32_t *s1,
+		int n, uint32_t f)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = px_lerp(s0[i], s1[i], f);
+}
+
+static void
+scalar_lerp_h(uint32_t *dst, const uint32_t *row, const int32_t *pos, int n)
+{
+	const uint32_t *s;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		s = row + (pos[i] >> 16);
+		dst[i] = px_lerp(s[0], s[1], (pos[i] >> 8) & 0xff);
+	}
+}
+
+static void
+scalar_gather(uint32_t *dst, const uint32_t *row, const int32_t *idx, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = row[idx[i]];
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * SSE2 kernels, 4 pixels per step.
+ * Every pixel is unpacked to 16 bit channels, multiplied by inverted
+ * source alpha and divided by 255 with (x + 128 + ((x + 128) >> 8)) >> 8.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_over(__m128i s, __m128i d)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(0x80);
+	__m128i ia, ialo, iahi, dlo, dhi;
+
+	ia = _mm_sub_epi32(_mm_set1_epi32(0xff), _mm_srli_epi32(s, 24));
+	ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+	ialo = _mm_unpacklo_epi32(ia, ia);
+	iahi = _mm_unpackhi_epi32(ia, ia);
+
+	dlo = _mm_unpacklo_epi8(d, zero);
+	dhi = _mm_unpackhi_epi8(d, zero);
+	dlo = _mm_add_epi16(_mm_mullo_epi16(dlo, ialo), half);
+	dhi = _mm_add_epi16(_mm_mullo_epi16(dhi, iahi), half);
+	dlo = _mm_srli_epi16(_mm_add_epi16(dlo, _mm_srli_epi16(dlo, 8)), 8);
+	dhi = _mm_srli_epi16(_mm_add_epi16(dhi, _mm_srli_epi16(dhi, 8)), 8);
+
+	return _mm_adds_epu8(s, _mm_packus_epi16(dlo, dhi));
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_copy(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m128i a, b, c, d;
+
+	for (; n >= 16; n -= 16, dst += 16, src += 16) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)src + 1);
+		c = _mm_loadu_si128((const __m128i *)src + 2);
+		d = _mm_loadu_si128((const __m128i *)src + 3);
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)dst + 1, b);
+		_mm_storeu_si128((__m128i *)dst + 2, c);
+		_mm_storeu_si128((__m128i *)dst + 3, d);
+	}
+	for (; n >= 4; n -= 4, dst += 4, src += 4) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dst, a);
+	}
+	scalar_copy(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_blend(uint32_t *dst, const uint32_t *src, int n)
+{
+	const __m128i amask = _mm_set1_epi32(ALPHA_MASK);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i s, d;
+
+	for (; n >= 4; n -= 4, dst += 4, src += 4) {
+		s = _mm_loadu_si128((const __m128i *)src);
+		// fully opaque and fully transparent pixels are common
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+				_mm_and_si128(s, amask), amask)) == 0xffff) {
+			_mm_storeu_si128((__m128i *)dst, s);
+			continue;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+			continue;
+		d = _mm_loadu_si128((const __m128i *)dst);
+		_mm_storeu_si128((__m128i *)dst, sse2_over(s, d));
+	}
+	scalar_blend(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_blend_solid(uint32_t *dst, const uint32_t *src, int n, uint32_t bg)
+{
+	const __m128i d = _mm_set1_epi32(bg);
+	__m128i s;
+
+	for (; n >= 4; n -= 4, dst += 4, src += 4) {
+		s = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dst, sse2_over(s, d));
+	}
+	scalar_blend_solid(dst, src, n, bg);
+}
+
+/* Stream stores need aligned destination, head is copied as usual */
+__attribute__((target("sse2")))
+static void
+sse2_stream(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m128i a, b;
+
+	for (; n > 0 && ((uintptr_t)dst & 15); n--)
+		*dst++ = *src++;
+	for (; n >= 8; n -= 8, dst += 8, src += 8) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		b = _mm_loadu_si128((const __m128i *)src + 1);
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)dst + 1, b);
+	}
+	for (; n >= 4; n -= 4, dst += 4, src += 4) {
+		a = _mm_loadu_si128((const __m128i *)src);
+		_mm_stream_si128((__m128i *)dst, a);
+	}
+	scalar_copy(dst, src, n);
+}
+
+/*
+ * Rotation by 4x4 blocks: 4 source pixels of one destination column
+ * are contiguous (sy_step is 4 or -4), blocks are transposed in
+ * registers and stored as rows.
+ */
+__attribute__((target("sse2")))
+static void
+sse2_rotate(uint8_t *dst, int dst_pitch, const uint8_t *src,
+		long sx_step, long sy_step, int w, int h)
+{
+	__m128i r0, r1, r2, r3, t0, t1, t2, t3;
+	const uint8_t *s;
+	uint8_t *d;
+	int x, y, w4;
+
+	if (sy_step != 4 && sy_step != -4) {
+		scalar_rotate(dst, dst_pitch, src, sx_step, sy_step, w, h);
+		return;
+	}
+	w4 = w & ~3;
+	for (y = 0; y + 4 <= h; y += 4) {
+		d = dst + dst_pitch * y;
+		s = src + sy_step * y;
+		// bottom up source column is loaded from its last pixel
+		if (sy_step < 0)
+			s -= 12;
+		for (x = 0; x < w4; x += 4, d += 16, s += 4 * sx_step) {
+			r0 = _mm_loadu_si128((const __m128i *)s);
+			r1 = _mm_loadu_si128((const __m128i *)(s + sx_step));
+			r2 = _mm_loadu_si128((const __m128i *)(s + 2 * sx_step));
+			r3 = _mm_loadu_si128((const __m128i *)(s + 3 * sx_step));
+			t0 = _mm_unpacklo_epi32(r0, r1);
+			t1 = _mm_unpacklo_epi32(r2, r3);
+			t2 = _mm_unpackhi_epi32(r0, r1);
+			t3 = _mm_unpackhi_epi32(r2, r3);
+			r0 = _mm_unpacklo_epi64(t0, t1);
+			r1 = _mm_unpackhi_epi64(t0, t1);
+			r2 = _mm_unpacklo_epi64(t2, t3);
+			r3 = _mm_unpackhi_epi64(t2, t3);
+			if (sy_step < 0) {
+				t0 = r0, r0 = r3, r3 = t0;
+				t1 = r1, r1 = r2, r2 = t1;
+			}
+			_mm_storeu_si128((__m128i *)d, r0);
+			_mm_storeu_si128((__m128i *)(d + dst_pitch), r1);
+			_mm_storeu_si128((__m128i *)(d + 2 * dst_pitch), r2);
+			_mm_storeu_si128((__m128i *)(d + 3 * dst_pitch), r3);
+		}
+		scalar_rotate(dst + dst_pitch * y + 4 * w4, dst_pitch,
+			src + sy_step * y + sx_step * w4, sx_step, sy_step,
+			w - w4, 4);
+	}
+	scalar_rotate(dst + dst_pitch * y, dst_pitch, src + sy_step * y,
+		sx_step, sy_step, w, h - y);
+}
+
+/*
+ * Channels of 2 columns of both rows are widened to 16 bits and summed,
+ * rounded once as in px_avg4(), 4 * 255 + 2 fits.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_avg4(__m128i r0, __m128i r1)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo, hi;
+
+	lo = _mm_add_epi16(_mm_unpacklo_epi8(r0, zero),
+		_mm_unpacklo_epi8(r1, zero));
+	hi = _mm_add_epi16(_mm_unpackhi_epi8(r0, zero),
+		_mm_unpackhi_epi8(r1, zero));
+	// even pixels in one half, odd ones in the other
+	lo = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+		_mm_unpackhi_epi64(lo, hi));
+	return _mm_srli_epi16(_mm_add_epi16(lo, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_box2(uint32_t *dst, const uint8_t *src, int pitch, int n)
+{
+	const __m128i *s0 = (const __m128i *)src;
+	const __m128i *s1 = (const __m128i *)(src + pitch);
+	__m128i x, y;
+
+	for (; n >= 4; n -= 4, dst += 4, s0 += 2, s1 += 2) {
+		x = sse2_avg4(_mm_loadu_si128(s0), _mm_loadu_si128(s1));
+		y = sse2_avg4(_mm_loadu_si128(s0 + 1), _mm_loadu_si128(s1 + 1));
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(x, y));
+	}
+	scalar_box2(dst, (const uint8_t *)s0, pitch, n);
+}
+
+/*
+ * Linear interpolation of 16 bit channels, weights of both sides sum
+ * up to 256, so products fit 16 bits and mullo works for unsigned.
+ */
+__attribute__((target("sse2")))
+static inline __m128i
+sse2_lerp16(__m128i a, __m128i b, __m128i wa, __m128i wb)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, wa),
+			_mm_mullo_epi16(b, wb)), 8);
+}
+
+__attribute__((target("sse2")))
+static void
+sse2_lerp_v(uint32_t *dst, const uint32_t *s0, const uint32_t *s1,
+		int n, uint32_t f)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16(256 - f);
+	const __m128i wb = _mm_set1_epi16(f);
+	__m128i a, b, lo, hi;
+
+	for (; n >= 4; n -= 4, dst += 4, s0 += 4, s1 += 4) {
+		a = _mm_loadu_si128((const __m128i *)s0);
+		b = _mm_loadu_si128((const __m128i *)s1);
+		lo = sse2_lerp16(_mm_unpacklo_epi8(a, zero),
+			_mm_unpacklo_epi8(b, zero), wa, wb);
+		hi = sse2_lerp16(_mm_unpackhi_epi8(a, zero),
+			_mm_unpackhi_epi8(b, zero), wa, wb);
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+	}
+	scalar_lerp_v(dst, s0, s1, n, f);
+}
+
+/* 2 pixels per step, pixel pairs are loaded as 64 bit values */
+__attribute__((target("sse2")))
+static void
+sse2_lerp_h(uint32_t *dst, const uint32_t *row, const int32_t *pos, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w256 = _mm_set1_epi16(256);
+	__m128i p, a, b, wa, wb;
+	int f0, f1;
+
+	for (; n >= 2; n -= 2, dst += 2, pos += 2) {
+		p = _mm_unpacklo_epi64(
+			_mm_loadl_epi64((const __m128i *)(row + (pos[0] >> 16))),
+			_mm_loadl_epi64((const __m128i *)(row + (pos[1] >> 16))));
+		a = _mm_unpacklo_epi8(_mm_shuffle_epi32(p, _MM_SHUFFLE(2, 0, 2, 0)), zero);
+		b = _mm_unpacklo_epi8(_mm_shuffle_epi32(p, _MM_SHUFFLE(3, 1, 3, 1)), zero);
+		f0 = (pos[0] >> 8) & 0xff;
+		f1 = (pos[1] >> 8) & 0xff;
+		wb = _mm_set_epi16(f1, f1, f1, f1, f0, f0, f0, f0);
+		wa = _mm_sub_epi16(w256, wb);
+		p = sse2_lerp16(a, b, wa, wb);
+		_mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(p, p));
+	}
+	scalar_lerp_h(dst, row, pos, n);
+}
+
+/*
+ * AVX2 kernels, 8 pixels per step. Unpack and pack instructions work
+ * inside 128 bit lanes, so pixel order is preserved.
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_over(__m256i s, __m256i d)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i half = _mm256_set1_epi16(0x80);
+	__m256i ia, ialo, iahi, dlo, dhi;
+
+	ia = _mm256_sub_epi32(_mm256_set1_epi32(0xff), _mm256_srli_epi32(s, 24));
+	ia = _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+	ialo = _mm256_unpacklo_epi32(ia, ia);
+	iahi = _mm256_unpackhi_epi32(ia, ia);
+
+	dlo = _mm256_unpacklo_epi8(d, zero);
+	dhi = _mm256_unpackhi_epi8(d, zero);
+	dlo = _mm256_add_epi16(_mm256_mullo_epi16(dlo, ialo), half);
+	dhi = _mm256_add_epi16(_mm256_mullo_epi16(dhi, iahi), half);
+	dlo = _mm256_srli_epi16(_mm256_add_epi16(dlo, _mm256_srli_epi16(dlo, 8)), 8);
+	dhi = _mm256_srli_epi16(_mm256_add_epi16(dhi, _mm256_srli_epi16(dhi, 8)), 8);
+
+	return _mm256_adds_epu8(s, _mm256_packus_epi16(dlo, dhi));
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_copy(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m256i a, b;
+
+	for (; n >= 16; n -= 16, dst += 16, src += 16) {
+		a = _mm256_loadu_si256((const __m256i *)src);
+		b = _mm256_loadu_si256((const __m256i *)src + 1);
+		_mm256_storeu_si256((__m256i *)dst, a);
+		_mm256_storeu_si256((__m256i *)dst + 1, b);
+	}
+	for (; n >= 8; n -= 8, dst += 8, src += 8) {
+		a = _mm256_loadu_si256((const __m256i *)src);
+		_mm256_storeu_si256((__m256i *)dst, a);
+	}
+	scalar_copy(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_blend(uint32_t *dst, const uint32_t *src, int n)
+{
+	const __m256i amask = _mm256_set1_epi32(ALPHA_MASK);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i s, d;
+
+	for (; n >= 8; n -= 8, dst += 8, src += 8) {
+		s = _mm256_loadu_si256((const __m256i *)src);
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(
+				_mm256_and_si256(s, amask), amask)) == 0xffffffffu) {
+			_mm256_storeu_si256((__m256i *)dst, s);
+			continue;
+		}
+		if ((uint32_t)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi32(s, zero)) == 0xffffffffu)
+			continue;
+		d = _mm256_loadu_si256((const __m256i *)dst);
+		_mm256_storeu_si256((__m256i *)dst, avx2_over(s, d));
+	}
+	scalar_blend(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_blend_solid(uint32_t *dst, const uint32_t *src, int n, uint32_t bg)
+{
+	const __m256i d = _mm256_set1_epi32(bg);
+	__m256i s;
+
+	for (; n >= 8; n -= 8, dst += 8, src += 8) {
+		s = _mm256_loadu_si256((const __m256i *)src);
+		_mm256_storeu_si256((__m256i *)dst, avx2_over(s, d));
+	}
+	scalar_blend_solid(dst, src, n, bg);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_stream(uint32_t *dst, const uint32_t *src, int n)
+{
+	__m256i a, b;
+
+	for (; n > 0 && ((uintptr_t)dst & 31); n--)
+		*dst++ = *src++;
+	for (; n >= 16; n -= 16, dst += 16, src += 16) {
+		a = _mm256_loadu_si256((const __m256i *)src);
+		b = _mm256_loadu_si256((const __m256i *)src + 1);
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)dst + 1, b);
+	}
+	for (; n >= 8; n -= 8, dst += 8, src += 8) {
+		a = _mm256_loadu_si256((const __m256i *)src);
+		_mm256_stream_si256((__m256i *)dst, a);
+	}
+	scalar_copy(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_lerp_v(uint32_t *dst, const uint32_t *s0, const uint32_t *s1,
+		int n, uint32_t f)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i wa = _mm256_set1_epi16(256 - f);
+	const __m256i wb = _mm256_set1_epi16(f);
+	__m256i a, b, lo, hi;
+
+	for (; n >= 8; n -= 8, dst += 8, s0 += 8, s1 += 8) {
+		a = _mm256_loadu_si256((const __m256i *)s0);
+		b = _mm256_loadu_si256((const __m256i *)s1);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), wa),
+			_mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), wb)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), wa),
+			_mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), wb)), 8);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(lo, hi));
+	}
+	scalar_lerp_v(dst, s0, s1, n, f);
+}
+
+__attribute__((target("avx2")))
+static void
+avx2_gather(uint32_t *dst, const uint32_t *row, const int32_t *idx, int n)
+{
+	__m256i i;
+
+	for (; n >= 8; n -= 8, dst += 8, idx += 8) {
+		i = _mm256_loadu_si256((const __m256i *)idx);
+		_mm256_storeu_si256((__m256i *)dst,
+			_mm256_i32gather_epi32((const int *)row, i, 4));
+	}
+	scalar_gather(dst, row, idx, n);
+}
+
+__attribute__((target("sse2")))
+static void
+blit_fence(void)
+{
+	_mm_sfence();
+}
+
+#else
+
+static void
+blit_fence(void)
+{
+}
+
+#endif // HAVE_X86_SIMD
+
+static const struct amcs_blit_ops blit_impls[] = {
+#ifdef HAVE_X86_SIMD
+	// gathers are slower than 4x4 transposes, AVX2 shares SSE2 rotation
+	{"avx2", avx2_copy, avx2_blend, avx2_blend_solid, avx2_stream,
+		sse2_rotate, sse2_box2, avx2_lerp_v, sse2_lerp_h, avx2_gather},
+	// SSE2 has no gathers, scalar loads are as fast
+	{"sse2", sse2_copy, sse2_blend, sse2_blend_solid, sse2_stream,
+		sse2_rotate, sse2_box2, sse2_lerp_v, sse2_lerp_h, scalar_gather},
+#endif
+	{"scalar", scalar_copy, scalar_blend, scalar_blend_solid, scalar_stream,
+		scalar_rotate, scalar_box2, scalar_lerp_v, scalar_lerp_h,
+		scalar_gather},
+};
+
+struct amcs_blit_ops amcs_blit = {
+	"scalar", scalar_copy, scalar_blend, scalar_blend_solid, scalar_stream,
+	scalar_rotate, scalar_box2, scalar_lerp_v, scalar_lerp_h, scalar_gather,
+};
+
+static bool
+blit_impl_supported(const struct amcs_blit_ops *ops)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (STREQ(ops->name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+	if (STREQ(ops->name, "sse2"))
+		return __builtin_cpu_supports("sse2");
+#endif
+	return true;
+}
+
+void
+amcs_blit_init(void)
+{
+	const char *force;
+	int i;
+
+	force = getenv("AMCS_BLIT");
+	for (i = 0; i < ARRSZ(blit_impls); i++) {
+		if (force && STRNEQ(force, blit_impls[i].name))
+			continue;
+		if (!blit_impl_supported(&blit_impls[i]))
+			continue;
+		amcs_blit = blit_impls[i];
+		debug("use %s blitter", amcs_blit.name);
+		return;
+	}
+	warning("blitter %s isn't available, use %s", force, amcs_blit.name);
+}
+
+void
+amcs_blit_rect(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch,
+		int w, int h, enum blit_op op, uint32_t bg)
+{
+	int i;
+
+	if (w <= 0 || h <= 0)
+		return;
+	// premultiplied source over black is the source itself
+	if (op == BLIT_BLEND_SOLID && bg == 0)
+		op = BLIT_COPY;
+	// contiguous rows, copy them at once
+	if (op == BLIT_COPY && dst_pitch == src_pitch && src_pitch == w * 4) {
+		amcs_blit.copy((uint32_t *)dst, (const uint32_t *)src, w * h);
+		return;
+	}
+
+	for (i = 0; i < h; i++, dst += dst_pitch, src += src_pitch) {
+		switch (op) {
+		case BLIT_COPY:
+			amcs_blit.copy((uint32_t *)dst, (const uint32_t *)src, w);
+			break;
+		case BLIT_BLEND:
+			amcs_blit.blend((uint32_t *)dst, (const uint32_t *)src, w);
+			break;
+		case BLIT_BLEND_SOLID:
+			amcs_blit.blend_solid((uint32_t *)dst,
+					(const uint32_t *)src, w, bg);
+			break;
+		}
+	}
+}
+
+void
+amcs_blit_stream_rect(uint8_t *dst, int dst_pitch, const uint8_t *src,
+		int src_pitch, int w, int h)
+{
+	int i;
+
+	if (w <= 0 || h <= 0)
+		return;
+	for (i = 0; i < h; i++, dst += dst_pitch, src += src_pitch)
+		amcs_blit.stream((uint32_t *)dst, (const uint32_t *)src, w);
+	// streaming stores are weakly ordered, flush them before page flip
+	blit_fence();
+}
+
+void
+amcs_blit_fill(uint8_t *dst, int dst_pitch, int w, int h, uint32_t color)
+{
+	uint32_t *row;
+	int i, j;
+
+	for (i = 0; i < h; i++, dst += dst_pitch) {
+		if (color == 0) {
+			memset(dst, 0, w * 4);
+			continue;
+		}
+		row = (uint32_t *)dst;
+		for (j = 0; j < w; j++)
+			row[j] = color;
+	}
+}
+
+// rotated copies are done by tiles of this size, 4K of every side
+#define ROTATE_TILE 32
+
+void
+amcs_blit_transform(uint8_t *dst, int dst_pitch, const uint8_t *src,
+		long sx_step, long sy_step, int w, int h)
+{
+	const uint32_t *s;
+	uint32_t *d;
+	int x, y, tw, th;
+
+	if (w <= 0 || h <= 0)
+		return;
+	// source rows are destination rows, maybe bottom up
+	if (sx_step == 4) {
+		for (y = 0; y < h; y++, dst += dst_pitch, src += sy_step)
+			amcs_blit.copy((uint32_t *)dst, (const uint32_t *)src, w);
+		return;
+	}
+	// mirrored rows
+	if (sx_step == -4) {
+		for (y = 0; y < h; y++, dst += dst_pitch, src += sy_step) {
+			d = (uint32_t *)dst;
+			s = (const uint32_t *)src;
+			for (x = 0; x < w; x++)
+				d[x] = *(s - x);
+		}
+		return;
+	}
+	for (y = 0; y < h; y += ROTATE_TILE) {
+		th = MIN(ROTATE_TILE, h - y);
+		for (x = 0; x < w; x += ROTATE_TILE) {
+			tw = MIN(ROTATE_TILE, w - x);
+			amcs_blit.rotate(dst + dst_pitch * y + 4 * x, dst_pitch,
+				src + sy_step * y + sx_step * x,
+				sx_step, sy_step, tw, th);
+		}
+	}
+}
+
+/* Average of *k* x *k* block for every destination pixel */
+static void
+scale_box(uint8_t *dst, int dst_pitch, int x, int y, int w, int h,
+		const uint8_t *src, int src_pitch, int k)
+{
+	const uint32_t *s;
+	uint32_t *d, p, n, sum[4];
+	int i, j, a, b;
+
+	if (k == 2) {
+		for (j = 0; j < h; j++) {
+			amcs_blit.box2((uint32_t *)(dst + dst_pitch * (y + j)) + x,
+				src + src_pitch * 2 * (y + j) + 4 * 2 * x,
+				src_pitch, w);
+		}
+		return;
+	}
+	n = k * k;
+	for (j = y; j < y + h; j++) {
+		d = (uint32_t *)(dst + dst_pitch * j);
+		for (i = x; i < x + w; i++) {
+			memset(sum, 0, sizeof(sum));
+			for (b = 0; b < k; b++) {
+				s = (const uint32_t *)(src + src_pitch * (j * k + b)) + i * k;
+				for (a = 0; a < k; a++) {
+					sum[0] += s[a] & 0xff;
+					sum[1] += (s[a] >> 8) & 0xff;
+					sum[2] += (s[a] >> 16) & 0xff;
+					sum[3] += s[a] >> 24;
+				}
+			}
+			for (a = 0, p = 0; a < 4; a++)
+				p |= (sum[a] + n / 2) / n << (8 * a);
+			d[i] = p;
+		}
+	}
+}
+
+/* Source pixel of destination pixel center */
+static inline int
+scale_idx(int i, int dn, int sn)
+{
+	return ((int64_t)i * 2 + 1) * sn / (2 * dn);
+}
+
+static void
+scale_nearest(uint8_t *dst, int dst_pitch, int dw, int dh,
+		int x, int y, int w, int h,
+		const uint8_t *src, int src_pitch, int sw, int sh)
+{
+	int32_t *idx;
+	int i, j;
+
+	idx = xmalloc(sizeof(*idx) * w);
+	for (i = 0; i < w; i++)
+		idx[i] = scale_idx(x + i, dw, sw);
+	for (j = y; j < y + h; j++) {
+		amcs_blit.gather((uint32_t *)(dst + dst_pitch * j) + x,
+			(const uint32_t *)(src + src_pitch * scale_idx(j, dh, sh)),
+			idx, w);
+	}
+	free(idx);
+}
+
+/* Source position of destination pixel center, 16.16 fixed point */
+static inline int32_t
+scale_pos(int i, int dn, int sn)
+{
+	int64_t v;
+
+	v = (((int64_t)i * 2 + 1) * sn << 16) / (2 * dn) - (1 << 15);
+	return MIN(MAX(v, 0), (int64_t)(sn - 1) << 16);
+}
+
+/*
+ * Rows are interpolated vertically into a temporary row first, it's
+ * contiguous and vectorizes well, then every destination pixel is
+ * interpolated from a pair of its pixels.
+ */
+static void
+scale_bilinear(uint8_t *dst, int dst_pitch, int dw, int dh,
+		int x, int y, int w, int h,
+		const uint8_t *src, int src_pitch, int sw, int sh)
+{
+	const uint32_t *s0, *s1, *row;
+	uint32_t *tmp, fy;
+	int32_t *pos, py;
+	int i, j, lo, n;
+
+	// source columns used by the destination part
+	lo = scale_pos(x, dw, sw) >> 16;
+	n = MIN((scale_pos(x + w - 1, dw, sw) >> 16) + 1, sw - 1) - lo + 1;
+	pos = xmalloc(sizeof(*pos) * w);
+	tmp = xmalloc(sizeof(*tmp) * (n + 1));
+	for (i = 0; i < w; i++)
+		pos[i] = scale_pos(x + i, dw, sw) - (lo << 16);
+
+	for (j = y; j < y + h; j++) {
+		py = scale_pos(j, dh, sh);
+		fy = (py >> 8) & 0xff;
+		s0 = (const uint32_t *)(src + src_pitch * (py >> 16)) + lo;
+		s1 = (const uint32_t *)(src + src_pitch *
+				MIN((py >> 16) + 1, sh - 1)) + lo;
+		if (fy == 0 && lo + n < sw) {
+			// exact source row, pixel after the last one exists
+			row = s0;
+		} else {
+			amcs_blit.lerp_v(tmp, s0, s1, n, fy);
+			// lerp_h reads the pair of the last pixel
+			tmp[n] = tmp[n - 1];
+			row = tmp;
+		}
+		amcs_blit.lerp_h((uint32_t *)(dst + dst_pitch * j) + x, row, pos, w);
+	}
+	free(pos);
+	free(tmp);
+}
+
+void
+amcs_blit_scale(uint8_t *dst, int dst_pitch, int dw, int dh,
+		int x, int y, int w, int h,
+		const uint8_t *src, int src_pitch, int sw, int sh,
+		enum scale_filter filter)
+{
+	if (w <= 0 || h <= 0 || sw <= 0 || sh <= 0)
+		return;
+	if (sw == dw && sh == dh)
+		amcs_blit_rect(dst + dst_pitch * y + 4 * x, dst_pitch,
+			src + src_pitch * y + 4 * x, src_pitch, w, h, BLIT_COPY, 0);
+	else if (sw % dw == 0 && sh % dh == 0 && sw / dw == sh / dh)
+		scale_box(dst, dst_pitch, x, y, w, h, src, src_pitch, sw / dw);
+	else if ((dw % sw == 0 && dh % sh == 0 && dw / sw == dh / sh) ||
+	    filter == SCALE_NEAREST)
+		scale_nearest(dst, dst_pitch, dw, dh, x, y, w, h,
+			src, src_pitch, sw, sh);
+	else
+		scale_bilinear(dst, dst_pitch, dw, dh, x, y, w, h,
+			src, src_pitch, sw, sh);
+}
@@ -0,0 +1,197 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <wayland-server.h>
+
+#include "blit.h"
+#include "format.h"
+#include "macro.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#endif
+
+#define OPAQUE 0xff000000u
+
+/*
+ * Pixel conversions into ARGB8888, *p* is a source pixel widened to 32
+ * bits. They are plain shifts and masks, so the same expression works
+ * on scalars and on GCC vectors of 32 bit lanes.
+ */
+#define PX_XBGR8888(p)	(((p) & 0x0000ff00) | (((p) >> 16) & 0xff) | \
+			 (((p) & 0xff) << 16) | OPAQUE)
+#define PX_ABGR8888(p)	(((p) & 0xff00ff00) | (((p) >> 16) & 0xff) | \
+			 (((p) & 0xff) << 16))
+#define PX_RGBX8888(p)	(((p) >> 8) | OPAQUE)
+#define PX_RGBA8888(p)	(((p) >> 8) | ((p) << 24))
+#define PX_BGRX8888(p)	((((p) & 0xff00) << 8) | (((p) >> 8) & 0xff00) | \
+			 ((p) >> 24) | OPAQUE)
+#define PX_BGRA8888(p)	(((p) << 24) | (((p) & 0xff00) << 8) | \
+			 (((p) >> 8) & 0xff00) | ((p) >> 24))
+// 5 and 6 bit channels, top bits are replicated into the low ones
+#define PX_RGB565(p)	((((p) & 0xf800) << 8) | (((p) & 0xe000) << 3) | \
+			 (((p) & 0x07e0) << 5) | (((p) & 0x0600) >> 1) | \
+			 (((p) & 0x001f) << 3) | (((p) & 0x001c) >> 2) | OPAQUE)
+// 10 bit channels are truncated, 2 bit alpha is scaled by 0x55
+#define PX_XRGB2101010(p) ((((p) >> 6) & 0xff0000) | (((p) >> 4) & 0xff00) | \
+			 (((p) >> 2) & 0xff) | OPAQUE)
+#define PX_ARGB2101010(p) ((((p) >> 6) & 0xff0000) | (((p) >> 4) & 0xff00) | \
+			 (((p) >> 2) & 0xff) | (((p) >> 30) * 0x55 << 24))
+#define PX_XBGR2101010(p) ((((p) << 14) & 0xff0000) | (((p) >> 4) & 0xff00) | \
+			 (((p) >> 22) & 0xff) | OPAQUE)
+#define PX_ABGR2101010(p) ((((p) << 14) & 0xff0000) | (((p) >> 4) & 0xff00) | \
+			 (((p) >> 22) & 0xff) | (((p) >> 30) * 0x55 << 24))
+
+#define SCALAR_CONVERTER(name, stype)					\
+static void								\
+scalar_##name(uint32_t *dst, const uint8_t *src, int n)		\
+{									\
+	const stype *s = (const stype *)src;				\
+	uint32_t p;							\
+	int i;								\
+									\
+	for (i = 0; i < n; i++) {					\
+		p = s[i];						\
+		dst[i] = PX_##name(p);					\
+	}								\
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * *lanes* pixels per step: source pixels are loaded unaligned, widened
+ * to 32 bit lanes and converted with the scalar expression, GCC emits
+ * SSE2/AVX2 shifts and masks. The tail is converted by the scalar code.
+ */
+#define SIMD_CONVERTER(isa, lanes, name, stype)				\
+__attribute__((target(#isa)))						\
+static void								\
+isa##_##name(uint32_t *dst, const uint8_t *src, int n)			\
+{									\
+	typedef stype vsrc __attribute__((vector_size(lanes * sizeof(stype)))); \
+	typedef uint32_t vpx __attribute__((vector_size(lanes * 4)));	\
+	vsrc s;								\
+	vpx p;								\
+									\
+	for (; n >= lanes; n -= lanes, dst += lanes,			\
+			src += lanes * sizeof(stype)) {			\
+		memcpy(&s, src, sizeof(s));				\
+		p = __builtin_convertvector(s, vpx);			\
+		p = PX_##name(p);					\
+		memcpy(dst, &p, sizeof(p));				\
+	}								\
+	scalar_##name(dst, src, n);					\
+}
+
+#define CONVERTER(name, stype)						\
+	SCALAR_CONVERTER(name, stype)					\
+	SIMD_CONVERTER(sse2, 4, name, stype)				\
+	SIMD_CONVERTER(avx2, 8, name, stype)
+#define IMPLS(name) scalar_##name, sse2_##name, avx2_##name
+#else
+#define CONVERTER(name, stype) SCALAR_CONVERTER(name, stype)
+#define IMPLS(name) scalar_##name, NULL, NULL
+#endif // HAVE_X86_SIMD
+
+CONVERTER(XBGR8888, uint32_t)
+CONVERTER(ABGR8888, uint32_t)
+CONVERTER(RGBX8888, uint32_t)
+CONVERTER(RGBA8888, uint32_t)
+CONVERTER(BGRX8888, uint32_t)
+CONVERTER(BGRA8888, uint32_t)
+CONVERTER(RGB565, uint16_t)
+CONVERTER(XRGB2101010, uint32_t)
+CONVERTER(ARGB2101010, uint32_t)
+CONVERTER(XBGR2101010, uint32_t)
+CONVERTER(ABGR2101010, uint32_t)
+
+/* 24 bit formats, byte order in memory: B, G, R and R, G, B */
+static void
+scalar_RGB888(uint32_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, src += 3)
+		dst[i] = OPAQUE | src[2] << 16 | src[1] << 8 | src[0];
+}
+
+static void
+scalar_BGR888(uint32_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, src += 3)
+		dst[i] = OPAQUE | src[0] << 16 | src[1] << 8 | src[2];
+}
+
+struct format_impl {
+	uint32_t format;
+	const char *name;
+	int bpp;
+	bool alpha;
+	amcs_convert_fn scalar, sse2, avx2;
+};
+
+#define FMT(name, bpp, alpha) \
+	{WL_SHM_FORMAT_##name, #name, bpp, alpha, IMPLS(name)}
+static const struct format_impl impls[] = {
+	// native, advertised by wl_display_init_shm()
+	{WL_SHM_FORMAT_ARGB8888, "ARGB8888", 4, true, NULL, NULL, NULL},
+	{WL_SHM_FORMAT_XRGB8888, "XRGB8888", 4, false, NULL, NULL, NULL},
+	FMT(XBGR8888, 4, false),
+	FMT(ABGR8888, 4, true),
+	FMT(RGBX8888, 4, false),
+	FMT(RGBA8888, 4, true),
+	FMT(BGRX8888, 4, false),
+	FMT(BGRA8888, 4, true),
+	FMT(RGB565, 2, false),
+	FMT(XRGB2101010, 4, false),
+	FMT(ARGB2101010, 4, true),
+	FMT(XBGR2101010, 4, false),
+	FMT(ABGR2101010, 4, true),
+	{WL_SHM_FORMAT_RGB888, "RGB888", 3, false, scalar_RGB888, NULL, NULL},
+	{WL_SHM_FORMAT_BGR888, "BGR888", 3, false, scalar_BGR888, NULL, NULL},
+};
+#undef FMT
+
+static struct amcs_format formats[ARRSZ(impls)];
+
+void
+amcs_format_init(void)
+{
+	const struct format_impl *impl;
+	int i;
+
+	for (i = 0; i < ARRSZ(impls); i++) {
+		impl = &impls[i];
+		formats[i] = (struct amcs_format) {
+			impl->format, impl->name, impl->bpp, impl->alpha,
+			impl->scalar,
+		};
+		// 24 bit formats have no vector converters
+		if (STREQ(amcs_blit.name, "avx2") && impl->avx2)
+			formats[i].convert = impl->avx2;
+		else if (!STREQ(amcs_blit.name, "scalar") && impl->sse2)
+			formats[i].convert = impl->sse2;
+	}
+	debug("%d shm formats, %s converters", (int)ARRSZ(impls), amcs_blit.name);
+}
+
+const struct amcs_format *
+amcs_format_get(uint32_t format)
+{
+	int i;
+
+	for (i = 0; i < ARRSZ(formats); i++) {
+		if (formats[i].format == format)
+			return &formats[i];
+	}
+	return NULL;
+}
+
+const struct amcs_format *
+amcs_format_list(int *n)
+{
+	*n = ARRSZ(formats);
+	return formats;
+}
@@ -0,0 +1,386 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <wayland-server-protocol.h>
+
+#include "input.h"
+#include "latency.h"
+#include "macro.h"
+
+#define XKB_STATE(st) (st == LIBINPUT_KEY_STATE_RELEASED ? XKB_KEY_UP : XKB_KEY_DOWN)
+#define XKB_KEY(k) (k + 8)
+
+#define CACHELINE 64
+
+static const struct {
+	const char *name;
+	uint32_t mask;
+} kb_mods[] = {
+	{XKB_MOD_NAME_CTRL, KB_CTRL},
+	{XKB_MOD_NAME_ALT, KB_ALT},
+	{XKB_MOD_NAME_SHIFT, KB_SHIFT},
+	{XKB_MOD_NAME_LOGO, KB_WIN},
+};
+
+struct amcs_input {
+	struct libinput *li;
+	struct xkb_keymap *keymap;
+	struct xkb_state *kbstate;	// touched by the thread only
+	xkb_mod_index_t mod_idx[ARRSZ(kb_mods)];	// looked up at keymap load
+	int ndevs;
+
+	pthread_t thread;
+	int wake_fd;			// eventfd, wakes the thread
+	int notify_fd;			// eventfd, wakes the main loop
+	bool stop;			// atomic
+	bool waiting;			// atomic, producer waits for free space
+	unsigned int layout_req;	// atomic, bumped by the main thread
+	unsigned int layout_done;
+
+	// producer and consumer indexes are on their own cache lines,
+	// they grow forever and are masked on access
+	uint32_t head __attribute__((aligned(CACHELINE)));
+	uint32_t tail __attribute__((aligned(CACHELINE)));
+	struct amcs_input_event ring[INPUT_RING_SIZE]
+		__attribute__((aligned(CACHELINE)));
+};
+
+static void
+fd_signal(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		warning("eventfd write: %s", strerror(errno));
+}
+
+static void
+fd_clear(int fd)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		warning("eventfd read: %s", strerror(errno));
+}
+
+/*
+ * Nothing is dropped: if the main thread lags behind by the whole ring,
+ * the thread sleeps until it takes a record, events are kept by libinput
+ * and the kernel meanwhile.
+ */
+static void
+ring_push(struct amcs_input *in, const struct amcs_input_event *ev)
+{
+	struct pollfd pfd = {in->wake_fd, POLLIN, 0};
+	uint32_t head = in->head;
+
+	while (head - __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE) ==
+			INPUT_RING_SIZE) {
+		if (__atomic_load_n(&in->stop, __ATOMIC_ACQUIRE)) {
+			// shutting down, the record is never taken
+			if (ev->type == INPUT_DEVICE_ADDED)
+				free(ev->device.name);
+			return;
+		}
+		fd_signal(in->notify_fd);
+		// pairs with the tail store and the check in amcs_input_pop()
+		__atomic_store_n(&in->waiting, true, __ATOMIC_SEQ_CST);
+		if (head - __atomic_load_n(&in->tail, __ATOMIC_SEQ_CST) ==
+				INPUT_RING_SIZE &&
+		    poll(&pfd, 1, -1) > 0)
+			fd_clear(in->wake_fd);
+		__atomic_store_n(&in->waiting, false, __ATOMIC_RELAXED);
+	}
+	in->ring[head & (INPUT_RING_SIZE - 1)] = *ev;
+	__atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool
+amcs_input_pop(struct amcs_input *in, struct amcs_input_event *ev)
+{
+	uint32_t tail = in->tail;
+
+	if (tail == __atomic_load_n(&in->head, __ATOMIC_ACQUIRE))
+		return false;
+	*ev = in->ring[tail & (INPUT_RING_SIZE - 1)];
+	__atomic_store_n(&in->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&in->waiting, __ATOMIC_SEQ_CST))
+		fd_signal(in->wake_fd);
+	return true;
+}
+
+static void
+mods_serialize(struct keyboard_modifiers_state *m, struct xkb_state *s)
+{
+	m->depressed = xkb_state_serialize_mods(s, XKB_STATE_MODS_DEPRESSED);
+	m->latched = xkb_state_serialize_mods(s, XKB_STATE_MODS_LATCHED);
+	m->locked = xkb_state_serialize_mods(s, XKB_STATE_MODS_LOCKED);
+	m->group = xkb_state_serialize_group(s, XKB_STATE_LAYOUT_EFFECTIVE);
+}
+
+static void
+ki_state_init(struct amcs_key_info *ki, struct amcs_input *in, uint32_t keysym,
+		uint32_t state)
+{
+	int i;
+
+	mods_serialize(&ki->mods, in->kbstate);
+	ki->keysym = keysym;
+	ki->state = state;
+	ki->modifiers = 0;
+
+	for (i = 0; i < ARRSZ(kb_mods); i++) {
+		if (in->mod_idx[i] != XKB_MOD_INVALID &&
+		    xkb_state_mod_index_is_active(in->kbstate, in->mod_idx[i],
+				XKB_STATE_MODS_DEPRESSED) > 0)
+			ki->modifiers |= kb_mods[i].mask;
+	}
+}
+
+/* Layout switches requested by the main thread */
+static void
+input_layout(struct amcs_input *in)
+{
+	struct amcs_input_event rec = {0};
+	struct keyboard_modifiers_state *m = &rec.mods;
+	unsigned int req;
+	int n;
+
+	req = __atomic_load_n(&in->layout_req, __ATOMIC_ACQUIRE);
+	if (req == in->layout_done)
+		return;
+	n = xkb_keymap_num_layouts(in->keymap);
+	mods_serialize(m, in->kbstate);
+	m->group = (m->group + (req - in->layout_done)) % MAX(n, 1);
+	in->layout_done = req;
+	xkb_state_update_mask(in->kbstate,
+		m->depressed, m->latched, m->locked, 0, 0, m->group);
+	rec.type = INPUT_MODIFIERS;
+	rec.read_usec = amcs_lat_now();
+	ring_push(in, &rec);
+}
+
+static int
+get_dev_caps(struct libinput_device *dev)
+{
+	int res = 0;
+	if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_KEYBOARD))
+		res |= WL_SEAT_CAPABILITY_KEYBOARD;
+	if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_POINTER))
+		res |= WL_SEAT_CAPABILITY_POINTER;;
+	return res;
+}
+
+static void
+input_pointer(struct libinput_event *ev, struct amcs_input_event *rec)
+{
+	static const enum libinput_pointer_axis axes[] = {
+		LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL,
+		LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL,
+	};
+	struct libinput_event_pointer *p;
+	int i;
+
+	p = libinput_event_get_pointer_event(ev);
+	rec->time_usec = libinput_event_pointer_get_time_usec(p);
+	switch (libinput_event_get_type(ev)) {
+	case LIBINPUT_EVENT_POINTER_MOTION:
+		rec->type = INPUT_MOTION;
+		rec->motion.dx = libinput_event_pointer_get_dx(p);
+		rec->motion.dy = libinput_event_pointer_get_dy(p);
+		break;
+	case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE:
+		// output size is known by the main thread only
+		rec->type = INPUT_MOTION_ABSOLUTE;
+		rec->abs.x = libinput_event_pointer_get_absolute_x_transformed(p, 1);
+		rec->abs.y = libinput_event_pointer_get_absolute_y_transformed(p, 1);
+		break;
+	case LIBINPUT_EVENT_POINTER_BUTTON:
+		rec->type = INPUT_BUTTON;
+		rec->button.button = libinput_event_pointer_get_button(p);
+		rec->button.state = libinput_event_pointer_get_button_state(p);
+		break;
+	default:
+		rec->type = INPUT_AXIS;
+		for (i = 0; i < ARRSZ(axes); i++) {
+			if (!libinput_event_pointer_has_axis(p, axes[i]))
+				continue;
+			rec->axis.mask |= 1 << axes[i];
+			rec->axis.value[axes[i]] =
+				libinput_event_pointer_get_axis_value(p, axes[i]);
+		}
+		break;
+	}
+}
+
+/* False if *ev* has no record */
+static bool
+input_translate(struct amcs_input *in, struct libinput_event *ev,
+		struct amcs_input_event *rec)
+{
+	struct libinput_event_keyboard *k;
+	struct libinput_device *dev;
+	xkb_keysym_t keysym;
+	char name[128];
+	uint32_t key, state;
+
+	memset(rec, 0, sizeof(*rec));
+	dev = libinput_event_get_device(ev);
+	switch (libinput_event_get_type(ev)) {
+	case LIBINPUT_EVENT_DEVICE_ADDED:
+		debug("device added sysname = %s, name %s",
+				libinput_device_get_sysname(dev),
+				libinput_device_get_name(dev));
+		snprintf(name, sizeof(name), "%s (%s)",
+				libinput_device_get_name(dev),
+				libinput_device_get_sysname(dev));
+		rec->type = INPUT_DEVICE_ADDED;
+		rec->device.name = strdup(name);
+		rec->device.caps = get_dev_caps(dev);
+		libinput_device_set_user_data(dev, (void *)(uintptr_t)in->ndevs++);
+		break;
+	case LIBINPUT_EVENT_DEVICE_REMOVED:
+		debug("device removed");
+		return false;
+	case LIBINPUT_EVENT_KEYBOARD_KEY:
+		k = libinput_event_get_keyboard_event(ev);
+		key = libinput_event_keyboard_get_key(k);
+		state = libinput_event_keyboard_get_key_state(k);
+		xkb_state_update_key(in->kbstate, XKB_KEY(key), XKB_STATE(state));
+		keysym = xkb_state_key_get_one_sym(in->kbstate, XKB_KEY(key));
+		rec->type = INPUT_KEY;
+		rec->time_usec = libinput_event_keyboard_get_time_usec(k);
+		rec->key.key = key;
+		ki_state_init(&rec->key.ki, in, keysym, state);
+		break;
+	case LIBINPUT_EVENT_POINTER_MOTION:
+	case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE:
+	case LIBINPUT_EVENT_POINTER_BUTTON:
+	case LIBINPUT_EVENT_POINTER_AXIS:
+		input_pointer(ev, rec);
+		break;
+	default:
+		debug("next input event %p, type = %d", ev,
+				libinput_event_get_type(ev));
+		return false;
+	}
+	rec->dev = (uintptr_t)libinput_device_get_user_data(dev);
+	rec->read_usec = amcs_lat_now();
+	return true;
+}
+
+static void *
+input_main(void *data)
+{
+	struct amcs_input *in = data;
+	struct pollfd fds[] = {
+		{libinput_get_fd(in->li), POLLIN, 0},
+		{in->wake_fd, POLLIN, 0},
+	};
+	struct amcs_input_event rec;
+	struct libinput_event *ev;
+	uint32_t head;
+
+	while (!__atomic_load_n(&in->stop, __ATOMIC_ACQUIRE)) {
+		if (poll(fds, ARRSZ(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			warning("input poll: %s", strerror(errno));
+			break;
+		}
+		head = in->head;
+		if (fds[1].revents & POLLIN)
+			fd_clear(in->wake_fd);
+		// a wakeup may be taken by ring_push(), requests are counted
+		input_layout(in);
+		if (fds[0].revents & POLLIN) {
+			libinput_dispatch(in->li);
+			while ((ev = libinput_get_event(in->li)) != NULL) {
+				if (input_translate(in, ev, &rec))
+					ring_push(in, &rec);
+				libinput_event_destroy(ev);
+			}
+		}
+		// one wakeup per batch
+		if (in->head != head)
+			fd_signal(in->notify_fd);
+	}
+	return NULL;
+}
+
+struct amcs_input *
+amcs_input_new(struct libinput *li, struct xkb_keymap *keymap)
+{
+	struct amcs_input *in;
+	sigset_t set, old;
+	int i;
+
+	in = xmalloc(sizeof(*in));
+	memset(in, 0, sizeof(*in));
+	in->li = li;
+	in->keymap = keymap;
+	in->kbstate = xkb_state_new(keymap);
+	assert(in->kbstate && "can't create keyboard state");
+	for (i = 0; i < ARRSZ(kb_mods); i++)
+		in->mod_idx[i] = xkb_keymap_mod_get_index(keymap, kb_mods[i].name);
+	in->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	in->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (in->wake_fd < 0 || in->notify_fd < 0)
+		error(1, "can't create eventfd");
+
+	// same as workers, asynchronous signals go to the main thread
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&in->thread, NULL, input_main, in))
+		error(1, "can't create input thread");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return in;
+}
+
+void
+amcs_input_free(struct amcs_input *in)
+{
+	if (in == NULL)
+		return;
+	__atomic_store_n(&in->stop, true, __ATOMIC_RELEASE);
+	fd_signal(in->wake_fd);
+	pthread_join(in->thread, NULL);
+	close(in->wake_fd);
+	close(in->notify_fd);
+	xkb_state_unref(in->kbstate);
+	free(in);
+}
+
+int
+amcs_input_fd(struct amcs_input *in)
+{
+	return in->notify_fd;
+}
+
+void
+amcs_input_drain(struct amcs_input *in)
+{
+	fd_clear(in->notify_fd);
+}
+
+void
+amcs_input_layout_next(struct amcs_input *in)
+{
+	__atomic_add_fetch(&in->layout_req, 1, __ATOMIC_RELEASE);
+	fd_signal(in->wake_fd);
+}
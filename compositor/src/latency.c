@@ -0,0 +1,220 @@
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <wayland-server-core.h>
+
+#include "latency.h"
+#include "macro.h"
+#include "vector.h"
+
+struct amcs_lat_dev {
+	char *name;
+	struct amcs_hist hist[LAT_NSTAGES];
+};
+
+static const char *stage_names[LAT_NSTAGES] = {
+	"kernel", "dispatch", "flush", "total",
+};
+
+static bool lat_ready;
+static pvector lat_devs;		// struct amcs_lat_dev *
+static vector lat_pending;		// struct amcs_lat_sample, not flushed yet
+static struct wl_event_source *lat_signal;
+
+uint64_t
+amcs_lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+hist_idx(uint32_t v)
+{
+	int shift;
+
+	if (v < 2 * LAT_SUB)
+		return v;
+	// top LAT_SUB_BITS + 1 bits of the value
+	shift = 31 - __builtin_clz(v) - LAT_SUB_BITS;
+	return shift * LAT_SUB + (v >> shift);
+}
+
+/* Lowest value of the bucket */
+static uint64_t
+hist_value(int idx)
+{
+	int shift;
+
+	if (idx < 2 * LAT_SUB)
+		return idx;
+	shift = idx / LAT_SUB - 1;
+	return (uint64_t)(idx - shift * LAT_SUB) << shift;
+}
+
+void
+amcs_hist_add(struct amcs_hist *h, uint64_t usec)
+{
+	h->count++;
+	h->sum += usec;
+	h->max = MAX(h->max, usec);
+	h->buckets[hist_idx(MIN(usec, UINT32_MAX))]++;
+}
+
+uint64_t
+amcs_hist_quantile(const struct amcs_hist *h, double q)
+{
+	uint64_t target, n = 0;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	target = MAX((uint64_t)(q * h->count + 0.5), 1);
+	for (i = 0; i < LAT_NBUCKETS; i++) {
+		n += h->buckets[i];
+		// the highest value of the bucket, never above the real max
+		if (n >= target)
+			return MIN(hist_value(i + 1) - 1, h->max);
+	}
+	return h->max;
+}
+
+static void
+lat_add(struct amcs_lat_dev *d, enum lat_stage stage, uint64_t from, uint64_t to)
+{
+	amcs_hist_add(&d->hist[stage], to > from ? to - from : 0);
+}
+
+struct amcs_lat_dev *
+amcs_lat_dev_new(const char *name)
+{
+	struct amcs_lat_dev *d;
+
+	if (!lat_ready)
+		return NULL;
+	d = xmalloc(sizeof(*d));
+	memset(d, 0, sizeof(*d));
+	d->name = strdup(name ? name : "unknown");
+	pvector_push(&lat_devs, d);
+	return d;
+}
+
+void
+amcs_lat_event(struct amcs_lat_sample *s, struct amcs_lat_dev *dev,
+		uint64_t kernel_usec, uint64_t dispatch_usec)
+{
+	s->dev = dev;
+	s->kernel = kernel_usec;
+	s->dispatch = dispatch_usec;
+	s->queued = 0;
+	if (dev == NULL)
+		return;
+	lat_add(dev, LAT_KERNEL, s->kernel, s->dispatch);
+}
+
+void
+amcs_lat_queued(const struct amcs_lat_sample *s)
+{
+	struct amcs_lat_sample q;
+
+	if (s->dev == NULL)
+		return;
+	q = *s;
+	q.queued = amcs_lat_now();
+	lat_add(q.dev, LAT_DISPATCH, q.dispatch, q.queued);
+	vector_push(&lat_pending, &q);
+}
+
+void
+amcs_lat_flushed(void)
+{
+	struct amcs_lat_sample *s;
+	uint64_t now;
+	int i;
+
+	if (!lat_ready || vector_len(&lat_pending) == 0)
+		return;
+	now = amcs_lat_now();
+	s = vector_data(&lat_pending);
+	for (i = 0; i < vector_len(&lat_pending); i++) {
+		lat_add(s[i].dev, LAT_FLUSH, s[i].queued, now);
+		lat_add(s[i].dev, LAT_TOTAL, s[i].kernel, now);
+	}
+	vector_clear(&lat_pending);
+}
+
+void
+amcs_lat_dump(FILE *f)
+{
+	struct amcs_lat_dev *d;
+	const struct amcs_hist *h;
+	int i, k;
+
+	fprintf(f, "input latency, microseconds\n");
+	pvector_for_each(i, d, &lat_devs) {
+		for (k = 0; k < LAT_NSTAGES; k++) {
+			h = &d->hist[k];
+			if (h->count == 0)
+				continue;
+			fprintf(f, "%s: %-8s n %llu mean %llu p50 %llu p90 %llu "
+				"p99 %llu p99.9 %llu max %llu\n",
+				d->name, stage_names[k],
+				(unsigned long long)h->count,
+				(unsigned long long)(h->sum / h->count),
+				(unsigned long long)amcs_hist_quantile(h, 0.5),
+				(unsigned long long)amcs_hist_quantile(h, 0.9),
+				(unsigned long long)amcs_hist_quantile(h, 0.99),
+				(unsigned long long)amcs_hist_quantile(h, 0.999),
+				(unsigned long long)h->max);
+		}
+	}
+	fflush(f);
+}
+
+static int
+lat_dump_signal(int signum, void *data)
+{
+	amcs_lat_dump(stderr);
+	return 0;
+}
+
+int
+amcs_lat_init(struct wl_event_loop *loop)
+{
+	pvector_init(&lat_devs, xrealloc);
+	vector_init(&lat_pending, sizeof(struct amcs_lat_sample), xrealloc);
+	lat_ready = true;
+	// signalfd, the dump runs in the event loop
+	lat_signal = wl_event_loop_add_signal(loop, LAT_DUMP_SIGNAL,
+			lat_dump_signal, NULL);
+	if (lat_signal == NULL) {
+		warning("can't watch latency dump signal");
+		return 1;
+	}
+	return 0;
+}
+
+void
+amcs_lat_finalize(void)
+{
+	struct amcs_lat_dev *d;
+	int i;
+
+	if (!lat_ready)
+		return;
+	if (lat_signal)
+		wl_event_source_remove(lat_signal);
+	lat_signal = NULL;
+	pvector_for_each(i, d, &lat_devs) {
+		free(d->name);
+		free(d);
+	}
+	pvector_free(&lat_devs);
+	vector_free(&lat_pending);
+	lat_ready = false;
+}
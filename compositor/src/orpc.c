@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -43,6 +44,10 @@
 int drm_fds[16];
 int n_drm_fds;
 
+// requests come from the main and the input threads, each one waits
+// for its own reply
+static pthread_mutex_t orpc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* handles commands like 'o OPEN_FLAG FPATH' */
 static int
 handle_file_open(struct amcs_orpc *ctx, char *buf, ssize_t bufsz)
@@ -277,8 +282,8 @@ orpc_run(struct amcs_orpc *ctx)
 	return 0;
 }
 
-int
-orpc_open(struct amcs_orpc *ctx, const char *file, int flags)
+static int
+request_open(struct amcs_orpc *ctx, const char *file, int flags)
 {
 	struct msghdr msg = {0};
 	struct cmsghdr *cmsg;
@@ -320,6 +325,17 @@ orpc_open(struct amcs_orpc *ctx, const char *file, int flags)
 	return newfd;
 }
 
+int
+orpc_open(struct amcs_orpc *ctx, const char *file, int flags)
+{
+	int fd;
+
+	pthread_mutex_lock(&orpc_lock);
+	fd = request_open(ctx, file, flags);
+	pthread_mutex_unlock(&orpc_lock);
+	return fd;
+}
+
 struct tty_handlers {
 	orpc_handler_t start;
 	orpc_handler_t stop;
@@ -333,7 +349,12 @@ notify_tty_status(int fd, uint32_t mask, void *data)
 	ssize_t sz;
 
 	debug("");
-	sz = read(fd, buf, sizeof(buf));
+	// the socket may have been readable with a reply to orpc_open()
+	pthread_mutex_lock(&orpc_lock);
+	sz = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	pthread_mutex_unlock(&orpc_lock);
+	if (sz < 0 && errno == EAGAIN)
+		return 0;
 	if (sz < 1)
 		error(1, "can't read event info");
 	switch (buf[0]) {
@@ -1,20 +1,43 @@
 #include <assert.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
 
 #include "orpc.h"
 #include "amcs_drm.h"
+#include "blit.h"
+#include "format.h"
+#include "transform.h"
 #include "wl-server.h"
 #include "macro.h"
 #include "output.h"
+#include "region.h"
 #include "udev.h"
+#include "workers.h"
 #include "common.h"
 
 #define DEFAULT_SURFSZ 1024
+// 60Hz
+#define DEFAULT_REFRESH_NSEC 16666667
+// milliseconds before vblank, when repaint starts
+#define DEFAULT_REPAINT_WINDOW 7
+// milliseconds to wait for clients to redraw resized windows
+#define DEFAULT_CONFIGURE_TIMEOUT 100
 
 #define DRIPATH "/dev/dri/"
 
+// damage area in pixels, below it composition isn't split between threads
+#define PARALLEL_MIN_AREA (512 * 512)
+// stripe height granularity
+#define STRIPE_ALIGN 16
+#define MAX_THREADS 16
+#define MAX_SCALE 4
+#define ALIGN_UP(v, a) (((v) + (a) - 1) / (a) * (a))
+
 static void
 update_screen_state(const char *name, int status)
 {
@@ -24,12 +47,157 @@ update_screen_state(const char *name, int status)
 		debug("EVENT: %s: disconnected", name);
 }
 
+static inline int64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* Duration of a single frame for the screen mode */
+static int64_t
+mode_refresh_nsec(const drmModeModeInfo *mode)
+{
+	if (mode->clock && mode->htotal && mode->vtotal)
+		return (int64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+	if (mode->vrefresh)
+		return 1000000000 / mode->vrefresh;
+	return DEFAULT_REFRESH_NSEC;
+}
+
+static void screen_repaint(struct amcs_screen *screen);
+static void screen_set_cursor(struct amcs_screen *screen);
+
+static void
+screen_idle_repaint(void *data)
+{
+	struct amcs_screen *screen = data;
+
+	screen->idle = NULL;
+	screen_repaint(screen);
+}
+
+static int
+screen_timer_repaint(void *data)
+{
+	struct amcs_screen *screen = data;
+
+	screen_repaint(screen);
+	return 0;
+}
+
+/* Start repaint as soon as possible, used when nothing is on the fly */
+static void
+screen_schedule_repaint(struct amcs_screen *screen)
+{
+	if (screen->state != REPAINT_IDLE)
+		return;
+	if (amcs_region_empty(&screen->damage) && !screen->frame_requested &&
+	    !screen->cursor_dirty)
+		return;
+	screen->idle = wl_event_loop_add_idle(compositor_ctx.evloop,
+			screen_idle_repaint, screen);
+	screen->state = REPAINT_SCHEDULED;
+}
+
+/*
+ * Frame was presented. Start the next repaint *repaint_window*
+ * milliseconds before the next vblank, so clients get the latest
+ * possible deadline for their updates.
+ */
+static void
+screen_frame_done(struct amcs_screen *screen, const struct timespec *ts)
+{
+	struct timespec now;
+	int64_t next, delay;
+
+	screen->state = REPAINT_IDLE;
+	screen->last_present = *ts;
+	wl_signal_emit(&screen->out->present_sig, screen);
+
+	// nothing changed, leave the screen alone
+	if (amcs_region_empty(&screen->damage) && !screen->frame_requested &&
+	    !screen->cursor_dirty)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next = timespec_to_nsec(&screen->last_present) + screen->refresh_nsec -
+		(int64_t)screen->out->repaint_window * 1000000;
+	delay = (next - timespec_to_nsec(&now)) / 1000000;
+	if (delay < 1) {
+		screen_schedule_repaint(screen);
+		return;
+	}
+	wl_event_source_timer_update(screen->timer, delay);
+	screen->state = REPAINT_SCHEDULED;
+}
+
+static void
+screen_flip_done(amcs_drm_dev *dev, unsigned int sec, unsigned int usec,
+		void *opaq)
+{
+	struct amcs_screen *screen = opaq;
+	struct timespec ts;
+
+	debug("flip done %u.%06u", sec, usec);
+	// queued frame wasn't flipped, draw it again
+	if (dev->frame_lost) {
+		dev->frame_lost = false;
+		amcs_region_add(&screen->damage, 0, 0, screen->w, screen->h);
+	}
+	ts.tv_sec = sec;
+	ts.tv_nsec = usec * 1000;
+	screen_frame_done(screen, &ts);
+}
+
+/* Estimated vblank of a frame without page flip */
+static int
+screen_vblank_done(void *data)
+{
+	struct amcs_screen *screen = data;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	screen_frame_done(screen, &now);
+	return 0;
+}
+
+/*
+ * Nothing to draw, but clients wait for frame callbacks. Pretend
+ * the frame is presented at the next vblank to keep them throttled.
+ */
+static void
+screen_skip_frame(struct amcs_screen *screen)
+{
+	struct timespec now;
+	int64_t last, cur, delay;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	last = timespec_to_nsec(&screen->last_present);
+	cur = timespec_to_nsec(&now);
+	delay = screen->refresh_nsec;
+	if (last != 0 && cur > last)
+		delay -= (cur - last) % screen->refresh_nsec;
+	wl_event_source_timer_update(screen->vblank_timer,
+			MAX(delay / 1000000, 1));
+	screen->state = REPAINT_AWAITING_FLIP;
+}
+
+static int
+drm_event_cb(int fd, uint32_t mask, void *data)
+{
+	amcs_drm_card *card = data;
+
+	amcs_drm_handle_events(card);
+	return 0;
+}
+
 static int
 amcs_output_screens_add(struct amcs_output *out, const char *path)
 {
 	amcs_drm_card *card;
 	amcs_drm_dev_list *dev_list;
 	struct amcs_screen *screen;
+	int i;
 
 	assert(out && path);
 
@@ -37,16 +205,44 @@ amcs_output_screens_add(struct amcs_output *out, const char *path)
 		return 1;
 	}
 	pvector_push(&out->cards, card);
+	card->source = wl_event_loop_add_fd(compositor_ctx.evloop, card->fd,
+			WL_EVENT_READABLE, drm_event_cb, card);
 	dev_list = card->list;
 
 	while (dev_list) {
 		screen = xmalloc(sizeof(*screen));
 		memset(screen, 0, sizeof(*screen));
-		screen->w = dev_list->w;
-		screen->h = dev_list->h;
+		screen->transform = out->transform;
+		amcs_transform_size(screen->transform, dev_list->w, dev_list->h,
+				&screen->w, &screen->h);
+		screen->fb_pitch = dev_list->pitch;
 		screen->pitch = dev_list->pitch;
-		screen->buf = dev_list->buf;
+		if (screen->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+			screen->pitch = screen->w * 4;
+		screen->out = out;
+		screen->card = card;
+		screen->dev = dev_list;
+		screen->refresh_nsec = mode_refresh_nsec(&dev_list->mode);
+		if (out->shadowfb ||
+		    screen->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+			screen->shadow = xmalloc(screen->pitch * screen->h);
+		screen->timer = wl_event_loop_add_timer(compositor_ctx.evloop,
+				screen_timer_repaint, screen);
+		screen->vblank_timer = wl_event_loop_add_timer(
+				compositor_ctx.evloop, screen_vblank_done, screen);
+		wl_list_init(&screen->frame_cbs);
+		amcs_region_init(&screen->damage);
+		// nothing is drawn yet
+		amcs_region_add(&screen->damage, 0, 0, screen->w, screen->h);
+		for (i = 0; i < AMCS_DRM_NBUFS; i++) {
+			amcs_region_init(&screen->fb_damage[i]);
+			amcs_region_add(&screen->fb_damage[i], 0, 0,
+					screen->w, screen->h);
+		}
+		dev_list->flip_cb = screen_flip_done;
+		dev_list->flip_opaq = screen;
 		pvector_push(&out->screens, screen);
+		screen_schedule_repaint(screen);
 		dev_list = dev_list->next;
 	}
 	return 0;
@@ -57,22 +253,61 @@ amcs_output_screens_free(struct amcs_output *out)
 {
 	amcs_drm_card *card;
 	struct amcs_screen *screen;
-	int i;
+	struct wl_resource *res, *tmp;
+	struct timespec now;
+	uint32_t msec;
+	int i, j;
 
+	// planes are gone with their cards
+	out->scene_dirty = true;
 	pvector_for_each(i, card, &out->cards) {
+		if (card->source)
+			wl_event_source_remove(card->source);
 		amcs_drm_free(card);
 	}
 	pvector_clear(&out->cards);
 	pvector_for_each(i, screen, &out->screens) {
+		if (screen->timer)
+			wl_event_source_remove(screen->timer);
+		if (screen->idle)
+			wl_event_source_remove(screen->idle);
+		if (screen->vblank_timer)
+			wl_event_source_remove(screen->vblank_timer);
+		// don't leave clients waiting for a frame which never comes
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		msec = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		wl_resource_for_each_safe(res, tmp, &screen->frame_cbs) {
+			wl_callback_send_done(res, msec);
+			wl_resource_destroy(res);
+		}
+		amcs_region_fini(&screen->damage);
+		for (j = 0; j < AMCS_DRM_NBUFS; j++)
+			amcs_region_fini(&screen->fb_damage[j]);
+		free(screen->shadow);
 		free(screen);
 	}
 	pvector_clear(&out->screens);
 }
 
+static int
+output_freeze_timeout(void *data)
+{
+	struct amcs_output *out = data;
+
+	warning("clients didn't redraw in %d ms, show layout as is",
+			out->configure_timeout);
+	// otherwise every later layout change waits for the stuck client
+	amcs_workspace_configure_expire(out->ws);
+	amcs_output_thaw(out);
+	return 0;
+}
+
 struct amcs_output *
 amcs_output_new()
 {
 	struct amcs_output *res;
+	const char *env;
+	int nthreads;
 
 	res = xmalloc(sizeof(*res));
 	memset(res, 0, sizeof(*res));
@@ -80,6 +315,30 @@ amcs_output_new()
 	pvector_init(&res->screens, xrealloc);
 	res->w = DEFAULT_SURFSZ;
 	res->h = DEFAULT_SURFSZ;
+	res->repaint_window = DEFAULT_REPAINT_WINDOW;
+	if ((env = getenv("AMCS_REPAINT_WINDOW")) != NULL)
+		res->repaint_window = atoi(env);
+	res->shadowfb = getenv("AMCS_SHADOWFB") != NULL;
+	res->scale = 1;
+	if ((env = getenv("AMCS_OUTPUT_SCALE")) != NULL)
+		res->scale = MIN(MAX(atoi(env), 1), MAX_SCALE);
+	if ((env = getenv("AMCS_OUTPUT_TRANSFORM")) != NULL)
+		res->transform = atoi(env) & 7;
+	res->configure_timeout = DEFAULT_CONFIGURE_TIMEOUT;
+	if ((env = getenv("AMCS_CONFIGURE_TIMEOUT")) != NULL)
+		res->configure_timeout = atoi(env);
+	res->freeze_timer = wl_event_loop_add_timer(compositor_ctx.evloop,
+			output_freeze_timeout, res);
+	if ((env = getenv("AMCS_THREADS")) != NULL)
+		nthreads = atoi(env);
+	else
+		nthreads = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_THREADS);
+	if (nthreads > 1)
+		res->workers = amcs_workers_new(nthreads);
+	vector_init(&res->scene, sizeof(struct amcs_draw), xrealloc);
+	res->scene_dirty = true;
+	wl_signal_init(&res->frame_sig);
+	wl_signal_init(&res->present_sig);
 	return res;
 }
 
@@ -106,10 +365,19 @@ amcs_output_reload(struct amcs_output *out)
 		return 1;
 	}
 
-	screen = pvector_get(&out->screens, 0);
-	//TODO: use additional screens
-	out->w = screen->w;
-	out->h = screen->h;
+	// screens are placed left to right in enumeration order,
+	// output is their bounding box
+	out->w = out->h = 0;
+	pvector_for_each(i, screen, &out->screens) {
+		screen->x = out->w;
+		screen->y = 0;
+		out->w += screen->w;
+		out->h = MAX(out->h, screen->h);
+		debug("screen %d: %dx%d+%d+%d", i, screen->w, screen->h,
+				screen->x, screen->y);
+	}
+	pvector_for_each(i, screen, &out->screens)
+		screen_set_cursor(screen);
 	return 0;
 }
 
@@ -124,62 +392,935 @@ amcs_output_release(struct amcs_output *out)
 void
 amcs_output_send_info(struct amcs_output *out, struct wl_resource *resource)
 {
-	wl_output_send_geometry(resource, 0, 0, out->w, out->h, 0,
-			"unknown", "unknown", WL_OUTPUT_TRANSFORM_NORMAL);
-	wl_output_send_mode(resource, 0, out->w, out->h, 60);
-	wl_output_send_scale(resource, 1);
+	int w, h;
+
+	// mode is in scanout pixels, layout is rotated
+	amcs_transform_size(out->transform, out->w, out->h, &w, &h);
+	wl_output_send_geometry(resource, 0, 0, w, h, 0,
+			"unknown", "unknown", out->transform);
+	wl_output_send_mode(resource, 0, w, h, 60);
+	wl_output_send_scale(resource, out->scale);
 	wl_output_send_done(resource);
 }
 
-int
-amcs_output_update_region(struct amcs_output *out, struct amcs_win *win)
+/* Part of window buffer, which should be drawn, buffer coordinates */
+static bool
+win_visible_box(struct amcs_win *win, struct amcs_rect *vis)
 {
-	struct amcs_screen *screen;
-	int i, j, h, w;
-	size_t offset;
-	int buf_off;
-
-	debug("nscreens %lu", pvector_len(&out->screens));
-	// no actual surface
-	if (out->isactive == false)
-		return 0;
-	if (pvector_len(&out->screens) < 1)
-		return 0;
+	int w, h;
 
-	screen = pvector_get(&out->screens, 0);
-	//TODO: use additional screens
+	if (!amcs_buf_attached(&win->buf))
+		return false;
 	h = MIN(win->buf.h, win->h);
 	w = MIN(win->buf.w, win->w);
 	if (win->v_box.w != 0 && win->v_box.w < w)
 		w = win->v_box.w;
 	if (win->v_box.h != 0 && win->v_box.h < h)
 		h = win->v_box.h;
-	buf_off = win->v_box.y * win->buf.w;
-	for (i = 0; i < h; ++i) {
-		for (j = 0; j < w; ++j) {
-			offset = screen->pitch * (i + win->y) + 4 * (j + win->x);
-			*(uint32_t*)&screen->buf[offset] = win->buf.dt[win->v_box.x + buf_off + win->buf.w * i + j];
-		}
+	w = MIN(w, win->buf.w - win->v_box.x);
+	h = MIN(h, win->buf.h - win->v_box.y);
+
+	vis->x = win->v_box.x;
+	vis->y = win->v_box.y;
+	vis->w = w;
+	vis->h = h;
+	return !amcs_rect_empty(vis);
+}
+
+/* Fill draw entry for the window, false if nothing is visible */
+static bool
+draw_init(struct amcs_draw *d, struct amcs_win *win)
+{
+	struct amcs_rect vis;
+
+	if (!win_visible_box(win, &vis))
+		return false;
+	d->win = win;
+	d->buf = &win->buf;
+	d->box = (struct amcs_rect) {win->x, win->y, vis.w, vis.h};
+	d->src_x = vis.x;
+	d->src_y = vis.y;
+	amcs_region_clear(&d->opaque);
+	if (win->buf.format == WL_SHM_FORMAT_XRGB8888) {
+		amcs_region_add_rect(&d->opaque, &d->box);
+	} else {
+		amcs_region_copy(&d->opaque, &win->opaque);
+		amcs_region_translate(&d->opaque, win->x - vis.x, win->y - vis.y);
+		amcs_region_intersect_rect(&d->opaque, &d->box);
+	}
+	return true;
+}
+
+static void
+scene_clear(struct amcs_output *out)
+{
+	struct amcs_draw *d;
+	int i;
+
+	d = vector_data(&out->scene);
+	for (i = 0; i < vector_len(&out->scene); i++)
+		amcs_region_fini(&d[i].opaque);
+	vector_clear(&out->scene);
+}
+
+static int
+scene_add_cb(struct amcs_win *win, void *opaq)
+{
+	struct amcs_output *out = opaq;
+	struct amcs_draw d;
+
+	if (win->type != WT_WIN)
+		return 0;
+	win->draw_idx = -1;
+	d.plane = NULL;
+	amcs_region_init(&d.opaque);
+	if (!draw_init(&d, win)) {
+		amcs_region_fini(&d.opaque);
+		return 0;
+	}
+	win->draw_idx = vector_len(&out->scene);
+	vector_push(&out->scene, &d);
+	return 0;
+}
+
+static void
+output_planes_dirty(struct amcs_output *out)
+{
+	struct amcs_screen *screen;
+	int i;
+
+	pvector_for_each(i, screen, &out->screens)
+		screen->planes_dirty = true;
+}
+
+/* The only tree walk of rendering, done when the tree is changed */
+static void
+output_build_scene(struct amcs_output *out)
+{
+	if (!out->scene_dirty)
+		return;
+	out->scene_dirty = false;
+	scene_clear(out);
+	if (out->ws)
+		amcs_workspace_pass(out->ws, scene_add_cb, out);
+	output_planes_dirty(out);
+	debug("scene: %zu windows", vector_len(&out->scene));
+}
+
+/* Entry has translucent parts */
+static bool
+draw_has_alpha(const struct amcs_draw *d)
+{
+	const struct amcs_rect *r = amcs_region_rects(&d->opaque);
+
+	return amcs_region_nrects(&d->opaque) != 1 ||
+		r->x != d->box.x || r->y != d->box.y ||
+		r->w != d->box.w || r->h != d->box.h;
+}
+
+/* Window buffer is committed, refresh its entry in place */
+static void
+scene_update_win(struct amcs_output *out, struct amcs_win *win)
+{
+	struct amcs_draw *d;
+	struct amcs_rect vis, box;
+	bool alpha;
+
+	if (out->scene_dirty)
+		return;
+	if (win->draw_idx < 0 || win->draw_idx >= vector_len(&out->scene)) {
+		// window has just become visible
+		if (win_visible_box(win, &vis))
+			out->scene_dirty = true;
+		return;
+	}
+	d = vector_get(&out->scene, win->draw_idx);
+	box = d->box;
+	alpha = draw_has_alpha(d);
+	if (d->win != win || !draw_init(d, win)) {
+		out->scene_dirty = true;
+		return;
+	}
+	// plane is set up for the old size or blending
+	if (d->plane && (memcmp(&box, &d->box, sizeof(box)) != 0 ||
+	    alpha != draw_has_alpha(d)))
+		output_planes_dirty(out);
+}
+
+void
+amcs_output_invalidate_scene(struct amcs_output *out)
+{
+	assert(out);
+	out->scene_dirty = true;
+}
+
+/* *r* is in output coordinates */
+static void
+screen_damage(struct amcs_screen *screen, const struct amcs_rect *r)
+{
+	struct amcs_rect sr = {screen->x, screen->y, screen->w, screen->h};
+	struct amcs_rect tmp;
+
+	if (!amcs_rect_intersect(r, &sr, &tmp))
+		return;
+	tmp.x -= screen->x;
+	tmp.y -= screen->y;
+	amcs_region_add_rect(&screen->damage, &tmp);
+	screen_schedule_repaint(screen);
+}
+
+void
+amcs_output_damage(struct amcs_output *out, const struct amcs_rect *r)
+{
+	struct amcs_screen *screen;
+	int i;
+
+	pvector_for_each(i, screen, &out->screens)
+		screen_damage(screen, r);
+}
+
+struct amcs_win *
+amcs_output_win_at(struct amcs_output *out, int x, int y)
+{
+	struct amcs_draw *d;
+	int i;
+
+	output_build_scene(out);
+	d = vector_data(&out->scene);
+	for (i = vector_len(&out->scene) - 1; i >= 0; i--) {
+		if (x >= d[i].box.x && y >= d[i].box.y &&
+		    x < d[i].box.x + d[i].box.w && y < d[i].box.y + d[i].box.h)
+			return d[i].win;
+	}
+	return NULL;
+}
+
+/* Pointer image on the output */
+static void
+cursor_box(const struct amcs_output *out, struct amcs_rect *r)
+{
+	*r = (struct amcs_rect) {out->cursor.x - out->cursor.hx,
+		out->cursor.y - out->cursor.hy, out->cursor.w, out->cursor.h};
+}
+
+/* Composed pointer image is redrawn */
+static void
+cursor_damage(struct amcs_output *out)
+{
+	struct amcs_screen *screen;
+	struct amcs_rect r;
+	int i;
+
+	if (!out->cursor.visible)
+		return;
+	cursor_box(out, &r);
+	pvector_for_each(i, screen, &out->screens) {
+		if (!screen->hw_cursor)
+			screen_damage(screen, &r);
+	}
+}
+
+/*
+ * Move the cursor plane, *old* is the pointer image before the move.
+ * Atomic devices commit plane state alone, nothing is composed.
+ */
+static void
+screen_move_cursor(struct amcs_screen *screen, const struct amcs_rect *old)
+{
+	struct amcs_output *out = screen->out;
+	struct amcs_rect sr = {screen->x, screen->y, screen->w, screen->h};
+	struct amcs_rect r, tmp;
+
+	cursor_box(out, &r);
+	// not shown before and after the move
+	if (old && !amcs_rect_intersect(old, &sr, &tmp) &&
+	    !amcs_rect_intersect(&r, &sr, &tmp))
+		return;
+	amcs_drm_dev_move_cursor(screen->card, screen->dev,
+			out->cursor.x - screen->x, out->cursor.y - screen->y);
+	if (screen->dev->atomic) {
+		screen->cursor_dirty = true;
+		screen_schedule_repaint(screen);
+	}
+}
+
+/* Put the pointer image on the cursor plane if the screen has one */
+static void
+screen_set_cursor(struct amcs_screen *screen)
+{
+	struct amcs_output *out = screen->out;
+	bool hw;
+
+	// cursor planes aren't rotated
+	hw = out->cursor.visible &&
+		screen->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+		amcs_drm_dev_set_cursor(screen->card, screen->dev,
+			out->cursor.img, out->cursor.w, out->cursor.h,
+			out->cursor.hx, out->cursor.hy) == 0;
+	if (!hw && screen->hw_cursor)
+		amcs_drm_dev_set_cursor(screen->card, screen->dev,
+				NULL, 0, 0, 0, 0);
+	// composed pointer must stay above plane windows
+	if (!hw || hw != screen->hw_cursor)
+		screen->planes_dirty = true;
+	if (hw || screen->hw_cursor) {
+		screen->hw_cursor = hw;
+		screen_move_cursor(screen, NULL);
+	}
+}
+
+void
+amcs_output_set_cursor(struct amcs_output *out, const uint32_t *img,
+		int w, int h, int hx, int hy)
+{
+	struct amcs_screen *screen;
+	int i;
+
+	assert(out);
+	cursor_damage(out);
+	out->cursor.visible = img != NULL && w > 0 && h > 0;
+	if (out->cursor.visible) {
+		out->cursor.img = xrealloc(out->cursor.img, w * h * 4);
+		memcpy(out->cursor.img, img, w * h * 4);
+		out->cursor.w = w;
+		out->cursor.h = h;
+		out->cursor.hx = hx;
+		out->cursor.hy = hy;
+	}
+	pvector_for_each(i, screen, &out->screens)
+		screen_set_cursor(screen);
+	cursor_damage(out);
+}
+
+void
+amcs_output_move_cursor(struct amcs_output *out, int x, int y)
+{
+	struct amcs_screen *screen;
+	struct amcs_rect old;
+	int i;
+
+	assert(out);
+	if (x == out->cursor.x && y == out->cursor.y)
+		return;
+	cursor_box(out, &old);
+	cursor_damage(out);
+	out->cursor.x = x;
+	out->cursor.y = y;
+	cursor_damage(out);
+	pvector_for_each(i, screen, &out->screens) {
+		if (screen->hw_cursor)
+			screen_move_cursor(screen, &old);
 	}
+}
+
+/* Move window damage to the output, it'll be drawn at the next repaint */
+int
+amcs_output_update_region(struct amcs_output *out, struct amcs_win *win)
+{
+	struct amcs_rect vis, r, *dmg;
+	int k;
+
+	debug("nscreens %lu", pvector_len(&out->screens));
+	scene_update_win(out, win);
+	// no actual surface
+	if (out->isactive == false)
+		goto done;
+	if (!win_visible_box(win, &vis))
+		goto done;
+
+	amcs_region_for_each(k, dmg, &win->damage) {
+		if (!amcs_rect_intersect(dmg, &vis, &r))
+			continue;
+		r.x += win->x - vis.x;
+		r.y += win->y - vis.y;
+		amcs_output_damage(out, &r);
+	}
+done:
+	amcs_region_clear(&win->damage);
 	return 0;
 }
 
 void
 amcs_output_clear(struct amcs_output *out)
+{
+	struct amcs_rect r = {0, 0, out->w, out->h};
+
+	assert(out);
+	amcs_output_damage(out, &r);
+}
+
+void
+amcs_output_set_workspace(struct amcs_output *out, struct amcs_workspace *ws)
+{
+	assert(out);
+	if (out->ws == ws)
+		return;
+	amcs_workspace_configure_expire(out->ws);
+	out->ws = ws;
+	out->scene_dirty = true;
+	// don't wait for clients of the hidden workspace
+	amcs_output_thaw(out);
+	amcs_output_clear(out);
+}
+
+void
+amcs_output_freeze(struct amcs_output *out)
+{
+	assert(out);
+	if (out->configure_timeout <= 0)
+		return;
+	out->frozen = true;
+	wl_event_source_timer_update(out->freeze_timer, out->configure_timeout);
+}
+
+void
+amcs_output_thaw(struct amcs_output *out)
+{
+	assert(out);
+	if (!out->frozen)
+		return;
+	out->frozen = false;
+	wl_event_source_timer_update(out->freeze_timer, 0);
+	amcs_output_schedule_repaint(out);
+}
+
+void
+amcs_output_schedule_repaint(struct amcs_output *out)
+{
+	struct amcs_screen *screen;
+	int i;
+
+	assert(out);
+	pvector_for_each(i, screen, &out->screens) {
+		screen->frame_requested = true;
+		screen_schedule_repaint(screen);
+	}
+}
+
+/* Window position on the screen, screen coordinates */
+static bool
+win_screen_box(struct amcs_screen *screen, struct amcs_win *win,
+		struct amcs_rect *vis, struct amcs_rect *wr)
+{
+	if (!win_visible_box(win, vis))
+		return false;
+	wr->x = win->x - screen->x;
+	wr->y = win->y - screen->y;
+	wr->w = vis->w;
+	wr->h = vis->h;
+	return true;
+}
+
+bool
+amcs_screen_win_clip(struct amcs_screen *screen, struct amcs_win *win,
+		struct amcs_rect *clip)
+{
+	struct amcs_rect vis, wr;
+	struct amcs_rect sr = {0, 0, screen->w, screen->h};
+
+	if (!win_screen_box(screen, win, &vis, &wr))
+		return false;
+	return amcs_rect_intersect(&wr, &sr, clip);
+}
+
+void
+amcs_output_schedule_frame(struct amcs_output *out, struct amcs_win *win)
 {
 	struct amcs_screen *screen;
+	struct amcs_rect clip;
+	int i;
 
 	assert(out);
-	if (pvector_len(&out->screens) < 1)
+	pvector_for_each(i, screen, &out->screens) {
+		if (!amcs_screen_win_clip(screen, win, &clip))
+			continue;
+		screen->frame_requested = true;
+		screen_schedule_repaint(screen);
+	}
+}
+
+/* *r* is in output coordinates, *src* is mapped entry buffer */
+static void
+draw_blit(struct amcs_screen *screen, const struct amcs_draw *d,
+		const uint8_t *src, const struct amcs_rect *r, enum blit_op op)
+{
+	int stride = d->buf->stride;
+
+	amcs_blit_rect(screen->buf + screen->pitch * (r->y - screen->y) +
+			4 * (r->x - screen->x), screen->pitch,
+		src + stride * (r->y - d->box.y + d->src_y) +
+			4 * (r->x - d->box.x + d->src_x), stride,
+		r->w, r->h, op, OUTPUT_BG_COLOR);
+}
+
+/*
+ * Draw *vis* part of the entry, output coordinates. Opaque parts are
+ * copied, translucent ones are blended over *bg* color if nothing is
+ * drawn below the entry (*solid*) or over the screen content otherwise.
+ */
+static void
+paint_draw(struct amcs_screen *screen, const struct amcs_draw *d,
+		const struct amcs_region *vis, bool solid)
+{
+	const struct amcs_buf *buf = d->buf;
+	struct amcs_region blend;
+	struct amcs_rect r, *rect, *o;
+	struct wl_shm_buffer *shm;
+	uint8_t *src;
+	int i, k;
+
+	// client may have destroyed the buffer since the scene was built
+	if (!amcs_buf_attached(buf))
 		return;
+	// client buffer read in place, client may truncate the pool under
+	// us, access is protected from SIGBUS by libwayland
+	if ((shm = buf->shm) != NULL) {
+		wl_shm_buffer_begin_access(shm);
+		src = wl_shm_buffer_get_data(shm);
+	} else {
+		src = (uint8_t *)buf->dt;
+	}
+	amcs_region_init(&blend);
+	amcs_region_copy(&blend, vis);
+	amcs_region_for_each(k, o, &d->opaque) {
+		amcs_region_for_each(i, rect, vis) {
+			if (amcs_rect_intersect(rect, o, &r))
+				draw_blit(screen, d, src, &r, BLIT_COPY);
+		}
+		amcs_region_subtract_rect(&blend, o);
+	}
+	amcs_region_for_each(i, rect, &blend)
+		draw_blit(screen, d, src, rect,
+			solid ? BLIT_BLEND_SOLID : BLIT_BLEND);
+	amcs_region_fini(&blend);
+	if (shm)
+		wl_shm_buffer_end_access(shm);
+}
+
+/* Copy *r* part of the shadow into scanout buffer *fb* */
+static void
+screen_flush_rect(struct amcs_screen *screen, uint8_t *fb,
+		const struct amcs_rect *r)
+{
+	const uint8_t *src;
+	struct amcs_rect fr;
+	long sx_step, sy_step;
+	int fw, fh;
+
+	if (screen->transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+		amcs_blit_stream_rect(fb + screen->fb_pitch * r->y + 4 * r->x,
+			screen->fb_pitch,
+			screen->shadow + screen->pitch * r->y + 4 * r->x,
+			screen->pitch, r->w, r->h);
+		return;
+	}
+	// scanout buffer is filled row by row from rotated shadow
+	amcs_transform_rect(screen->transform, screen->w, screen->h, r, &fr);
+	amcs_transform_size(screen->transform, screen->w, screen->h, &fw, &fh);
+	src = amcs_transform_src(amcs_transform_invert(screen->transform),
+			fw, fh, &fr, screen->shadow, screen->pitch,
+			&sx_step, &sy_step);
+	amcs_blit_transform(fb + screen->fb_pitch * fr.y + 4 * fr.x,
+			screen->fb_pitch, src, sx_step, sy_step, fr.w, fr.h);
+}
+
+/* Horizontal stripe of the screen, composed by a single thread */
+struct paint_job {
+	struct amcs_screen *screen;
+	struct amcs_region *paint;	//draw into screen->buf
+	struct amcs_region *flush;	//stream from shadow to *fb*, optional
+	uint8_t *fb;
+	int stripe_h;
+};
+
+static void
+paint_stripe(int idx, void *opaq)
+{
+	struct paint_job *job = opaq;
+	struct amcs_screen *screen = job->screen;
+	struct amcs_rect clip = {0, idx * job->stripe_h, screen->w, job->stripe_h};
+	struct amcs_output *out = screen->out;
+	struct amcs_region reg, bg, cur, *vis;
+	struct amcs_draw *d;
+	struct amcs_rect *r, tmp, cb;
+	bool *solid;
+	int i, j, n;
+
+	amcs_region_init(&reg);
+	amcs_region_init(&bg);
+	amcs_region_init(&cur);
+	// disjoint rectangles, translucent parts must be blended only once
+	amcs_region_copy(&reg, job->paint);
+	amcs_region_intersect_rect(&reg, &clip);
+	amcs_region_translate(&reg, screen->x, screen->y);
+	amcs_region_for_each(i, r, &reg)
+		amcs_region_union_rect(&bg, r);
+	// composed pointer is on top of everything
+	cursor_box(out, &cb);
+	if (out->cursor.visible && !screen->hw_cursor) {
+		amcs_region_for_each(i, r, &reg) {
+			if (amcs_rect_intersect(r, &cb, &tmp))
+				amcs_region_union_rect(&cur, &tmp);
+		}
+	}
+
+	d = vector_data(&screen->out->scene);
+	n = vector_len(&screen->out->scene);
+	vis = xmalloc(sizeof(*vis) * (n + 1));
+	solid = xmalloc(sizeof(*solid) * (n + 1));
+	// front to back: every entry gets the part not hidden by opaque
+	// regions above it, *bg* keeps what is left for the background
+	for (i = n - 1; i >= 0; i--) {
+		amcs_region_init(&vis[i]);
+		// buffer is gone since the scene was built, nothing is drawn
+		if (!amcs_buf_attached(d[i].buf))
+			continue;
+		if (d[i].plane) {
+			// scanned out above the primary plane, parts it
+			// hides aren't drawn at all
+			amcs_region_for_each(j, r, &d[i].opaque)
+				amcs_region_subtract_rect(&bg, r);
+			continue;
+		}
+		amcs_region_copy(&vis[i], &bg);
+		amcs_region_intersect_rect(&vis[i], &d[i].box);
+		if (amcs_region_empty(&vis[i]))
+			continue;
+		for (j = 0, solid[i] = true; j < i && solid[i]; j++)
+			solid[i] = !amcs_rect_intersect(&d[i].box, &d[j].box, &tmp);
+		if (solid[i]) {
+			amcs_region_subtract_rect(&bg, &d[i].box);
+		} else {
+			amcs_region_for_each(j, r, &d[i].opaque)
+				amcs_region_subtract_rect(&bg, r);
+		}
+	}
+	amcs_region_for_each(i, r, &bg) {
+		amcs_blit_fill(screen->buf + screen->pitch * (r->y - screen->y) +
+				4 * (r->x - screen->x),
+			screen->pitch, r->w, r->h, OUTPUT_BG_COLOR);
+	}
+	// back to front, translucent parts are blended over drawn content
+	for (i = 0; i < n; i++) {
+		if (!amcs_region_empty(&vis[i]))
+			paint_draw(screen, &d[i], &vis[i], solid[i]);
+		amcs_region_fini(&vis[i]);
+	}
+	free(vis);
+	free(solid);
+	amcs_region_for_each(i, r, &cur) {
+		amcs_blit_rect(screen->buf + screen->pitch * (r->y - screen->y) +
+				4 * (r->x - screen->x), screen->pitch,
+			(uint8_t *)(out->cursor.img + out->cursor.w * (r->y - cb.y) +
+				r->x - cb.x), out->cursor.w * 4,
+			r->w, r->h, BLIT_BLEND, OUTPUT_BG_COLOR);
+	}
+
+	if (job->flush) {
+		amcs_region_copy(&reg, job->flush);
+		amcs_region_intersect_rect(&reg, &clip);
+		amcs_region_for_each(i, r, &reg)
+			screen_flush_rect(screen, job->fb, r);
+	}
+	amcs_region_fini(&reg);
+	amcs_region_fini(&bg);
+	amcs_region_fini(&cur);
+}
+
+/*
+ * Draw *paint* region into screen->buf and stream *flush* region to *fb*
+ * if shadow is used. Large damage is split into stripes composed by
+ * the worker pool, small one is drawn right here.
+ */
+static void
+screen_compose(struct amcs_screen *screen, struct amcs_region *paint,
+		struct amcs_region *flush, uint8_t *fb)
+{
+	struct amcs_workers *workers = screen->out->workers;
+	struct paint_job job = {screen, paint, flush, fb, screen->h};
+	long area;
+	int n;
+
+	area = amcs_region_area(paint);
+	if (flush)
+		area += amcs_region_area(flush);
+	if (workers == NULL || area < PARALLEL_MIN_AREA) {
+		paint_stripe(0, &job);
+		return;
+	}
+	// a few stripes per thread to even out uneven damage
+	n = amcs_workers_nthreads(workers) * 2;
+	job.stripe_h = ALIGN_UP((screen->h + n - 1) / n, STRIPE_ALIGN);
+	n = (screen->h + job.stripe_h - 1) / job.stripe_h;
+	amcs_workers_run(workers, paint_stripe, &job, n);
+}
+
+/* Entry box is inside the screen and nothing is drawn above it */
+static bool
+draw_plane_ok(struct amcs_screen *screen, const struct amcs_draw *d, int i)
+{
+	struct amcs_draw *scene = vector_data(&screen->out->scene);
+	struct amcs_rect tmp;
+	int j;
+
+	if (d->box.x < screen->x || d->box.y < screen->y ||
+	    d->box.x + d->box.w > screen->x + screen->w ||
+	    d->box.y + d->box.h > screen->y + screen->h ||
+	    !amcs_buf_attached(d->buf))
+		return false;
+	for (j = i + 1; j < vector_len(&screen->out->scene); j++) {
+		if (amcs_rect_intersect(&d->box, &scene[j].box, &tmp))
+			return false;
+	}
+	return true;
+}
+
+static int
+draw_area_cmp(const void *a, const void *b)
+{
+	const struct amcs_draw *da = *(const struct amcs_draw **)a;
+	const struct amcs_draw *db = *(const struct amcs_draw **)b;
+	long sa = (long)da->box.w * da->box.h;
+	long sb = (long)db->box.w * db->box.h;
 
-	screen = pvector_get(&out->screens, 0);
-	memset(screen->buf, 0, screen->pitch * screen->h);
+	return (sa < sb) - (sa > sb);
 }
+
+/* Try free planes for the entry, false if none fits */
+static bool
+screen_place_draw(struct amcs_screen *screen, struct amcs_draw *d)
+{
+	struct amcs_drm_plane *p;
+	bool alpha = draw_has_alpha(d);
+	int i;
+
+	for (i = 0; i < screen->dev->nplanes; i++) {
+		p = &screen->dev->planes[i];
+		// reserved for the pointer
+		if (p == screen->dev->cursor)
+			continue;
+		if (p->on || (alpha && !p->argb) ||
+		    d->box.w > p->chain.w || d->box.h > p->chain.h)
+			continue;
+		p->on = true;
+		p->alpha = alpha;
+		p->x = d->box.x - screen->x;
+		p->y = d->box.y - screen->y;
+		p->w = d->box.w;
+		p->h = d->box.h;
+		if (amcs_drm_dev_test(screen->card, screen->dev)) {
+			d->plane = p;
+			return true;
+		}
+		p->on = false;
+	}
+	return false;
+}
+
+/*
+ * Scan out topmost windows by overlay and cursor planes, the largest
+ * first as they save the most blending. Every assignment is checked by
+ * a test commit, windows without a plane are composed. Windows moved
+ * between planes and composition are damaged.
+ */
+static void
+screen_assign_planes(struct amcs_screen *screen)
+{
+	amcs_drm_dev *dev = screen->dev;
+	struct amcs_draw *d, **cand;
+	struct amcs_drm_plane *p;
+	struct amcs_rect r;
+	int i, n, ncand;
+
+	if (!screen->planes_dirty)
+		return;
+	screen->planes_dirty = false;
+	for (i = 0; i < dev->nplanes; i++) {
+		p = &dev->planes[i];
+		if (!p->on || p == dev->cursor)
+			continue;
+		r = (struct amcs_rect) {p->x, p->y, p->w, p->h};
+		amcs_region_add_rect(&screen->damage, &r);
+		p->on = false;
+	}
+	// planes of other screens are still on
+	d = vector_data(&screen->out->scene);
+	n = vector_len(&screen->out->scene);
+	for (i = 0; i < n; i++) {
+		if (d[i].plane && !d[i].plane->on)
+			d[i].plane = NULL;
+	}
+	if (dev->nplanes == 0 || screen->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    (screen->out->cursor.visible && !screen->hw_cursor))
+		return;
+
+	cand = xmalloc(sizeof(*cand) * (n + 1));
+	for (i = ncand = 0; i < n; i++) {
+		if (d[i].plane == NULL && draw_plane_ok(screen, &d[i], i))
+			cand[ncand++] = &d[i];
+	}
+	qsort(cand, ncand, sizeof(*cand), draw_area_cmp);
+	for (i = 0; i < ncand; i++) {
+		if (!screen_place_draw(screen, cand[i]))
+			continue;
+		r = cand[i]->box;
+		r.x -= screen->x;
+		r.y -= screen->y;
+		amcs_region_add_rect(&screen->damage, &r);
+		debug("window %dx%d+%d+%d on plane %u", r.w, r.h, r.x, r.y,
+				cand[i]->plane->id);
+	}
+	free(cand);
+}
+
+/*
+ * Copy damaged windows into back buffers of their planes. Damage under
+ * opaque plane windows is dropped, the primary plane isn't redrawn
+ * there. False if some plane has no free buffer, its damage is kept.
+ */
+static bool
+screen_update_planes(struct amcs_screen *screen)
+{
+	struct amcs_draw *d;
+	struct amcs_drm_plane *p;
+	struct amcs_rect box, tmp, *r;
+	struct wl_shm_buffer *shm;
+	const uint8_t *src;
+	uint8_t *fb;
+	bool hit, ok = true;
+	int i, k, back;
+
+	d = vector_data(&screen->out->scene);
+	for (i = 0; i < vector_len(&screen->out->scene); i++) {
+		if ((p = d[i].plane) == NULL || !amcs_buf_attached(d[i].buf))
+			continue;
+		box = d[i].box;
+		box.x -= screen->x;
+		box.y -= screen->y;
+		hit = false;
+		amcs_region_for_each(k, r, &screen->damage)
+			hit = hit || amcs_rect_intersect(r, &box, &tmp);
+		if (!hit)
+			continue;
+		if ((back = amcs_drm_plane_get_back(screen->card, p)) == -1) {
+			ok = false;
+			continue;
+		}
+		// whole window, the buffer missed the last frames
+		if ((shm = d[i].buf->shm) != NULL) {
+			wl_shm_buffer_begin_access(shm);
+			src = wl_shm_buffer_get_data(shm);
+		} else {
+			src = (uint8_t *)d[i].buf->dt;
+		}
+		fb = p->chain.fbs[back].buf;
+		amcs_blit_stream_rect(fb, p->chain.pitch,
+			src + d[i].buf->stride * d[i].src_y + 4 * d[i].src_x,
+			d[i].buf->stride, box.w, box.h);
+		if (shm)
+			wl_shm_buffer_end_access(shm);
+		amcs_region_for_each(k, r, &d[i].opaque) {
+			tmp = *r;
+			tmp.x -= screen->x;
+			tmp.y -= screen->y;
+			amcs_region_subtract_rect(&screen->damage, &tmp);
+		}
+	}
+	return ok;
+}
+
+static void
+screen_repaint(struct amcs_screen *screen)
+{
+	struct amcs_output *out = screen->out;
+	struct amcs_region *reg;
+	uint8_t *fb;
+	bool requested;
+	int i, back;
+
+	// state is still REPAINT_SCHEDULED, so new damage from frame_sig
+	// listeners goes into this frame without rescheduling
+	assert(screen->state == REPAINT_SCHEDULED);
+	if (!out->isactive)
+		goto idle;
+	requested = screen->frame_requested;
+	screen->frame_requested = false;
+	wl_signal_emit(&out->frame_sig, screen);
+	output_build_scene(out);
+	// keep damage for the frame with complete new layout
+	if (out->frozen || amcs_region_empty(&screen->damage)) {
+		// pointer moves even if the layout is frozen
+		if (screen->cursor_dirty)
+			goto present;
+		// requested frames keep the frame clock running, input
+		// coalesced per frame is paced by it
+		if (!wl_list_empty(&screen->frame_cbs) || requested) {
+			screen_skip_frame(screen);
+			return;
+		}
+		goto idle;
+	}
+	screen_assign_planes(screen);
+	if (!screen_update_planes(screen)) {
+		// planes are busy, repaint after page flip
+		debug("screen %p planes are busy", screen);
+		goto idle;
+	}
+	// only plane windows are changed
+	if (amcs_region_empty(&screen->damage))
+		goto present;
+	back = amcs_drm_dev_get_back(screen->dev);
+	if (back == -1) {
+		// all buffers are busy, repaint after page flip
+		debug("screen %p is busy", screen);
+		goto idle;
+	}
+	fb = screen->dev->primary.chain.fbs[back].buf;
+
+	// back buffer misses new damage and everything it didn't get before
+	reg = &screen->fb_damage[back];
+	amcs_region_add_region(reg, &screen->damage);
+	if (screen->shadow) {
+		// shadow is up to date except new damage
+		screen->buf = screen->shadow;
+		screen_compose(screen, &screen->damage, reg, fb);
+	} else {
+		screen->buf = fb;
+		screen_compose(screen, reg, NULL, fb);
+	}
+
+	for (i = 0; i < AMCS_DRM_NBUFS; i++) {
+		if (i != back)
+			amcs_region_add_region(&screen->fb_damage[i],
+					&screen->damage);
+	}
+	amcs_region_clear(reg);
+	amcs_region_clear(&screen->damage);
+present:
+	screen->cursor_dirty = false;
+	if (amcs_drm_dev_present(screen->card, screen->dev) == 0) {
+		screen->state = REPAINT_AWAITING_FLIP;
+		return;
+	}
+	if (screen->dev->frame_lost) {
+		// shown with the next repaint, retrying now may spin
+		screen->dev->frame_lost = false;
+		amcs_region_add(&screen->damage, 0, 0, screen->w, screen->h);
+	}
+idle:
+	screen->state = REPAINT_IDLE;
+}
+
 void
 amcs_output_free(struct amcs_output *out)
 {
 	amcs_output_screens_free(out);
+	amcs_workers_free(out->workers);
+	if (out->freeze_timer)
+		wl_event_source_remove(out->freeze_timer);
+	scene_clear(out);
+	vector_free(&out->scene);
+	free(out->cursor.img);
 	pvector_free(&out->screens);
 	pvector_free(&out->cards);
 	free(out);
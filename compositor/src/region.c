@@ -0,0 +1,267 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "macro.h"
+#include "region.h"
+
+static bool
+rect_contains(const struct amcs_rect *a, const struct amcs_rect *b)
+{
+	return b->x >= a->x && b->y >= a->y &&
+		b->x + b->w <= a->x + a->w &&
+		b->y + b->h <= a->y + a->h;
+}
+
+bool
+amcs_rect_intersect(const struct amcs_rect *a, const struct amcs_rect *b,
+		struct amcs_rect *out)
+{
+	int x1, y1, x2, y2;
+
+	x1 = MAX(a->x, b->x);
+	y1 = MAX(a->y, b->y);
+	x2 = MIN(a->x + a->w, b->x + b->w);
+	y2 = MIN(a->y + a->h, b->y + b->h);
+
+	if (x2 <= x1 || y2 <= y1) {
+		memset(out, 0, sizeof(*out));
+		return false;
+	}
+	out->x = x1;
+	out->y = y1;
+	out->w = x2 - x1;
+	out->h = y2 - y1;
+	return true;
+}
+
+void
+amcs_rect_union(const struct amcs_rect *a, const struct amcs_rect *b,
+		struct amcs_rect *out)
+{
+	int x1, y1, x2, y2;
+
+	if (amcs_rect_empty(a)) {
+		*out = *b;
+		return;
+	}
+	if (amcs_rect_empty(b)) {
+		*out = *a;
+		return;
+	}
+	x1 = MIN(a->x, b->x);
+	y1 = MIN(a->y, b->y);
+	x2 = MAX(a->x + a->w, b->x + b->w);
+	y2 = MAX(a->y + a->h, b->y + b->h);
+	out->x = x1;
+	out->y = y1;
+	out->w = x2 - x1;
+	out->h = y2 - y1;
+}
+
+void
+amcs_region_init(struct amcs_region *r)
+{
+	assert(r);
+	vector_init(&r->rects, sizeof(struct amcs_rect), xrealloc);
+}
+
+void
+amcs_region_fini(struct amcs_region *r)
+{
+	assert(r);
+	vector_free(&r->rects);
+	memset(r, 0, sizeof(*r));
+}
+
+void
+amcs_region_clear(struct amcs_region *r)
+{
+	vector_clear(&r->rects);
+}
+
+bool
+amcs_region_empty(const struct amcs_region *r)
+{
+	return vector_len(&r->rects) == 0;
+}
+
+int
+amcs_region_nrects(const struct amcs_region *r)
+{
+	return vector_len(&r->rects);
+}
+
+struct amcs_rect *
+amcs_region_rects(const struct amcs_region *r)
+{
+	return vector_data(&r->rects);
+}
+
+void
+amcs_region_extents(const struct amcs_region *r, struct amcs_rect *out)
+{
+	struct amcs_rect *rect;
+	int i;
+
+	memset(out, 0, sizeof(*out));
+	amcs_region_for_each(i, rect, r)
+		amcs_rect_union(out, rect, out);
+}
+
+long
+amcs_region_area(const struct amcs_region *r)
+{
+	struct amcs_rect *rect;
+	long res = 0;
+	int i;
+
+	amcs_region_for_each(i, rect, r)
+		res += (long)rect->w * rect->h;
+	return res;
+}
+
+void
+amcs_region_add_rect(struct amcs_region *r, const struct amcs_rect *rect)
+{
+	struct amcs_rect *arr, ext;
+	int i;
+
+	if (amcs_rect_empty(rect))
+		return;
+
+	arr = amcs_region_rects(r);
+	for (i = 0; i < amcs_region_nrects(r); i++) {
+		if (rect_contains(&arr[i], rect))
+			return;
+	}
+	/* drop rectangles covered by the new one */
+	for (i = amcs_region_nrects(r) - 1; i >= 0; i--) {
+		if (rect_contains(rect, &arr[i]))
+			vector_del(&r->rects, i);
+	}
+
+	if (amcs_region_nrects(r) >= REGION_MAXRECTS) {
+		/* too fragmented, it's cheaper to redraw bounding box */
+		amcs_region_extents(r, &ext);
+		amcs_rect_union(&ext, rect, &ext);
+		vector_clear(&r->rects);
+		vector_push(&r->rects, &ext);
+		return;
+	}
+	vector_push(&r->rects, rect);
+}
+
+void
+amcs_region_add(struct amcs_region *r, int x, int y, int w, int h)
+{
+	struct amcs_rect rect = {
+		.x = x,
+		.y = y,
+		.w = w,
+		.h = h,
+	};
+
+	amcs_region_add_rect(r, &rect);
+}
+
+void
+amcs_region_add_region(struct amcs_region *r, const struct amcs_region *src)
+{
+	struct amcs_rect *rect;
+	int i;
+
+	amcs_region_for_each(i, rect, src)
+		amcs_region_add_rect(r, rect);
+}
+
+void
+amcs_region_intersect_rect(struct amcs_region *r, const struct amcs_rect *clip)
+{
+	struct amcs_rect *arr;
+	int i;
+
+	arr = amcs_region_rects(r);
+	for (i = amcs_region_nrects(r) - 1; i >= 0; i--) {
+		if (!amcs_rect_intersect(&arr[i], clip, &arr[i]))
+			vector_del(&r->rects, i);
+	}
+}
+
+void
+amcs_region_translate(struct amcs_region *r, int dx, int dy)
+{
+	struct amcs_rect *rect;
+	int i;
+
+	amcs_region_for_each(i, rect, r) {
+		rect->x += dx;
+		rect->y += dy;
+	}
+}
+
+/* add parts of *r* not covered by *cut* into *out* */
+static void
+rect_subtract(vector *out, const struct amcs_rect *r, const struct amcs_rect *cut)
+{
+	struct amcs_rect in, tmp;
+
+	if (!amcs_rect_intersect(r, cut, &in)) {
+		vector_push(out, r);
+		return;
+	}
+	// top and bottom bands
+	tmp = (struct amcs_rect) {r->x, r->y, r->w, in.y - r->y};
+	if (!amcs_rect_empty(&tmp))
+		vector_push(out, &tmp);
+	tmp = (struct amcs_rect) {r->x, in.y + in.h, r->w, r->y + r->h - in.y - in.h};
+	if (!amcs_rect_empty(&tmp))
+		vector_push(out, &tmp);
+	// left and right parts of the middle band
+	tmp = (struct amcs_rect) {r->x, in.y, in.x - r->x, in.h};
+	if (!amcs_rect_empty(&tmp))
+		vector_push(out, &tmp);
+	tmp = (struct amcs_rect) {in.x + in.w, in.y, r->x + r->w - in.x - in.w, in.h};
+	if (!amcs_rect_empty(&tmp))
+		vector_push(out, &tmp);
+}
+
+/*
+ * Result isn't collapsed to bounding box, so the number of rectangles
+ * may exceed REGION_MAXRECTS.
+ */
+void
+amcs_region_subtract_rect(struct amcs_region *r, const struct amcs_rect *cut)
+{
+	vector res;
+	struct amcs_rect *rect;
+	int i;
+
+	if (amcs_rect_empty(cut) || amcs_region_empty(r))
+		return;
+	vector_init(&res, sizeof(struct amcs_rect), xrealloc);
+	amcs_region_for_each(i, rect, r)
+		rect_subtract(&res, rect, cut);
+	vector_free(&r->rects);
+	r->rects = res;
+}
+
+void
+amcs_region_union_rect(struct amcs_region *r, const struct amcs_rect *rect)
+{
+	if (amcs_rect_empty(rect))
+		return;
+	amcs_region_subtract_rect(r, rect);
+	vector_push(&r->rects, rect);
+}
+
+void
+amcs_region_copy(struct amcs_region *dst, const struct amcs_region *src)
+{
+	struct amcs_rect *rect;
+	int i;
+
+	vector_clear(&dst->rects);
+	amcs_region_for_each(i, rect, src)
+		vector_push(&dst->rects, rect);
+}
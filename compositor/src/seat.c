@@ -15,12 +15,18 @@
 
 #include "utils.h"
 #include "common.h"
+#include "input.h"
 #include "macro.h"
+#include "latency.h"
 #include "orpc.h"
+#include "output.h"
 #include "seat.h"
 #include "wl-server.h"
 
 #define SEAT_NAME "seat0"
+// built-in pointer image, surface units
+#define CURSOR_SIZE 16
+#define MAX_CURSOR_SCALE 4
 
 struct xkb_rule_names DEFAULT_XKB_NAMES = {
 	.rules = NULL,
@@ -30,9 +36,6 @@ struct xkb_rule_names DEFAULT_XKB_NAMES = {
 	.options = NULL,
 };
 
-#define XKB_STATE(st) (st == LIBINPUT_KEY_STATE_RELEASED ? XKB_KEY_UP : XKB_KEY_DOWN)
-#define XKB_KEY(k) (k + 8)
-
 static int
 keymap_file_alloc(struct xkb_keymap *keymap, int *out_sz)
 {
@@ -49,18 +52,303 @@ keymap_file_alloc(struct xkb_keymap *keymap, int *out_sz)
 	return fd;
 }
 
+/* Arrow pixel of the built-in image: 0 -- outside, 1 -- border, 2 -- fill */
+static int
+arrow_pixel(int x, int y)
+{
+	static const int d[][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+	int i, nx, ny;
+
+	if (x > y || 2 * x + y > 22 || y >= CURSOR_SIZE)
+		return 0;
+	for (i = 0; i < ARRSZ(d); i++) {
+		nx = x + d[i][0];
+		ny = y + d[i][1];
+		if (nx < 0 || nx > ny || 2 * nx + ny > 22 || ny >= CURSOR_SIZE)
+			return 1;
+	}
+	return 2;
+}
+
+/*
+ * Show the built-in arrow, used over the background and until the
+ * client under the pointer sets its own image.
+ */
+static void
+cursor_reset(struct amcs_compositor *ctx)
+{
+	static const uint32_t colors[] = {0, 0xff000000, 0xffffffff};
+	static uint32_t img[CURSOR_SIZE * CURSOR_SIZE *
+		MAX_CURSOR_SCALE * MAX_CURSOR_SCALE];
+	int x, y, scale, sz;
+
+	ctx->seat->cursor = NULL;
+	scale = MIN(ctx->output->scale, MAX_CURSOR_SCALE);
+	sz = CURSOR_SIZE * scale;
+	for (y = 0; y < sz; y++) {
+		for (x = 0; x < sz; x++)
+			img[y * sz + x] = colors[arrow_pixel(x / scale, y / scale)];
+	}
+	amcs_output_set_cursor(ctx->output, img, sz, sz, 0, 0);
+}
+
+static void
+pointer_send_frame(struct wl_resource *ptr)
+{
+	if (wl_resource_get_version(ptr) >= WL_POINTER_FRAME_SINCE_VERSION)
+		wl_pointer_send_frame(ptr);
+}
+
+/* wl_pointer of the surface client, NULL if it has none */
+static struct wl_resource *
+surf_pointer(struct amcs_surface *surf)
+{
+	struct amcs_client *c = amcs_get_client(surf->res);
+
+	return c ? c->pointer : NULL;
+}
+
+/* Pointer position in *surf* coordinates */
+static void
+pointer_surface_pos(struct amcs_compositor *ctx, struct amcs_surface *surf,
+		wl_fixed_t *sx, wl_fixed_t *sy)
+{
+	struct amcs_seat *seat = ctx->seat;
+	struct amcs_win *w = surf->aw;
+	double scale = ctx->output->scale;
+
+	// window buffer is in output pixels, *v_box* is its shown part
+	*sx = wl_fixed_from_double((seat->px - w->x + w->v_box.x) / scale);
+	*sy = wl_fixed_from_double((seat->py - w->y + w->v_box.y) / scale);
+}
+
+/* Surface accepting input under the pointer, NULL if none */
+static struct amcs_surface *
+pointer_pick(struct amcs_compositor *ctx)
+{
+	struct amcs_surface *surf;
+	struct amcs_win *w;
+	struct amcs_rect *r;
+	wl_fixed_t sx, sy;
+	int i, x, y;
+
+	w = amcs_output_win_at(ctx->output, ctx->seat->px, ctx->seat->py);
+	if (w == NULL || (surf = amcs_win_get_opaq(w)) == NULL)
+		return NULL;
+	if (surf->input_all)
+		return surf;
+	pointer_surface_pos(ctx, surf, &sx, &sy);
+	x = wl_fixed_to_int(sx);
+	y = wl_fixed_to_int(sy);
+	amcs_region_for_each(i, r, &surf->input) {
+		if (x >= r->x && y >= r->y && x < r->x + r->w && y < r->y + r->h)
+			return surf;
+	}
+	return NULL;
+}
+
+/* Move pointer focus to *surf*, false if it's focused already */
+static bool
+pointer_set_focus(struct amcs_compositor *ctx, struct amcs_surface *surf)
+{
+	struct amcs_seat *seat = ctx->seat;
+	struct wl_resource *ptr;
+	wl_fixed_t sx, sy;
+
+	if (seat->focus == surf)
+		return false;
+	if (seat->focus && (ptr = surf_pointer(seat->focus)) != NULL) {
+		wl_pointer_send_leave(ptr, wl_display_next_serial(ctx->display),
+				seat->focus->res);
+		pointer_send_frame(ptr);
+	}
+	seat->focus = surf;
+	// image of the old client, the new one sets its own on enter
+	cursor_reset(ctx);
+	if (surf && (ptr = surf_pointer(surf)) != NULL) {
+		seat->enter_serial = wl_display_next_serial(ctx->display);
+		pointer_surface_pos(ctx, surf, &sx, &sy);
+		wl_pointer_send_enter(ptr, seat->enter_serial, surf->res, sx, sy);
+		pointer_send_frame(ptr);
+	}
+	return true;
+}
+
+/*
+ * Tell clients about the pointer position, focus may change. False if
+ * nothing is sent.
+ */
+static bool
+pointer_moved(struct amcs_compositor *ctx, uint32_t time)
+{
+	struct amcs_seat *seat = ctx->seat;
+	struct wl_resource *ptr;
+	wl_fixed_t sx, sy;
+
+	// implicit grab: focus is kept until all buttons are released,
+	// enter carries the position already
+	if (seat->nbuttons == 0 && pointer_set_focus(ctx, pointer_pick(ctx)))
+		return seat->focus && surf_pointer(seat->focus);
+	if (seat->focus == NULL || (ptr = surf_pointer(seat->focus)) == NULL)
+		return false;
+	pointer_surface_pos(ctx, seat->focus, &sx, &sy);
+	wl_pointer_send_motion(ptr, time, sx, sy);
+	pointer_send_frame(ptr);
+	return true;
+}
+
+/* False if the focused client has no pointer */
+static bool
+pointer_button(struct amcs_compositor *ctx, uint32_t time, uint32_t button,
+		enum libinput_button_state state)
+{
+	struct amcs_seat *seat = ctx->seat;
+	struct wl_resource *ptr = NULL;
+	bool pressed = state == LIBINPUT_BUTTON_STATE_PRESSED;
+
+	seat->nbuttons = MAX(seat->nbuttons + (pressed ? 1 : -1), 0);
+	if (seat->focus && (ptr = surf_pointer(seat->focus)) != NULL) {
+		wl_pointer_send_button(ptr, wl_display_next_serial(ctx->display),
+			time, button, pressed ? WL_POINTER_BUTTON_STATE_PRESSED :
+				WL_POINTER_BUTTON_STATE_RELEASED);
+		pointer_send_frame(ptr);
+	}
+	// grab is over, another surface may be under the pointer
+	if (seat->nbuttons == 0 && !pressed)
+		pointer_set_focus(ctx, pointer_pick(ctx));
+	return ptr != NULL;
+}
+
+static bool
+pointer_axis(struct amcs_compositor *ctx, const struct amcs_input_event *rec,
+		uint32_t time)
+{
+	static const struct {
+		enum libinput_pointer_axis in;
+		enum wl_pointer_axis out;
+	} axes[] = {
+		{LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL, WL_POINTER_AXIS_VERTICAL_SCROLL},
+		{LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL, WL_POINTER_AXIS_HORIZONTAL_SCROLL},
+	};
+	struct wl_resource *ptr;
+	int i;
+
+	if (ctx->seat->focus == NULL ||
+	    (ptr = surf_pointer(ctx->seat->focus)) == NULL)
+		return false;
+	for (i = 0; i < ARRSZ(axes); i++) {
+		if (!(rec->axis.mask & (1 << axes[i].in)))
+			continue;
+		wl_pointer_send_axis(ptr, time, axes[i].out,
+			wl_fixed_from_double(rec->axis.value[axes[i].in]));
+	}
+	pointer_send_frame(ptr);
+	return true;
+}
+
+static struct amcs_lat_dev *
+lat_dev(struct amcs_seat *seat, int dev)
+{
+	return dev < pvector_len(&seat->lat_devs) ?
+		pvector_get(&seat->lat_devs, dev) : NULL;
+}
+
+static int
+process_pointer_event(struct amcs_compositor *ctx,
+		const struct amcs_input_event *rec)
+{
+	struct amcs_seat *seat = ctx->seat;
+	struct amcs_output *out = ctx->output;
+	struct amcs_lat_sample lat;
+	uint32_t time;
+
+	time = rec->time_usec / 1000;
+	amcs_lat_event(&lat, lat_dev(seat, rec->dev), rec->time_usec,
+		rec->read_usec);
+	switch (rec->type) {
+	case INPUT_MOTION:
+		seat->px += rec->motion.dx;
+		seat->py += rec->motion.dy;
+		break;
+	case INPUT_MOTION_ABSOLUTE:
+		seat->px = rec->abs.x * out->w;
+		seat->py = rec->abs.y * out->h;
+		break;
+	case INPUT_BUTTON:
+		// clients see the click where it happened
+		seat_pointer_flush(ctx);
+		if (pointer_button(ctx, time, rec->button.button,
+				rec->button.state))
+			amcs_lat_queued(&lat);
+		return 0;
+	case INPUT_AXIS:
+		seat_pointer_flush(ctx);
+		if (pointer_axis(ctx, rec, time))
+			amcs_lat_queued(&lat);
+		return 0;
+	default:
+		return 1;
+	}
+	seat->px = MIN(MAX(seat->px, 0), out->w - 1);
+	seat->py = MIN(MAX(seat->py, 0), out->h - 1);
+	// cursor plane follows every event, clients get one motion per
+	// frame at the repaint start
+	amcs_output_move_cursor(out, seat->px, seat->py);
+	seat->motion_time = time;
+	if (!seat->motion_pending) {
+		// coalesced motion is timed from its first event
+		seat->motion_lat = lat;
+		seat->motion_pending = true;
+		amcs_output_schedule_repaint(out);
+	}
+	return 0;
+}
+
 static void
 pointer_set_cursor(struct wl_client *client, struct wl_resource *resource,
 	uint32_t serial, struct wl_resource *surface,
 	int32_t hotspot_x, int32_t hotspot_y)
 {
-	error(1, "writeme");
+	struct amcs_compositor *ctx = &compositor_ctx;
+	struct amcs_seat *seat = ctx->seat;
+	struct amcs_surface *surf;
+
+	// only the client under the pointer may change the image, requests
+	// older than its enter are stale
+	if (seat->focus == NULL ||
+	    wl_resource_get_client(seat->focus->res) != client ||
+	    (int32_t)(serial - seat->enter_serial) < 0)
+		return;
+	surf = surface ? wl_resource_get_user_data(surface) : NULL;
+	if (surf && surf->aw) {
+		wl_resource_post_error(resource, WL_POINTER_ERROR_ROLE,
+			"surface has another role");
+		return;
+	}
+	seat->cursor = surf;
+	seat->hot_x = hotspot_x;
+	seat->hot_y = hotspot_y;
+	if (surf == NULL)
+		amcs_output_set_cursor(ctx->output, NULL, 0, 0, 0, 0);
+	else
+		seat_cursor_commit(surf);
 }
 
 static void
 pointer_release(struct wl_client *client, struct wl_resource *resource)
 {
-	debug("unimplemented");
+	wl_resource_destroy(resource);
+}
+
+static void
+unbind_pointer(struct wl_resource *resource)
+{
+	struct amcs_client *c;
+
+	// client may be gone already
+	c = amcs_get_client(resource);
+	if (c && c->pointer == resource)
+		c->pointer = NULL;
 }
 
 const struct wl_pointer_interface pointer_interface = {
@@ -71,7 +359,20 @@ const struct wl_pointer_interface pointer_interface = {
 static void
 keyboard_release(struct wl_client *client, struct wl_resource *resource)
 {
-	debug("unimplemented");
+	wl_resource_destroy(resource);
+}
+
+static void
+unbind_keyboard(struct wl_resource *resource)
+{
+	struct amcs_client *c;
+
+	if (compositor_ctx.seat->kb_res == resource)
+		compositor_ctx.seat->kb_res = NULL;
+	// client may be gone already
+	c = amcs_get_client(resource);
+	if (c && c->keyboard == resource)
+		c->keyboard = NULL;
 }
 
 const struct wl_keyboard_interface keyboard_interface = {
@@ -109,7 +410,7 @@ seat_new(struct amcs_compositor *ctx)
 	assert(res->input && "can't initialize libinput context");
 
 	libinput_udev_assign_seat(res->input, SEAT_NAME);
-	res->ifd = libinput_get_fd(res->input);
+	pvector_init(&res->lat_devs, xrealloc);
 
 	res->xkb = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 	assert(res->xkb && "can't initialize keyboard context");
@@ -117,7 +418,6 @@ seat_new(struct amcs_compositor *ctx)
 	res->keymap = xkb_keymap_new_from_names(res->xkb, &DEFAULT_XKB_NAMES, 0);
 	assert(res->keymap && "can't create keymap");
 	res->f_keymap = keymap_file_alloc(res->keymap, &res->f_keymap_sz);
-	res->kbstate = xkb_state_new(res->keymap);
 
 	return res;
 }
@@ -127,12 +427,13 @@ seat_free(struct amcs_seat *ps)
 {
 	if (ps == NULL)
 		return;
+	// the thread uses libinput and the keymap
+	amcs_input_free(ps->in);
 	if (ps->udev)
 		udev_unref(ps->udev);
 	if (ps->input)
 		libinput_unref(ps->input);
-	if (ps->kbstate)
-		xkb_state_unref(ps->kbstate);
+	pvector_free(&ps->lat_devs);
 	if (ps->keymap)
 		xkb_keymap_unref(ps->keymap);
 	if (ps->xkb)
@@ -140,114 +441,104 @@ seat_free(struct amcs_seat *ps)
 	free(ps);
 }
 
-#define keymod_set(xkb_key, kb_mode) do {				\
-	index = xkb_keymap_mod_get_index(seat->keymap,		\
-		XKB_MOD_NAME_ ## xkb_key);			\
-	if (xkb_state_mod_index_is_active(seat->kbstate, index,	\
-		XKB_STATE_MODS_DEPRESSED))			\
-		ki->modifiers |= kb_mode;			\
-	} while (0)
-
+/* Send modifiers to the focused client if they differ from the sent ones */
 static void
-ki_state_init(struct amcs_key_info *ki, struct amcs_seat *seat, uint32_t keysym,
-		uint32_t state)
+keyboard_send_modifiers(struct amcs_compositor *ctx, bool force)
 {
-	struct xkb_state *s = seat->kbstate;
-	int index;
+	struct amcs_seat *seat = ctx->seat;
+	struct keyboard_modifiers_state *m = &seat->mods;
 
-	ki->mods.depressed = xkb_state_serialize_mods(s, XKB_STATE_MODS_DEPRESSED);
-	ki->mods.latched = xkb_state_serialize_mods(s, XKB_STATE_MODS_LATCHED);
-	ki->mods.locked = xkb_state_serialize_mods(s, XKB_STATE_MODS_LOCKED);
-	ki->mods.group = xkb_state_serialize_group(s, XKB_STATE_LAYOUT_EFFECTIVE);
-	ki->keysym = keysym;
-	ki->state = state;
-	ki->modifiers = 0;
+	if (!force && memcmp(m, &seat->kb_mods, sizeof(*m)) == 0)
+		return;
+	seat->kb_mods = *m;
+	if (seat->kb_res)
+		wl_keyboard_send_modifiers(seat->kb_res,
+			wl_display_next_serial(ctx->display),
+			m->depressed, m->latched, m->locked, m->group);
+}
 
-	keymod_set(CTRL, KB_CTRL);
-	keymod_set(ALT, KB_ALT);
-	keymod_set(SHIFT, KB_SHIFT);
-	keymod_set(LOGO, KB_WIN);
+/* *res* is the keyboard of the focused client */
+static void
+keyboard_enter(struct amcs_compositor *ctx, struct wl_resource *res)
+{
+	struct amcs_seat *seat = ctx->seat;
+	struct wl_array keys;
+
+	seat->kb_res = res;
+	wl_array_init(&keys);
+	wl_keyboard_send_enter(res, wl_display_next_serial(ctx->display),
+			seat->kb_focus->res, &keys);
+	wl_array_release(&keys);
+	keyboard_send_modifiers(ctx, true);
 }
-#undef keymod_set
 
-static int
-process_keyboard_event(struct amcs_compositor *ctx, struct libinput_event *ev)
+void
+seat_keyboard_focus(struct amcs_compositor *ctx)
 {
-	struct libinput_event_keyboard *k;
-	struct amcs_client *client;
+	struct amcs_seat *seat = ctx->seat;
+	struct amcs_surface *surf = NULL;
+	struct amcs_client *c;
 	struct amcs_win *w;
-	struct amcs_surface *surf;
-	struct amcs_key_info ki = {0};
-	struct wl_array arr;
-	uint32_t serial, time, key;
-	uint32_t state;
-	xkb_keysym_t keysym;
-
-	k = libinput_event_get_keyboard_event(ev);
-	time = libinput_event_keyboard_get_time(k);
-	key = libinput_event_keyboard_get_key(k);
-	state = libinput_event_keyboard_get_key_state(k);
-	xkb_state_update_key(ctx->seat->kbstate, XKB_KEY(key), XKB_STATE(state));
-	keysym = xkb_state_key_get_one_sym(ctx->seat->kbstate, XKB_KEY(key));
-
-	client = amcs_current_client();
-	debug("focused client = %p", client);
-
-	ki_state_init(&ki, ctx->seat, keysym, state);
-	if (amcs_compositor_handle_key(ctx, &ki))
-		return 0;
-
-	if (client == NULL || client->keyboard == NULL) {
-		warning("can't send keyboard event, no client keyboard connection");
-		return 1;
-	}
-
-	w = amcs_current_window();
-	if (w == NULL)
-		return 1;
-
-	serial = wl_display_next_serial(ctx->display);
-	surf = amcs_win_get_opaq(w);
-	assert(surf && "can't get amcs_surface from amcs_win");
 
-	wl_array_init(&arr);
-	wl_keyboard_send_enter(client->keyboard, serial, surf->res, &arr);
-	wl_array_release(&arr);
-
-	wl_keyboard_send_modifiers(client->keyboard,
-		wl_display_next_serial(ctx->display),
-		ki.mods.depressed, ki.mods.latched, ki.mods.locked, ki.mods.group);
-	wl_keyboard_send_key(client->keyboard,
-		wl_display_next_serial(ctx->display),
-		time, key, state);
-
-	if (surf->redraw_cb)
-		wl_callback_send_done(surf->redraw_cb, get_time());
-
-	debug("send (time, key, state, layout) (%d, %d, %d, %d)", time, key, state, ki.mods.group);
-	return 0;
+	if (seat == NULL)
+		return;
+	if ((w = amcs_current_window()) != NULL)
+		surf = amcs_win_get_opaq(w);
+	if (seat->kb_focus == surf)
+		return;
+	if (seat->kb_res)
+		wl_keyboard_send_leave(seat->kb_res,
+			wl_display_next_serial(ctx->display), seat->kb_focus->res);
+	seat->kb_focus = surf;
+	seat->kb_res = NULL;
+	// client lookup is done on focus change only
+	if (surf && (c = amcs_get_client(surf->res)) != NULL && c->keyboard)
+		keyboard_enter(ctx, c->keyboard);
 }
 
+/* Key is translated by the input thread already */
 static int
-get_dev_caps(struct libinput_device *dev)
+process_keyboard_event(struct amcs_compositor *ctx,
+		const struct amcs_input_event *rec)
 {
-	int res = 0;
-	if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_KEYBOARD))
-		res |= WL_SEAT_CAPABILITY_KEYBOARD;
-	if (libinput_device_has_capability(dev, LIBINPUT_DEVICE_CAP_POINTER))
-		res |= WL_SEAT_CAPABILITY_POINTER;;
-	return res;
+	struct amcs_seat *seat = ctx->seat;
+	struct amcs_key_info ki = rec->key.ki;
+	struct amcs_lat_sample lat;
+	bool handled;
+
+	amcs_lat_event(&lat, lat_dev(seat, rec->dev), rec->time_usec,
+		rec->read_usec);
+	seat->mods = ki.mods;
+	handled = amcs_compositor_handle_key(ctx, &ki);
+	// binding may have switched the current window
+	seat_keyboard_focus(ctx);
+	if (!handled && seat->kb_res) {
+		wl_keyboard_send_key(seat->kb_res,
+			wl_display_next_serial(ctx->display), rec->time_usec / 1000,
+			rec->key.key, ki.state);
+		amcs_lat_queued(&lat);
+	}
+	// modifier keys are tracked by the client even if a binding took them
+	keyboard_send_modifiers(ctx, false);
+	return 0;
 }
 
 static void
-update_capabilities(struct libinput_device *dev, int isAdd)
+update_capabilities(int caps, int isAdd)
 {
 	struct amcs_client *c;
-	int caps;
 
 	assert(isAdd == 1 && "unimplemented yet");
 
-	caps = get_dev_caps(dev);
+	// first pointer device, show the pointer in the middle
+	if ((caps & WL_SEAT_CAPABILITY_POINTER) &&
+	    !(compositor_ctx.seat->capabilities & WL_SEAT_CAPABILITY_POINTER)) {
+		compositor_ctx.seat->px = compositor_ctx.output->w / 2;
+		compositor_ctx.seat->py = compositor_ctx.output->h / 2;
+		amcs_output_move_cursor(compositor_ctx.output,
+			compositor_ctx.seat->px, compositor_ctx.seat->py);
+		cursor_reset(&compositor_ctx);
+	}
 	if ((compositor_ctx.seat->capabilities & caps) !=  caps) {
 		compositor_ctx.seat->capabilities |= caps;
 		wl_list_for_each(c, &compositor_ctx.clients, link) {
@@ -256,48 +547,38 @@ update_capabilities(struct libinput_device *dev, int isAdd)
 	}
 }
 
+/* Records queued by the input thread */
 static int
 notify_seat(int fd, uint32_t mask, void *data)
 {
 	struct amcs_compositor *ctx;
 	struct amcs_seat *seat;
-	struct libinput_event *ev = NULL;
+	struct amcs_input_event rec;
 
 	ctx = (struct amcs_compositor *) data;
 	seat = ctx->seat;
-	debug("notify_seat triggered");
-	libinput_dispatch(seat->input);
-	while ((ev = libinput_get_event(seat->input)) != NULL) {
-		struct libinput_device *dev;
-		int evtype;
-		evtype = libinput_event_get_type(ev);
-		switch (evtype) {
-		case LIBINPUT_EVENT_DEVICE_ADDED:
-			dev = libinput_event_get_device(ev);
-			debug("device added sysname = %s, name %s",
-					libinput_device_get_sysname(dev),
-					libinput_device_get_name(dev));
-			update_capabilities(dev, 1);
+	amcs_input_drain(seat->in);
+	while (amcs_input_pop(seat->in, &rec)) {
+		switch (rec.type) {
+		case INPUT_DEVICE_ADDED:
+			// records are numbered as devices are added
+			pvector_push(&seat->lat_devs,
+				amcs_lat_dev_new(rec.device.name));
+			free(rec.device.name);
+			update_capabilities(rec.device.caps, 1);
 			break;
-		case LIBINPUT_EVENT_DEVICE_REMOVED:
-			debug("device removed");
-			update_capabilities(dev, 0);
-			break;
-		case LIBINPUT_EVENT_KEYBOARD_KEY:
+		case INPUT_KEY:
 			//if (ctx->isactive)
-				process_keyboard_event(ctx, ev);
-			break;
-		case LIBINPUT_EVENT_POINTER_MOTION:
-			debug("mouse moved");
+				process_keyboard_event(ctx, &rec);
 			break;
-		case LIBINPUT_EVENT_POINTER_BUTTON:
-			debug("mouse key pressed");
+		case INPUT_MODIFIERS:
+			seat->mods = rec.mods;
+			keyboard_send_modifiers(ctx, false);
 			break;
 		default:
-			debug("next input event %p, type = %d", ev, evtype);
+			process_pointer_event(ctx, &rec);
 			break;
 		}
-		libinput_event_destroy(ev);
 	}
 	return 0;
 }
@@ -313,7 +594,8 @@ seat_get_pointer(struct wl_client *client, struct wl_resource *resource,
 
 	RESOURCE_CREATE(res, client, &wl_pointer_interface,
 			wl_resource_get_version(resource), id);
-	wl_resource_set_implementation(res, &pointer_interface, resource, NULL);
+	wl_resource_set_implementation(res, &pointer_interface, resource,
+			unbind_pointer);
 	assert(c->pointer == NULL && "pointer not null");
 	c->pointer = res;
 }
@@ -330,15 +612,18 @@ seat_get_keyboard(struct wl_client *client, struct wl_resource *resource,
 
 	RESOURCE_CREATE(res, client, &wl_keyboard_interface,
 			wl_resource_get_version(resource), id);
-	wl_resource_set_implementation(res, &keyboard_interface, resource, NULL);
+	wl_resource_set_implementation(res, &keyboard_interface, resource,
+			unbind_keyboard);
 	assert(c->keyboard == NULL && "keyboard not null");
 	c->keyboard = res;
 	wl_keyboard_send_keymap(res, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
 			ctx->seat->f_keymap,
 			ctx->seat->f_keymap_sz);
 	wl_keyboard_send_repeat_info(res, 200, 200);
-	wl_keyboard_send_modifiers(res,
-			wl_display_next_serial(ctx->display), 0, 0, 0, 0);
+	// focused window asked for the keyboard after it got the focus
+	if (ctx->seat->kb_focus && ctx->seat->kb_res == NULL &&
+	    wl_resource_get_client(ctx->seat->kb_focus->res) == client)
+		keyboard_enter(ctx, res);
 }
 
 static void
@@ -396,9 +681,12 @@ seat_init(struct amcs_compositor *ctx)
 		return 1;
 	}
 	ctx->seat = seat_new(ctx);
+	// before the thread, the dump signal is blocked in it
+	amcs_lat_init(ctx->evloop);
+	ctx->seat->in = amcs_input_new(ctx->seat->input, ctx->seat->keymap);
 
-	wl_event_loop_add_fd(ctx->evloop, ctx->seat->ifd, WL_EVENT_READABLE,
-			notify_seat, ctx);
+	wl_event_loop_add_fd(ctx->evloop, amcs_input_fd(ctx->seat->in),
+			WL_EVENT_READABLE, notify_seat, ctx);
 	return 0;
 }
 
@@ -406,27 +694,70 @@ int
 seat_finalize(struct amcs_compositor *ctx)
 {
 	seat_free(compositor_ctx.seat);
+	amcs_lat_finalize();
 	if (ctx->seat)
 		wl_global_destroy(ctx->g.seat);
 	return 0;
 
 }
 
+void
+seat_pointer_flush(struct amcs_compositor *ctx)
+{
+	struct amcs_seat *seat = ctx->seat;
+
+	if (seat == NULL || !seat->motion_pending)
+		return;
+	seat->motion_pending = false;
+	if (pointer_moved(ctx, seat->motion_time))
+		amcs_lat_queued(&seat->motion_lat);
+}
+
+void
+seat_cursor_commit(struct amcs_surface *surf)
+{
+	struct amcs_compositor *ctx = &compositor_ctx;
+	struct amcs_seat *seat = ctx->seat;
+	int scale = ctx->output->scale;
+
+	if (seat == NULL || seat->cursor != surf || surf->image.dt == NULL)
+		return;
+	// image is in output pixels already
+	amcs_output_set_cursor(ctx->output, surf->image.dt, surf->image.w,
+		surf->image.h, seat->hot_x * scale, seat->hot_y * scale);
+}
+
+void
+seat_surface_gone(struct amcs_surface *surf)
+{
+	struct amcs_seat *seat = compositor_ctx.seat;
+
+	if (seat == NULL)
+		return;
+	// no leave, the client knows its surface is destroyed
+	if (seat->kb_focus == surf) {
+		seat->kb_focus = NULL;
+		seat->kb_res = NULL;
+	}
+	if (seat->focus == surf) {
+		seat->focus = NULL;
+		cursor_reset(&compositor_ctx);
+	} else if (seat->cursor == surf) {
+		cursor_reset(&compositor_ctx);
+	}
+}
+
 int
 keyboard_layout_toggle(struct amcs_compositor *ctx)
 {
-	int n;
-	struct amcs_key_info ki = {0};
 	if (!ctx->seat)
 		return -1;
 
-	n = xkb_keymap_num_layouts(ctx->seat->keymap);
-
-	ki_state_init(&ki, ctx->seat, 0, 0);
-	assert(n && "OMG, no layouts :-(");
-	ki.mods.group = (ki.mods.group + 1) % n;
-	xkb_state_update_mask(ctx->seat->kbstate,
-		ki.mods.depressed, ki.mods.latched, ki.mods.locked, 0, 0, ki.mods.group);
+	assert(xkb_keymap_num_layouts(ctx->seat->keymap) &&
+		"OMG, no layouts :-(");
+	// xkb state is owned by the input thread, modifiers are sent
+	// when it reports the new group
+	amcs_input_layout_next(ctx->seat->in);
 	return 0;
 }
 
@@ -0,0 +1,86 @@
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+#include "macro.h"
+#include "transform.h"
+
+int
+amcs_transform_invert(int transform)
+{
+	// only plain rotations by 90 and 270 degrees aren't involutions
+	if (transform == WL_OUTPUT_TRANSFORM_90)
+		return WL_OUTPUT_TRANSFORM_270;
+	if (transform == WL_OUTPUT_TRANSFORM_270)
+		return WL_OUTPUT_TRANSFORM_90;
+	return transform;
+}
+
+/* Pixel (x, y) of *w* x *h* image is at (tx, ty) of the transformed one */
+void
+amcs_transform_point(int transform, int w, int h, int x, int y,
+		int *tx, int *ty)
+{
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	default:
+		*tx = x, *ty = y;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		*tx = y, *ty = w - 1 - x;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		*tx = w - 1 - x, *ty = h - 1 - y;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		*tx = h - 1 - y, *ty = x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		*tx = w - 1 - x, *ty = y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		*tx = y, *ty = x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		*tx = x, *ty = h - 1 - y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		*tx = h - 1 - y, *ty = w - 1 - x;
+		break;
+	}
+}
+
+void
+amcs_transform_rect(int transform, int w, int h, const struct amcs_rect *r,
+		struct amcs_rect *out)
+{
+	int x1, y1, x2, y2;
+
+	if (amcs_rect_empty(r)) {
+		*out = *r;
+		return;
+	}
+	// opposite corners stay opposite
+	amcs_transform_point(transform, w, h, r->x, r->y, &x1, &y1);
+	amcs_transform_point(transform, w, h, r->x + r->w - 1, r->y + r->h - 1,
+			&x2, &y2);
+	out->x = MIN(x1, x2);
+	out->y = MIN(y1, y2);
+	out->w = MAX(x1, x2) - out->x + 1;
+	out->h = MAX(y1, y2) - out->y + 1;
+}
+
+const uint8_t *
+amcs_transform_src(int transform, int w, int h, const struct amcs_rect *r,
+		const uint8_t *src, int pitch, long *sx_step, long *sy_step)
+{
+	int x0, y0, x1, y1;
+
+	// mapping is affine, steps are the same for every pixel
+	amcs_transform_point(transform, w, h, r->x, r->y, &x0, &y0);
+	amcs_transform_point(transform, w, h, r->x + 1, r->y, &x1, &y1);
+	*sx_step = (long)(y1 - y0) * pitch + (x1 - x0) * 4;
+	amcs_transform_point(transform, w, h, r->x, r->y + 1, &x1, &y1);
+	*sy_step = (long)(y1 - y0) * pitch + (x1 - x0) * 4;
+	return src + (long)y0 * pitch + x0 * 4;
+}
@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <stdbool.h>
+
+#include <wayland-server.h>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+
+#include "viewporter-server.h"
+
+#include "common.h"
+#include "macro.h"
+#include "viewporter.h"
+#include "wl-server.h"
+
+static const struct amcs_viewport viewport_unset = {-1, -1, -1, -1, -1, -1};
+
+static void
+destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+/* Viewport is removed on the next commit of its surface */
+static void
+delete_viewport(struct wl_resource *resource)
+{
+	struct amcs_surface *mysurf = wl_resource_get_user_data(resource);
+
+	if (mysurf == NULL)
+		return;
+	mysurf->pending.vp = viewport_unset;
+	mysurf->viewport = NULL;
+}
+
+static struct amcs_surface *
+viewport_surface(struct wl_resource *resource)
+{
+	struct amcs_surface *mysurf = wl_resource_get_user_data(resource);
+
+	if (mysurf == NULL)
+		wl_resource_post_error(resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+			"surface is destroyed");
+	return mysurf;
+}
+
+static void
+viewport_set_source(struct wl_client *client, struct wl_resource *resource,
+	wl_fixed_t x, wl_fixed_t y, wl_fixed_t width, wl_fixed_t height)
+{
+	struct amcs_surface *mysurf;
+	const wl_fixed_t unset = wl_fixed_from_int(-1);
+
+	if ((mysurf = viewport_surface(resource)) == NULL)
+		return;
+	if (x == unset && y == unset && width == unset && height == unset) {
+		mysurf->pending.vp.src_x = mysurf->pending.vp.src_y = -1;
+		mysurf->pending.vp.src_w = mysurf->pending.vp.src_h = -1;
+		return;
+	}
+	if (x < 0 || y < 0 || width <= 0 || height <= 0) {
+		wl_resource_post_error(resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+			"invalid source %f, %f, %fx%f",
+			wl_fixed_to_double(x), wl_fixed_to_double(y),
+			wl_fixed_to_double(width), wl_fixed_to_double(height));
+		return;
+	}
+	mysurf->pending.vp.src_x = x;
+	mysurf->pending.vp.src_y = y;
+	mysurf->pending.vp.src_w = width;
+	mysurf->pending.vp.src_h = height;
+}
+
+static void
+viewport_set_destination(struct wl_client *client, struct wl_resource *resource,
+	int32_t width, int32_t height)
+{
+	struct amcs_surface *mysurf;
+
+	if ((mysurf = viewport_surface(resource)) == NULL)
+		return;
+	if (!(width == -1 && height == -1) && (width <= 0 || height <= 0)) {
+		wl_resource_post_error(resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+			"invalid destination %dx%d", width, height);
+		return;
+	}
+	mysurf->pending.vp.dst_w = width;
+	mysurf->pending.vp.dst_h = height;
+}
+
+static const struct wp_viewport_interface viewport_interface = {
+	.destroy = destroy,
+	.set_source = viewport_set_source,
+	.set_destination = viewport_set_destination,
+};
+
+static void
+viewporter_get_viewport(struct wl_client *client, struct wl_resource *resource,
+	uint32_t id, struct wl_resource *surface)
+{
+	struct amcs_surface *mysurf = wl_resource_get_user_data(surface);
+
+	if (mysurf->viewport) {
+		wl_resource_post_error(resource,
+			WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS,
+			"surface already has a viewport");
+		return;
+	}
+	RESOURCE_CREATE(resource, client, &wp_viewport_interface,
+		wl_resource_get_version(resource), id);
+	wl_resource_set_implementation(resource, &viewport_interface,
+		mysurf, delete_viewport);
+	mysurf->viewport = resource;
+}
+
+static const struct wp_viewporter_interface viewporter_interface = {
+	.destroy = destroy,
+	.get_viewport = viewporter_get_viewport,
+};
+
+static void
+bind_viewporter(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	RESOURCE_CREATE(resource, client, &wp_viewporter_interface, version, id);
+	wl_resource_set_implementation(resource, &viewporter_interface,
+				       data, NULL);
+}
+
+void
+viewporter_surface_gone(struct amcs_surface *surf)
+{
+	// viewport outlives its surface, further requests are errors
+	if (surf->viewport)
+		wl_resource_set_user_data(surf->viewport, NULL);
+	surf->viewport = NULL;
+	surf->pending.vp = surf->vp = viewport_unset;
+}
+
+void
+viewporter_surface_init(struct amcs_surface *surf)
+{
+	surf->pending.vp = surf->vp = viewport_unset;
+}
+
+int
+viewporter_init(struct amcs_compositor *ctx)
+{
+	ctx->g.viewporter = wl_global_create(ctx->display,
+			&wp_viewporter_interface, 1, ctx, &bind_viewporter);
+	if (!ctx->g.viewporter) {
+		warning("can't create viewporter interface");
+		return 1;
+	}
+	return 0;
+}
+
+int
+viewporter_finalize(struct amcs_compositor *ctx)
+{
+	if (ctx->g.viewporter)
+		wl_global_destroy(ctx->g.viewporter);
+	ctx->g.viewporter = NULL;
+	return 0;
+}
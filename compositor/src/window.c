@@ -35,24 +35,65 @@ struct amcs_win *amcs_win_new(struct amcs_container *par, void *opaq,
 		win_update_cb upd);
 void amcs_win_free(struct amcs_win *w);
 
-static struct amcs_container *
-win_get_root(struct amcs_win *w)
+static inline struct amcs_workspace *
+win_get_workspace(struct amcs_win *w)
 {
-	struct amcs_container *wt = AMCS_CONTAINER(w);
+	struct amcs_workspace *ws;
 
-	assert(w);
-	while (wt->parent)
-		wt = wt->parent;
-	return wt;
+	ws = w->type == WT_WIN ? w->ws : AMCS_CONTAINER(w)->ws;
+	assert(ws && "can't get workspace from container");
+	return ws;
 }
 
-static inline struct amcs_workspace *
-win_get_workspace(struct amcs_win *w)
+/* Remember workspace in every node of the subtree */
+static void
+win_set_workspace(struct amcs_win *w, struct amcs_workspace *ws)
 {
-	struct amcs_container *r;
-	r = win_get_root(w);
-	assert(r && r->ws && "can't get workspace from container");
-	return r->ws;
+	struct amcs_container *wt;
+	struct amcs_win *sub;
+	int i;
+
+	if (w->type == WT_WIN) {
+		w->ws = ws;
+		return;
+	}
+	wt = AMCS_CONTAINER(w);
+	wt->ws = ws;
+	pvector_for_each(i, sub, &wt->subwins)
+		win_set_workspace(sub, ws);
+}
+
+static inline bool
+win_shown(struct amcs_workspace *ws)
+{
+	return ws && ws->out && ws->out->ws == ws;
+}
+
+/*
+ * Mark *w* dirty, every ancestor gets WIN_DIRTY_CHILD. The first
+ * invalidation of a shown workspace schedules repaint, layout is
+ * updated when it starts.
+ */
+static void
+win_invalidate(struct amcs_win *w, unsigned int flags)
+{
+	struct amcs_container *wt = AMCS_CONTAINER(w);
+	struct amcs_workspace *ws;
+
+	w->dirty |= flags;
+	while (wt->parent) {
+		wt = wt->parent;
+		wt->dirty |= WIN_DIRTY_CHILD;
+	}
+	// detached subtree, it's invalidated again on insertion
+	if (wt->type != WT_TREE || (ws = wt->ws) == NULL)
+		return;
+	if (ws->dirty)
+		return;
+	ws->dirty |= WIN_DIRTY_CHILD;
+	// transaction commit runs layout by itself
+	if (ws->txn == 0 && win_shown(ws))
+		amcs_output_schedule_repaint(ws->out);
 }
 
 /* search nearby amcs_win recursively */
@@ -160,6 +201,7 @@ amcs_workspace_set_output(struct amcs_workspace *ws, struct amcs_output *out)
 		ws->root->y = ws->y;
 		ws->root->h = ws->h;
 		ws->root->w = ws->w;
+		win_invalidate(AMCS_WIN(ws->root), WIN_DIRTY_GEOM);
 	}
 }
 
@@ -198,7 +240,7 @@ amcs_workspace_win_move(struct amcs_workspace *ws, enum ws_lookup_dir direction)
 	w = win_get_neighbour_win(ws->current, direction);
 	if (w == NULL)
 		return;
-	//TODO: update window only after move
+	amcs_workspace_begin(ws);
 	oldroot = ws->current->parent;
 	pos = amcs_container_pos(w->parent, w);
 	amcs_container_remove(oldroot, ws->current);
@@ -210,13 +252,12 @@ amcs_workspace_win_move(struct amcs_workspace *ws, enum ws_lookup_dir direction)
 	}
 	amcs_container_resize_subwins(w->parent);
 	amcs_container_resize_subwins(oldroot);
+	amcs_workspace_commit(ws);
 }
 
 void amcs_workspace_redraw(struct amcs_workspace *ws)
 {
 	assert(ws && ws->root && ws->out);
-	if (amcs_container_nmemb(ws->root) == 0)
-		amcs_output_clear(ws->out);
 	amcs_container_resize_subwins(ws->root);
 }
 
@@ -231,10 +272,13 @@ amcs_workspace_new_win(struct amcs_workspace  *ws, void *opaq,
 	else
 		r = ws->root;
 	assert(r && "can't get temporary root container");
+	amcs_workspace_begin(ws);
 	res = amcs_win_new(r, opaq, upd);
 	amcs_container_resize_subwins(r);
 	debug("===== win %p root %p", res, r);
 	ws->current = res;
+	// caller needs window geometry right now
+	amcs_workspace_commit(ws);
 	return res;
 }
 
@@ -255,12 +299,14 @@ int amcs_workspace_split(struct amcs_workspace *ws)
 		par->wt = type;
 		return 0;
 	}
+	amcs_workspace_begin(ws);
 	c = amcs_container_new(NULL, type);
 	pos = amcs_container_pos(par, ws->current);
 	amcs_container_remove_idx(par, pos);
 	amcs_container_insert(c, ws->current, 0);
 	amcs_container_insert(par, AMCS_WIN(c), pos);
 	amcs_container_resize_subwins(par);
+	amcs_workspace_commit(ws);
 	return 0;
 }
 
@@ -326,6 +372,9 @@ amcs_container_insert(struct amcs_container *wt, struct amcs_win *w, int pos)
 		pos = pvector_len(&wt->subwins);
 	pvector_add(&wt->subwins, pos, w);
 	w->parent = wt;
+	win_set_workspace(w, wt->ws);
+	win_invalidate(w, WIN_DIRTY_GEOM);
+	win_invalidate(AMCS_WIN(wt), WIN_DIRTY_GEOM);
 	return 0;
 }
 
@@ -356,6 +405,7 @@ amcs_container_remove(struct amcs_container *wt, struct amcs_win *w)
 		struct amcs_win *w;
 		w = pvector_get(&wt->subwins, pos);
 		w->parent = NULL;
+		win_set_workspace(w, NULL);
 
 		pvector_del(&wt->subwins, pos);
 		amcs_container_resize_subwins(wt);
@@ -370,6 +420,7 @@ amcs_container_remove_idx(struct amcs_container *wt, int pos)
 {
 	assert(wt && wt->type == WT_TREE);
 
+	win_set_workspace(pvector_get(&wt->subwins, pos), NULL);
 	pvector_del(&wt->subwins, pos);
 	amcs_container_resize_subwins(wt);
 	return 0;
@@ -396,8 +447,11 @@ amcs_win_new(struct amcs_container *par, void *opaq, win_update_cb upd)
 	res = xmalloc(sizeof(*res));
 	memset(res, 0, sizeof(*res));
 	res->type = WT_WIN;
+	res->draw_idx = -1;
 	res->opaq = opaq;
 	res->upd_cb = upd;
+	amcs_region_init(&res->damage);
+	amcs_region_init(&res->opaque);
 	if (par)
 		amcs_container_insert(par, res, -1);
 	return res;
@@ -410,41 +464,53 @@ amcs_win_free(struct amcs_win *w)
 	amcs_win_orphain(w);
 	if (w->buf.dt)
 		free(w->buf.dt);
+	amcs_region_fini(&w->damage);
+	amcs_region_fini(&w->opaque);
 	free(w);
 }
 
-static int
-_commit_cb(struct amcs_win *w, void *opaq)
+/* Window geometry is changed: redraw it and notify the client */
+static void
+win_layout(struct amcs_workspace *ws, struct amcs_win *w)
 {
 	int rc;
-	debug("commit cb");
-	if (w && w->type == WT_WIN && w->buf.dt) {
-		amcs_win_commit(w);
+
+	if (w->dirty & WIN_DIRTY_GEOM) {
+		if (amcs_buf_attached(&w->buf)) {
+			amcs_win_damage_all(w);
+			amcs_win_commit(w);
+		}
 		if (w->upd_cb) {
 			rc = w->upd_cb(w, w->opaq);
-			assert(rc == 0 || "TODO: writeme");
+			assert(rc == 0 || rc == WIN_UPD_CONFIGURE);
+			if (rc == WIN_UPD_CONFIGURE && !w->configuring) {
+				w->configuring = true;
+				ws->nconfiguring++;
+			}
 		}
 	}
-	return 0;
+	w->dirty = 0;
 }
 
-int
-amcs_container_resize_subwins(struct amcs_container *wt)
+/* Compute boxes of *wt* children, moved ones become dirty */
+static void
+container_place_subwins(struct amcs_container *wt)
 {
+	struct amcs_workspace *ws;
+	struct amcs_rect r = {wt->x, wt->y, wt->w, wt->h};
 	int i, nwin, step;
+	int x, y, w, h;
 
-	if (wt == NULL || wt->type == WT_WIN)
-		return 0;
+	// old content of removed or moved windows
+	ws = win_get_workspace(AMCS_WIN(wt));
+	if (win_shown(ws)) {
+		amcs_output_damage(ws->out, &r);
+		amcs_output_invalidate_scene(ws->out);
+	}
 
 	nwin = pvector_len(&wt->subwins);
-	if (nwin == 0) {
-		struct amcs_workspace *ws;
-		ws = win_get_workspace(AMCS_WIN(wt));
-		// Special case, clear buffer if last workspace window is deleted
-		if (wt == ws->root)
-			amcs_output_clear(ws->out);
-		return 0;
-	}
+	if (nwin == 0)
+		return;
 
 	if (wt->wt == CONTAINER_HSPLIT) {
 		step = wt->h / nwin;
@@ -459,21 +525,53 @@ amcs_container_resize_subwins(struct amcs_container *wt)
 		tmp = pvector_get(&wt->subwins, i);
 
 		if (wt->wt == CONTAINER_HSPLIT) {
-			tmp->x = wt->x;
-			tmp->y = wt->y + i * step;
-			tmp->w = wt->w;
-			tmp->h = step;
+			x = wt->x;
+			y = wt->y + i * step;
+			w = wt->w;
+			h = step;
 		} else {
-			tmp->x = wt->x + i * step;
-			tmp->y = wt->y;
-			tmp->w = step;
-			tmp->h = wt->h;
-		}
-		if (tmp->type == WT_TREE) {
-			amcs_container_resize_subwins(AMCS_CONTAINER(tmp));
+			x = wt->x + i * step;
+			y = wt->y;
+			w = step;
+			h = wt->h;
 		}
+		if (tmp->x == x && tmp->y == y && tmp->w == w && tmp->h == h)
+			continue;
+		tmp->x = x;
+		tmp->y = y;
+		tmp->w = w;
+		tmp->h = h;
+		tmp->dirty |= WIN_DIRTY_GEOM;
 	}
-	amcs_container_pass(wt, _commit_cb, NULL);
+}
+
+/* Visit only dirty subtrees */
+static void
+container_layout(struct amcs_workspace *ws, struct amcs_container *wt)
+{
+	struct amcs_win *sub;
+	int i;
+
+	if (wt->dirty & WIN_DIRTY_GEOM)
+		container_place_subwins(wt);
+	pvector_for_each(i, sub, &wt->subwins) {
+		if (sub->dirty == 0)
+			continue;
+		if (sub->type == WT_TREE)
+			container_layout(ws, AMCS_CONTAINER(sub));
+		else
+			win_layout(ws, sub);
+	}
+	wt->dirty = 0;
+}
+
+/* Geometry is recomputed by the next amcs_workspace_update() */
+int
+amcs_container_resize_subwins(struct amcs_container *wt)
+{
+	if (wt == NULL || wt->type == WT_WIN)
+		return 0;
+	win_invalidate(AMCS_WIN(wt), WIN_DIRTY_GEOM);
 	return 0;
 }
 
@@ -484,6 +582,12 @@ amcs_container_nmemb(struct amcs_container *wt)
 	return pvector_len(&wt->subwins);
 }
 
+struct amcs_workspace *
+amcs_win_get_workspace(struct amcs_win *w)
+{
+	return win_get_workspace(w);
+}
+
 int
 amcs_win_commit(struct amcs_win *win)
 {
@@ -493,9 +597,45 @@ amcs_win_commit(struct amcs_win *win)
 	debug("get workspace %p", ws);
 	if (ws->out == NULL)
 		return -1;
+	if (ws->out->ws != ws) {
+		// workspace is hidden, nothing to draw
+		amcs_region_clear(&win->damage);
+		return 0;
+	}
 	return amcs_output_update_region(ws->out, win);
 }
 
+void
+amcs_win_configured(struct amcs_win *w)
+{
+	struct amcs_workspace *ws;
+
+	assert(w && w->type == WT_WIN);
+	if (!w->configuring)
+		return;
+	w->configuring = false;
+	if (w->ws == NULL)
+		return;
+	ws = win_get_workspace(w);
+	if (--ws->nconfiguring == 0 && win_shown(ws))
+		amcs_output_thaw(ws->out);
+}
+
+void
+amcs_win_damage(struct amcs_win *w, int x, int y, int width, int height)
+{
+	assert(w && w->type == WT_WIN);
+	amcs_region_add(&w->damage, x, y, width, height);
+}
+
+void
+amcs_win_damage_all(struct amcs_win *w)
+{
+	assert(w && w->type == WT_WIN);
+	amcs_region_clear(&w->damage);
+	amcs_region_add(&w->damage, 0, 0, w->buf.w, w->buf.h);
+}
+
 int
 amcs_win_orphain(struct amcs_win *w)
 {
@@ -505,17 +645,24 @@ amcs_win_orphain(struct amcs_win *w)
 	assert(w);
 	if (w->parent == NULL)
 		return 1;
+	// don't wait for a window which is gone
+	amcs_win_configured(w);
 	par = w->parent;
 	ws = win_get_workspace(w);
 	if (ws->current == w) {
 		ws->current = win_get_neighbour_win(w, WS_ANY);
 	}
+	// scene mustn't refer to the window anymore
+	if (win_shown(ws))
+		amcs_output_invalidate_scene(ws->out);
+	amcs_workspace_begin(ws);
 	amcs_container_remove(par, w);
 	while (amcs_container_nmemb(par) == 0 && par->parent) {
 		struct amcs_container *tmp = par;
 		par = par->parent;
 		amcs_container_remove(par, AMCS_WIN(tmp));
 	}
+	amcs_workspace_commit(ws);
 
 	return 0;
 }
@@ -529,21 +676,60 @@ _print_cb(struct amcs_win *w, void *opaq)
 	return 0;
 }
 
+void
+amcs_workspace_update(struct amcs_workspace *ws)
+{
+	assert(ws && ws->root);
+	if (ws->dirty == 0 || ws->txn > 0)
+		return;
+	ws->dirty = 0;
+	if (ws->root->dirty)
+		container_layout(ws, ws->root);
+	// hold the new layout until clients redraw resized windows
+	if (ws->nconfiguring > 0 && win_shown(ws))
+		amcs_output_freeze(ws->out);
+}
+
 static int
-_upd_cb(struct amcs_win *w, void *opaq)
+win_configure_expire(struct amcs_win *w, void *opaq)
 {
-	debug("");
-	if (w->type != WT_WIN)
-		return 0;
-	if (w->upd_cb)
-		return w->upd_cb(w, w->opaq);
+	if (w->type == WT_WIN)
+		w->configuring = false;
 	return 0;
 }
 
 void
-amcs_workspace_update(struct amcs_workspace *ws)
+amcs_workspace_configure_expire(struct amcs_workspace *ws)
+{
+	if (ws == NULL || ws->nconfiguring == 0)
+		return;
+	amcs_container_pass(ws->root, win_configure_expire, NULL);
+	ws->nconfiguring = 0;
+}
+
+void
+amcs_workspace_begin(struct amcs_workspace *ws)
+{
+	assert(ws);
+	ws->txn++;
+}
+
+void
+amcs_workspace_commit(struct amcs_workspace *ws)
+{
+	assert(ws && ws->txn > 0);
+	if (--ws->txn > 0)
+		return;
+	// hidden workspace is updated when it's shown
+	if (win_shown(ws))
+		amcs_workspace_update(ws);
+}
+
+int
+amcs_workspace_pass(struct amcs_workspace *ws, win_pass_cb cb, void *opaq)
 {
-	amcs_container_pass(ws->root, _upd_cb, NULL);
+	assert(ws);
+	return amcs_container_pass(ws->root, cb, opaq);
 }
 
 void
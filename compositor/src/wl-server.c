@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,6 +9,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "viewporter-server.h"
 #include "xdg-shell-server.h"
 #include <sys/types.h>
 
@@ -15,11 +17,17 @@
 #include <wayland-server-core.h>
 #include <wayland-server-protocol.h>
 
+#include "bindings.h"
+#include "blit.h"
 #include "common.h"
+#include "format.h"
 #include "macro.h"
 #include "orpc.h"
 #include "output.h"
+#include "latency.h"
 #include "seat.h"
+#include "transform.h"
+#include "viewporter.h"
 #include "wl-server.h"
 #include "xdg-shell.h"
 
@@ -29,6 +37,8 @@
 
 struct amcs_compositor compositor_ctx = {0};
 
+static int keybindings_init(struct amcs_compositor *ctx);
+
 struct amcs_client *
 amcs_client_new(struct wl_client *client)
 {
@@ -46,6 +56,90 @@ amcs_client_free(struct amcs_client *c)
 	free(c);
 }
 
+static void
+buffer_ref_destroyed(struct wl_listener *listener, void *data)
+{
+	struct amcs_buffer_ref *ref;
+
+	ref = wl_container_of(listener, ref, destroy_listener);
+	ref->res = NULL;
+	wl_list_remove(&ref->destroy_listener.link);
+	wl_list_init(&ref->destroy_listener.link);
+	if (ref->destroy_cb)
+		ref->destroy_cb(ref);
+}
+
+static void
+buffer_ref_set(struct amcs_buffer_ref *ref, struct wl_resource *buffer)
+{
+	if (ref->res == buffer)
+		return;
+	if (ref->res)
+		wl_list_remove(&ref->destroy_listener.link);
+	ref->res = buffer;
+	if (buffer) {
+		ref->destroy_listener.notify = buffer_ref_destroyed;
+		wl_resource_add_destroy_listener(buffer, &ref->destroy_listener);
+	}
+}
+
+/* Client may reuse the buffer, we don't touch it anymore */
+static void
+buffer_ref_release(struct amcs_buffer_ref *ref)
+{
+	if (ref->res == NULL)
+		return;
+	wl_buffer_send_release(ref->res);
+	buffer_ref_set(ref, NULL);
+}
+
+/* Surface window is on the workspace shown by *out* */
+static bool
+surface_is_visible(struct amcs_surface *surf, struct amcs_output *out)
+{
+	struct amcs_workspace *ws;
+
+	if (surf->aw == NULL || surf->aw->ws == NULL)
+		return false;
+	ws = amcs_win_get_workspace(surf->aw);
+	return ws->out == out && out->ws == ws;
+}
+
+/* Window content is gone, the background is shown in its place */
+static void
+surf_detach(struct amcs_surface *mysurf)
+{
+	struct amcs_output *out = compositor_ctx.output;
+	struct amcs_win *aw = mysurf->aw;
+	struct amcs_rect r;
+
+	free(aw->buf.dt);
+	aw->buf.dt = NULL;
+	aw->buf.sz = 0;
+	aw->buf.shm = NULL;
+	aw->buf.stride = 0;
+	if (!surface_is_visible(mysurf, out))
+		return;
+	// window damage isn't mapped without a buffer
+	r = (struct amcs_rect) {aw->x, aw->y, aw->w, aw->h};
+	amcs_output_damage(out, &r);
+	amcs_output_invalidate_scene(out);
+	amcs_win_damage_all(aw);
+	amcs_win_commit(aw);
+}
+
+/* Client destroyed the buffer we read in place, stop drawing it */
+static void
+surf_buffer_destroyed(struct amcs_buffer_ref *ref)
+{
+	struct amcs_surface *surf;
+
+	surf = wl_container_of(ref, surf, buffer);
+	if (surf->aw == NULL || surf->aw->buf.shm == NULL)
+		return;
+	surf_detach(surf);
+}
+
 #define DEFAULT_TITLE "application"
 #define DEFAULT_APPID "app"
 struct amcs_surface *
@@ -56,6 +150,17 @@ amcs_surface_new()
 	res = xmalloc(sizeof(*res));
 	memset(res, 0, sizeof(*res));
 	wl_array_init(&res->surf_states);
+	amcs_region_init(&res->pending.damage);
+	amcs_region_init(&res->pending.buf_damage);
+	amcs_region_init(&res->pending.opaque);
+	amcs_region_init(&res->pending.input);
+	amcs_region_init(&res->input);
+	res->input_all = true;
+	res->pending.scale = res->scale = 1;
+	viewporter_surface_init(res);
+	wl_list_init(&res->pending.frame_cbs);
+	wl_list_init(&res->frame_cbs);
+	res->buffer.destroy_cb = surf_buffer_destroyed;
 
 	res->app_id = DEFAULT_APPID;
 	res->title = DEFAULT_TITLE;
@@ -63,25 +168,83 @@ amcs_surface_new()
 	return res;
 }
 
+static void
+destroy_frame_callbacks(struct wl_list *list)
+{
+	struct wl_resource *res, *tmp;
+
+	wl_resource_for_each_safe(res, tmp, list)
+		wl_resource_destroy(res);
+}
+
 void
 amcs_surface_free(struct amcs_surface *surf)
 {
+	destroy_frame_callbacks(&surf->pending.frame_cbs);
+	destroy_frame_callbacks(&surf->frame_cbs);
+	buffer_ref_set(&surf->pending.buf, NULL);
+	buffer_ref_release(&surf->buffer);
+	viewporter_surface_gone(surf);
+	seat_surface_gone(surf);
 	if (surf->aw)
 		amcs_win_free(surf->aw);
 	wl_array_release(&surf->surf_states);
+	amcs_region_fini(&surf->pending.damage);
+	amcs_region_fini(&surf->pending.buf_damage);
+	amcs_region_fini(&surf->pending.opaque);
+	amcs_region_fini(&surf->pending.input);
+	amcs_region_fini(&surf->input);
+	free(surf->conv.dt);
+	free(surf->stage.dt);
+	free(surf->image.dt);
 	free(surf);
 }
 
+/* Output starts a new frame, data is amcs_screen */
 static void
 sig_surfaces_redraw(struct wl_listener *listener, void *data)
 {
-	struct amcs_compositor *ctx = (struct amcs_compositor *) data;
-	struct amcs_workspace *ws;
+	struct amcs_compositor *ctx = &compositor_ctx;
+	struct amcs_screen *screen = data;
+	struct amcs_surface *surf;
+	struct amcs_rect clip;
+
+	// coalesced pointer motion, once per frame
+	seat_pointer_flush(ctx);
+	// windows mapped or closed since the last frame
+	seat_keyboard_focus(ctx);
+	// apply pending layout changes, cheap if nothing is dirty
+	if (screen->out->ws)
+		amcs_workspace_update(screen->out->ws);
+
+	// callbacks will be fired after this frame is presented
+	wl_list_for_each(surf, &ctx->surfaces, link) {
+		if (wl_list_empty(&surf->frame_cbs))
+			continue;
+		// pointer image may be on any screen
+		if (surf != ctx->seat->cursor &&
+		    (!surface_is_visible(surf, screen->out) ||
+		     !amcs_screen_win_clip(screen, surf->aw, &clip)))
+			continue;
+		wl_list_insert_list(screen->frame_cbs.prev, &surf->frame_cbs);
+		wl_list_init(&surf->frame_cbs);
+	}
+}
 
-	debug("");
-	ws = pvector_get(&ctx->workspaces, ctx->cur_workspace);
-	amcs_workspace_debug(ws);
-	amcs_workspace_update(ws);
+/* Frame is on the screen, data is amcs_screen */
+static void
+sig_surfaces_presented(struct wl_listener *listener, void *data)
+{
+	struct amcs_screen *screen = data;
+	struct wl_resource *res, *tmp;
+	uint32_t msec;
+
+	msec = screen->last_present.tv_sec * 1000 +
+		screen->last_present.tv_nsec / 1000000;
+	wl_resource_for_each_safe(res, tmp, &screen->frame_cbs) {
+		wl_callback_send_done(res, msec);
+		wl_resource_destroy(res);
+	}
 }
 
 static void
@@ -120,11 +283,10 @@ surf_attach(struct wl_client *client, struct wl_resource *resource,
 	mysurf->pending.y = y;
 
 	debug("resource %p, buffer %p, (x; y) (%d; %d)", resource, buffer, x, y);
-	if (!buffer) {
+	if (!buffer)
 		warning("buffer == NULL!!!");
-		return;
-	}
-	mysurf->pending.buf = wl_shm_buffer_get(buffer);
+	buffer_ref_set(&mysurf->pending.buf, buffer);
+	mysurf->pending.newbuf = true;
 }
 
 static void
@@ -136,7 +298,25 @@ surf_damage(struct wl_client *client, struct wl_resource *resource,
 	mysurf = wl_resource_get_user_data(resource);
 	debug("resource %p, need to redraw buf (x; y) (w; h) (%d; %d) (%d %d)",
 		resource, x, y, width, height);
-	(void)mysurf;
+	amcs_region_add(&mysurf->pending.damage, x, y, width, height);
+}
+
+static void
+surf_damage_buffer(struct wl_client *client, struct wl_resource *resource,
+	int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct amcs_surface *mysurf;
+
+	mysurf = wl_resource_get_user_data(resource);
+	debug("resource %p, (x; y) (w; h) (%d; %d) (%d %d)",
+		resource, x, y, width, height);
+	amcs_region_add(&mysurf->pending.buf_damage, x, y, width, height);
+}
+
+static void
+frame_cb_destroy(struct wl_resource *res)
+{
+	wl_list_remove(wl_resource_get_link(res));
 }
 
 static void
@@ -148,16 +328,23 @@ surf_frame(struct wl_client *client, struct wl_resource *resource,
 	mysurf = wl_resource_get_user_data(resource);
 
 	RESOURCE_CREATE(res, client, &wl_callback_interface, 1, id);
-	wl_resource_set_implementation(res, NULL, NULL, NULL);
-	mysurf->redraw_cb = res;
-	warning("%p", resource);
+	wl_resource_set_implementation(res, NULL, NULL, frame_cb_destroy);
+	wl_list_insert(mysurf->pending.frame_cbs.prev, wl_resource_get_link(res));
+	debug("%p", resource);
 }
 
+/* wl_region content is copied, client may destroy the region right away */
 static void
 surf_set_opaque_region(struct wl_client *client,
 	struct wl_resource *resource, struct wl_resource *region)
 {
-	warning("");
+	struct amcs_surface *mysurf = wl_resource_get_user_data(resource);
+
+	amcs_region_clear(&mysurf->pending.opaque);
+	if (region)
+		amcs_region_copy(&mysurf->pending.opaque,
+			wl_resource_get_user_data(region));
+	mysurf->pending.opaque_set = true;
 }
 
 static void
@@ -165,88 +352,532 @@ surf_set_input_region(struct wl_client *client,
 	 struct wl_resource *resource,
 	 struct wl_resource *region)
 {
-	warning("");
+	struct amcs_surface *mysurf = wl_resource_get_user_data(resource);
+
+	amcs_region_clear(&mysurf->pending.input);
+	// NULL region means infinite one
+	mysurf->pending.input_all = region == NULL;
+	if (region)
+		amcs_region_copy(&mysurf->pending.input,
+			wl_resource_get_user_data(region));
+	mysurf->pending.input_set = true;
+}
+
+/*
+ * Apply double-buffered region state. Returns true if the opaque
+ * region is changed.
+ */
+static bool
+surf_commit_regions(struct amcs_surface *mysurf)
+{
+	bool changed = false;
+
+	if (mysurf->pending.input_set) {
+		amcs_region_copy(&mysurf->input, &mysurf->pending.input);
+		mysurf->input_all = mysurf->pending.input_all;
+		mysurf->pending.input_set = false;
+	}
+	// kept pending until the surface gets its window
+	if (mysurf->pending.opaque_set && mysurf->aw) {
+		// no scale and transform, surface coordinates match buffer ones
+		amcs_region_copy(&mysurf->aw->opaque, &mysurf->pending.opaque);
+		mysurf->pending.opaque_set = false;
+		changed = true;
+	}
+	return changed;
+}
+
+/*
+ * Apply pending viewport to the buffer of *bw* x *bh* pixels: find its
+ * part shown by the surface and the surface size. False if the client
+ * has got a protocol error.
+ */
+static bool
+surf_commit_viewport(struct amcs_surface *mysurf, int bw, int bh)
+{
+	struct amcs_viewport *vp = &mysurf->vp;
+	int64_t x1, y1, x2, y2;
+	int tw, th, scale = mysurf->scale;
+
+	*vp = mysurf->pending.vp;
+	amcs_transform_size(mysurf->transform, bw, bh, &tw, &th);
+	mysurf->crop = (struct amcs_rect) {0, 0, tw, th};
+	mysurf->vw = (tw + scale - 1) / scale;
+	mysurf->vh = (th + scale - 1) / scale;
+	if (vp->src_w != -1) {
+		// source is in surface units of the whole buffer, 24.8 fixed
+		x1 = (int64_t)vp->src_x * scale;
+		y1 = (int64_t)vp->src_y * scale;
+		x2 = x1 + (int64_t)vp->src_w * scale;
+		y2 = y1 + (int64_t)vp->src_h * scale;
+		if (x2 > (int64_t)tw << 8 || y2 > (int64_t)th << 8) {
+			wl_resource_post_error(mysurf->viewport,
+				WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+				"source is outside of %dx%d buffer", bw, bh);
+			return false;
+		}
+		// rounded to buffer pixels, at least one is shown
+		x1 = MIN((x1 + 128) >> 8, tw - 1);
+		y1 = MIN((y1 + 128) >> 8, th - 1);
+		x2 = MAX((x2 + 128) >> 8, x1 + 1);
+		y2 = MAX((y2 + 128) >> 8, y1 + 1);
+		mysurf->crop = (struct amcs_rect) {x1, y1, x2 - x1, y2 - y1};
+		if (vp->dst_w == -1 &&
+		    ((vp->src_w | vp->src_h) & 0xff) != 0) {
+			wl_resource_post_error(mysurf->viewport,
+				WP_VIEWPORT_ERROR_BAD_SIZE,
+				"source size isn't integer");
+			return false;
+		}
+		mysurf->vw = wl_fixed_to_int(vp->src_w);
+		mysurf->vh = wl_fixed_to_int(vp->src_h);
+	}
+	if (vp->dst_w != -1) {
+		mysurf->vw = vp->dst_w;
+		mysurf->vh = vp->dst_h;
+	}
+	return true;
+}
+
+/* Surface shows the whole *tw* x *th* transformed buffer */
+static inline bool
+surf_crop_whole(const struct amcs_surface *mysurf, int tw, int th)
+{
+	const struct amcs_rect *c = &mysurf->crop;
+
+	return c->x == 0 && c->y == 0 && c->w == tw && c->h == th;
+}
+
+/*
+ * Convert pending surface damage into buffer coordinates and merge
+ * it with pending buffer damage, clipped by buffer size.
+ */
+static struct amcs_region *
+surf_flush_damage(struct amcs_surface *mysurf, int bw, int bh)
+{
+	struct amcs_region *dmg;
+	struct amcs_rect bufrect = {0, 0, bw, bh};
+	struct amcs_rect surfrect = {0, 0, mysurf->vw, mysurf->vh};
+	struct amcs_rect *c = &mysurf->crop;
+	struct amcs_rect sr, br, *r;
+	int i, tw, th, x1, y1, x2, y2;
+
+	dmg = &mysurf->pending.buf_damage;
+	// surface orientation, buffer resolution
+	amcs_transform_size(mysurf->transform, bw, bh, &tw, &th);
+	amcs_region_for_each(i, r, &mysurf->pending.damage) {
+		if (!amcs_rect_intersect(r, &surfrect, &sr))
+			continue;
+		// surface units to pixels of the shown part, rounded outwards
+		x1 = c->x + (long)sr.x * c->w / mysurf->vw;
+		y1 = c->y + (long)sr.y * c->h / mysurf->vh;
+		x2 = c->x + ((long)(sr.x + sr.w) * c->w + mysurf->vw - 1) / mysurf->vw;
+		y2 = c->y + ((long)(sr.y + sr.h) * c->h + mysurf->vh - 1) / mysurf->vh;
+		sr = (struct amcs_rect) {x1, y1, x2 - x1, y2 - y1};
+		amcs_transform_rect(mysurf->transform, tw, th, &sr, &br);
+		amcs_region_add_rect(dmg, &br);
+	}
+	amcs_region_clear(&mysurf->pending.damage);
+	amcs_region_intersect_rect(dmg, &bufrect);
+	return dmg;
+}
+
+static void
+buf_reserve(struct amcs_buf *b, int w, int h)
+{
+	int sz = w * h * 4;
+
+	if (b->sz < sz) {
+		b->dt = xrealloc(b->dt, sz);
+		b->sz = sz;
+	}
+	b->w = w;
+	b->h = h;
+	b->stride = w * 4;
+}
+
+/* Window buffer rectangle resampled from *r* of *sw* x *sh* image */
+static void
+scale_rect(const struct amcs_buf *wb, int sw, int sh,
+		const struct amcs_rect *r, struct amcs_rect *out)
+{
+	struct amcs_rect wr = {0, 0, wb->w, wb->h};
+	int x1, y1, x2, y2;
+
+	// bilinear filter reads neighbour pixels
+	x1 = (long)(r->x - 1) * wb->w / sw;
+	y1 = (long)(r->y - 1) * wb->h / sh;
+	x2 = ((long)(r->x + r->w + 1) * wb->w + sw - 1) / sw;
+	y2 = ((long)(r->y + r->h + 1) * wb->h + sh - 1) / sh;
+	*out = (struct amcs_rect) {x1, y1, x2 - x1, y2 - y1};
+	amcs_rect_intersect(out, &wr, out);
+}
+
+/*
+ * Copy damaged part of the client buffer into the window buffer:
+ * convert pixel format, undo buffer transform, crop and resample the
+ * buffer to the window size, identity steps are skipped. *dmg* is in
+ * buffer coordinates, it's replaced by damage of the window buffer.
+ * Client buffer is released.
+ */
+static void
+surf_copy_buffer(struct amcs_surface *mysurf, struct wl_shm_buffer *buf,
+		const struct amcs_format *fmt, struct amcs_region *dmg)
+{
+	struct amcs_buf *wb = &mysurf->aw->buf, *dst;
+	struct amcs_rect *c = &mysurf->crop;
+	struct amcs_region sdmg;
+	struct amcs_rect *r, sr;
+	const uint8_t *src;
+	uint8_t *data, *row;
+	long sx_step, sy_step;
+	int stride, pitch, i, k;
+	int bw, bh, tw, th;
+	bool resample;
+
+	buf_reserve(wb, wb->w, wb->h);
+	stride = wl_shm_buffer_get_stride(buf);
+	bw = wl_shm_buffer_get_width(buf);
+	bh = wl_shm_buffer_get_height(buf);
+	amcs_transform_size(mysurf->transform, bw, bh, &tw, &th);
+	resample = !surf_crop_whole(mysurf, tw, th) ||
+		tw != wb->w || th != wb->h;
+
+	wl_shm_buffer_begin_access(buf);
+	data = wl_shm_buffer_get_data(buf);
+	if (mysurf->transform == WL_OUTPUT_TRANSFORM_NORMAL && !resample) {
+		// buffer pixels are window pixels
+		amcs_region_for_each(k, r, dmg) {
+			for (i = r->y; i < r->y + r->h; i++) {
+				row = data + i * stride + r->x * fmt->bpp;
+				if (fmt->convert)
+					fmt->convert(wb->dt + i * wb->w + r->x,
+						row, r->w);
+				else
+					memcpy(wb->dt + i * wb->w + r->x, row, r->w * 4);
+			}
+		}
+		goto done;
+	}
+
+	src = data;
+	pitch = stride;
+	if (fmt->convert) {
+		buf_reserve(&mysurf->conv, bw, bh);
+		amcs_region_for_each(k, r, dmg) {
+			for (i = r->y; i < r->y + r->h; i++) {
+				fmt->convert(mysurf->conv.dt + i * bw + r->x,
+					data + i * stride + r->x * fmt->bpp, r->w);
+			}
+		}
+		src = (uint8_t *)mysurf->conv.dt;
+		pitch = mysurf->conv.stride;
+	}
+	// damage in surface orientation
+	amcs_region_init(&sdmg);
+	amcs_region_for_each(k, r, dmg) {
+		amcs_transform_rect(amcs_transform_invert(mysurf->transform),
+			bw, bh, r, &sr);
+		amcs_region_add_rect(&sdmg, &sr);
+	}
+	if (mysurf->transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		dst = wb;
+		if (resample) {
+			dst = &mysurf->stage;
+			buf_reserve(dst, tw, th);
+		}
+		amcs_region_for_each(k, r, &sdmg) {
+			amcs_blit_transform((uint8_t *)dst->dt +
+					dst->stride * r->y + 4 * r->x, dst->stride,
+				amcs_transform_src(mysurf->transform, tw, th, r,
+					src, pitch, &sx_step, &sy_step),
+				sx_step, sy_step, r->w, r->h);
+		}
+		src = (uint8_t *)dst->dt;
+		pitch = dst->stride;
+	}
+	amcs_region_clear(dmg);
+	// shown part of the buffer
+	src += c->y * pitch + c->x * 4;
+	amcs_region_for_each(k, r, &sdmg) {
+		if (!resample) {
+			amcs_region_add_rect(dmg, r);
+			continue;
+		}
+		if (!amcs_rect_intersect(r, c, &sr))
+			continue;
+		sr.x -= c->x;
+		sr.y -= c->y;
+		scale_rect(wb, c->w, c->h, &sr, &sr);
+		amcs_blit_scale((uint8_t *)wb->dt, wb->stride, wb->w, wb->h,
+			sr.x, sr.y, sr.w, sr.h, src, pitch, c->w, c->h,
+			compositor_ctx.scale_filter);
+		amcs_region_add_rect(dmg, &sr);
+	}
+	amcs_region_fini(&sdmg);
+done:
+	wl_shm_buffer_end_access(buf);
+	buffer_ref_release(&mysurf->pending.buf);
+}
+
+/*
+ * Keep reference to the client buffer and compose straight from it,
+ * previous buffer is released now, the new one -- at the next commit.
+ */
+static void
+surf_use_buffer(struct amcs_surface *mysurf, struct wl_shm_buffer *buf)
+{
+	struct amcs_buf *wb = &mysurf->aw->buf;
+
+	free(wb->dt);
+	wb->dt = NULL;
+	wb->sz = 0;
+	wb->shm = buf;
+	wb->stride = wl_shm_buffer_get_stride(buf);
+	if (mysurf->buffer.res != mysurf->pending.buf.res)
+		buffer_ref_release(&mysurf->buffer);
+	buffer_ref_set(&mysurf->buffer, mysurf->pending.buf.res);
+	buffer_ref_set(&mysurf->pending.buf, NULL);
+}
+
+/*
+ * Surface has no window, a cursor image for example: keep its content
+ * in output pixels. Transform and viewport aren't applied to it.
+ */
+static void
+surf_commit_image(struct amcs_surface *mysurf, struct wl_shm_buffer *buf)
+{
+	struct amcs_buf *img = &mysurf->image;
+	const struct amcs_format *fmt;
+	const uint8_t *src;
+	uint8_t *data;
+	int bw, bh, stride, pitch, oscale, i;
+
+	amcs_region_clear(&mysurf->pending.damage);
+	amcs_region_clear(&mysurf->pending.buf_damage);
+	if ((fmt = amcs_format_get(wl_shm_buffer_get_format(buf))) == NULL) {
+		warning("unknown buffer format, ignore");
+		return;
+	}
+	mysurf->scale = mysurf->pending.scale;
+	mysurf->transform = mysurf->pending.transform;
+	oscale = compositor_ctx.output->scale;
+	bw = wl_shm_buffer_get_width(buf);
+	bh = wl_shm_buffer_get_height(buf);
+	stride = wl_shm_buffer_get_stride(buf);
+
+	wl_shm_buffer_begin_access(buf);
+	data = wl_shm_buffer_get_data(buf);
+	src = data;
+	pitch = stride;
+	if (fmt->convert) {
+		buf_reserve(&mysurf->conv, bw, bh);
+		for (i = 0; i < bh; i++)
+			fmt->convert(mysurf->conv.dt + i * bw, data + i * stride, bw);
+		src = (uint8_t *)mysurf->conv.dt;
+		pitch = mysurf->conv.stride;
+	}
+	buf_reserve(img, MAX(bw * oscale / mysurf->scale, 1),
+			MAX(bh * oscale / mysurf->scale, 1));
+	amcs_blit_scale((uint8_t *)img->dt, img->stride, img->w, img->h,
+		0, 0, img->w, img->h, src, pitch, bw, bh,
+		compositor_ctx.scale_filter);
+	wl_shm_buffer_end_access(buf);
+	if (!fmt->alpha) {
+		for (i = 0; i < img->w * img->h; i++)
+			img->dt[i] |= 0xff000000;
+	}
+	img->format = WL_SHM_FORMAT_ARGB8888;
+	seat_cursor_commit(mysurf);
 }
 
 static void
 surf_commit(struct wl_client *client, struct wl_resource *resource)
 {
 	struct amcs_surface *mysurf;
+	struct amcs_region *dmg;
 	struct wl_shm_buffer *buf;
-	void *data;
+	const struct amcs_format *fmt;
+	struct amcs_buf *wb;
+	struct amcs_rect crop;
 	int x, y, w, h;
-	int bufsz, bh, bw;
-	int format;
+	int bh, bw, sw, sh, oscale;
+	bool changed;
 
 	mysurf = wl_resource_get_user_data(resource);
-	buf = mysurf->pending.buf;
 	debug("recieved commit, need to redraw stuff");
-	if (buf == NULL) {
-		warning("nothing to commit, ignore request");
+
+	wl_list_insert_list(mysurf->frame_cbs.prev, &mysurf->pending.frame_cbs);
+	wl_list_init(&mysurf->pending.frame_cbs);
+	// client waits for a frame even if nothing is damaged
+	if (!wl_list_empty(&mysurf->frame_cbs)) {
+		if (mysurf == compositor_ctx.seat->cursor)
+			amcs_output_schedule_repaint(compositor_ctx.output);
+		else if (surface_is_visible(mysurf, compositor_ctx.output))
+			amcs_output_schedule_frame(compositor_ctx.output,
+					mysurf->aw);
+	}
+
+	// without new attach the last copied content stays valid
+	if (!mysurf->pending.newbuf) {
+		amcs_region_clear(&mysurf->pending.damage);
+		amcs_region_clear(&mysurf->pending.buf_damage);
+		// opaque region only affects what is drawn below the window
+		if (surf_commit_regions(mysurf) && mysurf->aw &&
+		    mysurf->aw->ws)
+			amcs_win_commit(mysurf->aw);
 		return;
 	}
-	if (!mysurf->aw) {
-		warning("window without surface!");
+	surf_commit_regions(mysurf);
+	mysurf->pending.newbuf = false;
+	if (mysurf->pending.buf.res == NULL) {
+		// NULL attach unmaps the window, client gets its buffer back
+		amcs_region_clear(&mysurf->pending.damage);
+		amcs_region_clear(&mysurf->pending.buf_damage);
+		buffer_ref_release(&mysurf->buffer);
+		if (mysurf->aw && amcs_buf_attached(&mysurf->aw->buf))
+			surf_detach(mysurf);
 		return;
 	}
+	if ((buf = wl_shm_buffer_get(mysurf->pending.buf.res)) == NULL) {
+		warning("not a shm buffer, ignore");
+		goto release;
+	}
+	if (!mysurf->aw) {
+		surf_commit_image(mysurf, buf);
+		goto release;
+	}
 
-	x = mysurf->pending.x;
-	y = mysurf->pending.y;
-	w = mysurf->pending.w;
-	h = mysurf->pending.h;
-	wl_shm_buffer_begin_access(buf);
-	data = wl_shm_buffer_get_data(buf);
-
+	// window buffer is in output pixels, surface units are scaled
+	oscale = compositor_ctx.output->scale;
+	x = mysurf->pending.x * oscale;
+	y = mysurf->pending.y * oscale;
+	w = mysurf->pending.w * oscale;
+	h = mysurf->pending.h * oscale;
+
+	changed = mysurf->scale != mysurf->pending.scale ||
+		mysurf->transform != mysurf->pending.transform;
+	mysurf->scale = mysurf->pending.scale;
+	mysurf->transform = mysurf->pending.transform;
 	bh = wl_shm_buffer_get_height(buf);
 	bw = wl_shm_buffer_get_width(buf);
-	assert(x + w <= bw);
-	assert(y + h <= bh);
+	if (bw % mysurf->scale || bh % mysurf->scale)
+		warning("buffer %dx%d isn't a multiple of scale %d",
+			bw, bh, mysurf->scale);
+	crop = mysurf->crop;
+	if (!surf_commit_viewport(mysurf, bw, bh))
+		goto release;
+	if (memcmp(&crop, &mysurf->crop, sizeof(crop)) != 0)
+		changed = true;
+	// window buffer size
+	if (mysurf->vp.src_w == -1 && mysurf->vp.dst_w == -1) {
+		amcs_transform_size(mysurf->transform, bw, bh, &sw, &sh);
+		sw = sw * oscale / mysurf->scale;
+		sh = sh * oscale / mysurf->scale;
+	} else {
+		sw = mysurf->vw * oscale;
+		sh = mysurf->vh * oscale;
+	}
+	assert(x + w <= sw);
+	assert(y + h <= sh);
 	debug("try to commit buf, (x, y) (%d, %d), (w, h) (%d, %d)",
 	      x, y, bw, bh);
 
-	format = wl_shm_buffer_get_format(buf);
-	if (format != WL_SHM_FORMAT_ARGB8888 &&
-	    format != WL_SHM_FORMAT_XRGB8888) {
+	dmg = surf_flush_damage(mysurf, bw, bh);
+
+	fmt = amcs_format_get(wl_shm_buffer_get_format(buf));
+	if (fmt == NULL) {
 		warning("unknown buffer format, ignore");
-		goto finalize;
+		amcs_region_clear(dmg);
+		goto release;
 	}
 
-	bufsz = bh * bw * 4;
-	if (mysurf->aw->buf.sz < bufsz)
-		mysurf->aw->buf.dt = xrealloc(mysurf->aw->buf.dt, bufsz);
 	if (w == 0 || w > mysurf->w)
 		w = mysurf->w;
 	if (h == 0 || h > mysurf->h)
 		h = mysurf->h;
-	mysurf->aw->buf.sz = bufsz;
-	mysurf->aw->v_box.w = MIN(mysurf->pending.w, mysurf->w);
-	mysurf->aw->v_box.h = MIN(mysurf->pending.h, mysurf->h);
+	mysurf->aw->v_box.w = MIN(w, mysurf->w);
+	mysurf->aw->v_box.h = MIN(h, mysurf->h);
 	mysurf->aw->v_box.x = x;
 	mysurf->aw->v_box.y = y;
 
-	mysurf->aw->buf.h = bh;
-	mysurf->aw->buf.w = bw;
+	wb = &mysurf->aw->buf;
+	if (wb->h != sh || wb->w != sw)
+		changed = true;
+	wb->h = sh;
+	wb->w = sw;
+	wb->format = fmt->alpha ? WL_SHM_FORMAT_ARGB8888 : WL_SHM_FORMAT_XRGB8888;
+
+	// only buffers drawn as is can be read in place
+	if (compositor_ctx.shm_zerocopy && fmt->convert == NULL &&
+	    mysurf->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	    surf_crop_whole(mysurf, bw, bh) && sw == bw && sh == bh) {
+		surf_use_buffer(mysurf, buf);
+		mysurf->fmt = NULL;
+	} else {
+		if (wb->shm) {
+			// previous buffer was read in place, no copy to update
+			changed = true;
+			wb->shm = NULL;
+			if (mysurf->buffer.res != mysurf->pending.buf.res)
+				buffer_ref_release(&mysurf->buffer);
+			buffer_ref_set(&mysurf->buffer, NULL);
+		}
+		// scratch images are filled for another conversion
+		if (mysurf->fmt != fmt)
+			changed = true;
+		mysurf->fmt = fmt;
+		if (changed) {
+			// old content is useless
+			amcs_region_clear(dmg);
+			amcs_region_add(dmg, 0, 0, bw, bh);
+		}
+		surf_copy_buffer(mysurf, buf, fmt, dmg);
+	}
+	if (changed) {
+		amcs_region_clear(dmg);
+		amcs_region_add(dmg, 0, 0, sw, sh);
+	}
 
-	memcpy(mysurf->aw->buf.dt, data, bufsz);
+	amcs_region_add_region(&mysurf->aw->damage, dmg);
+	amcs_region_clear(dmg);
 	amcs_win_commit(mysurf->aw);
-	debug("data[0] = %x", ((uint8_t*)data)[0]);
-finalize:
-	wl_shm_buffer_end_access(buf);
+	if (mysurf->acked_serial == mysurf->pending.xdg_serial)
+		amcs_win_configured(mysurf->aw);
 	debug("end!");
+	return;
+release:
+	buffer_ref_release(&mysurf->pending.buf);
 }
 
 static void
 surf_set_buffer_transform(struct wl_client *client,
 	struct wl_resource *resource, int32_t transform)
 {
-	warning("");
+	struct amcs_surface *mysurf = wl_resource_get_user_data(resource);
+
+	if (transform < WL_OUTPUT_TRANSFORM_NORMAL ||
+	    transform > WL_OUTPUT_TRANSFORM_FLIPPED_270) {
+		wl_resource_post_error(resource,
+			WL_SURFACE_ERROR_INVALID_TRANSFORM,
+			"invalid transform %d", transform);
+		return;
+	}
+	mysurf->pending.transform = transform;
 }
 
 static void
 surf_set_buffer_scale(struct wl_client *client,
 	struct wl_resource *resource, int32_t scale)
 {
-	warning("");
+	struct amcs_surface *mysurf = wl_resource_get_user_data(resource);
+
+	if (scale < 1) {
+		wl_resource_post_error(resource, WL_SURFACE_ERROR_INVALID_SCALE,
+			"invalid scale %d", scale);
+		return;
+	}
+	mysurf->pending.scale = scale;
 }
 
 struct wl_surface_interface surface_interface = {
@@ -259,6 +890,7 @@ struct wl_surface_interface surface_interface = {
 	.commit = surf_commit,
 	.set_buffer_transform = surf_set_buffer_transform,
 	.set_buffer_scale = surf_set_buffer_scale,
+	.damage_buffer = surf_damage_buffer,
 };
 
 
@@ -281,21 +913,35 @@ compositor_create_surface(struct wl_client *client,
 static void
 region_destroy(struct wl_client *client, struct wl_resource *resource)
 {
-	warning("");
+	wl_resource_destroy(resource);
 }
 
+static void
+delete_region(struct wl_resource *resource)
+{
+	struct amcs_region *reg = wl_resource_get_user_data(resource);
+
+	amcs_region_fini(reg);
+	free(reg);
+}
+
+/* Regions are kept exact, opaque ones must never grow by collapsing */
 static void
 region_add(struct wl_client *client, struct wl_resource *resource,
 	int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	warning("");
+	struct amcs_rect r = {x, y, width, height};
+
+	amcs_region_union_rect(wl_resource_get_user_data(resource), &r);
 }
 
 static void
 region_subtract(struct wl_client *client, struct wl_resource *resource,
 	int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	warning("");
+	struct amcs_rect r = {x, y, width, height};
+
+	amcs_region_subtract_rect(wl_resource_get_user_data(resource), &r);
 }
 
 struct wl_region_interface region_interface = {
@@ -309,12 +955,15 @@ compositor_create_region(struct wl_client *client,
 			 struct wl_resource *resource, uint32_t id)
 {
 	struct wl_resource *res;
+	struct amcs_region *reg;
 
-	//TODO
 	debug("create region wl_client = %p, id = %d", client, id);
 	RESOURCE_CREATE(res, client, &wl_region_interface,
 			wl_resource_get_version(resource), id);
-	wl_resource_set_implementation(res, &region_interface, resource, NULL);
+	reg = xmalloc(sizeof(*reg));
+	amcs_region_init(reg);
+	wl_resource_set_implementation(res, &region_interface, reg,
+			delete_region);
 }
 
 static const struct wl_compositor_interface compositor_interface = {
@@ -472,8 +1121,9 @@ device_manager_init(struct amcs_compositor *ctx)
 int
 amcs_compositor_init(struct amcs_compositor *ctx)
 {
-	const char *sockpath = NULL;
-	int i;
+	const struct amcs_format *fmts;
+	const char *sockpath = NULL, *env;
+	int i, nfmts;
 
 	memset(ctx, 0, sizeof(*ctx));
 
@@ -483,6 +1133,9 @@ amcs_compositor_init(struct amcs_compositor *ctx)
 
 	wl_list_init(&ctx->clients);
 	wl_list_init(&ctx->surfaces);
+	ctx->shm_zerocopy = getenv("AMCS_SHM_ZEROCOPY") != NULL;
+	if ((env = getenv("AMCS_SCALE_FILTER")) && STREQ(env, "nearest"))
+		ctx->scale_filter = SCALE_NEAREST;
 
 	ctx->display = wl_display_create();
 	if (!ctx->display) {
@@ -508,17 +1161,29 @@ amcs_compositor_init(struct amcs_compositor *ctx)
 	}
 	debug("event loop %p", ctx->evloop);
 
+	// converters are picked by CPU features, before formats are listed
+	amcs_blit_init();
+	amcs_format_init();
 	wl_display_init_shm(ctx->display);
+	fmts = amcs_format_list(&nfmts);
+	for (i = 0; i < nfmts; i++) {
+		// native formats are advertised by default
+		if (fmts[i].convert)
+			wl_display_add_shm_format(ctx->display, fmts[i].format);
+	}
 
 	debug("compositor iface version %d", wl_compositor_interface.version);
 	// compositor stuff
-	ctx->g.comp = wl_global_create(ctx->display, &wl_compositor_interface, 3, ctx, &bind_compositor);
+	ctx->g.comp = wl_global_create(ctx->display, &wl_compositor_interface, 4, ctx, &bind_compositor);
 	if (!ctx->g.comp) {
 		warning("can't use compositor");
 		goto finalize;
 	}
 
+	// SIGHUP must be blocked before seat and output threads start
 	if (xdg_shell_init(ctx) != 0 ||
+	    viewporter_init(ctx) != 0 ||
+	    keybindings_init(ctx) != 0 ||
 	    seat_init(ctx) != 0 ||
 	    device_manager_init(ctx) != 0 ||
 	    output_init(ctx) != 0) {
@@ -526,9 +1191,10 @@ amcs_compositor_init(struct amcs_compositor *ctx)
 	}
 
 	debug("compositor created, adding redraw signal");
-	wl_signal_init(&ctx->redraw_sig);
 	ctx->redraw_listener.notify = sig_surfaces_redraw;
-	wl_signal_add(&ctx->redraw_sig, &ctx->redraw_listener);
+	wl_signal_add(&ctx->output->frame_sig, &ctx->redraw_listener);
+	ctx->present_listener.notify = sig_surfaces_presented;
+	wl_signal_add(&ctx->output->present_sig, &ctx->present_listener);
 
 	pvector_init(&ctx->workspaces, xrealloc);
 	for (i = 0; i < NWORKSPACES; i++) {
@@ -540,6 +1206,8 @@ amcs_compositor_init(struct amcs_compositor *ctx)
 		amcs_workspace_set_output(ws, ctx->output);
 		pvector_push(&ctx->workspaces, ws);
 	}
+	amcs_output_set_workspace(ctx->output,
+			pvector_get(&ctx->workspaces, ctx->cur_workspace));
 	return 0;
 finalize:
 	amcs_compositor_deinit(ctx);
@@ -556,7 +1224,9 @@ amcs_compositor_deinit(struct amcs_compositor *ctx)
 	if (ctx->g.comp)
 		wl_global_destroy(ctx->g.comp);
 	xdg_shell_finalize(ctx);
+	viewporter_finalize(ctx);
 	seat_finalize(ctx);
+	amcs_bindings_finalize();
 	output_finalize(ctx);
 
 	len = pvector_len(&ctx->workspaces);
@@ -580,9 +1250,24 @@ _switch_layout(struct amcs_compositor *ctx, int key, void *opaq)
 static int
 _spawn_proc(struct amcs_compositor *ctx, int key, void *opaq)
 {
-	char *cmd[] = {(char *) opaq, NULL};
+	char buf[PATH_MAX], *cmd[32], *save;
+	sigset_t set;
+	int n = 0;
+
+	// split before fork, other threads may hold the allocator locks
+	snprintf(buf, sizeof(buf), "%s", (char *) opaq);
+	for (cmd[n] = strtok_r(buf, " \t", &save); cmd[n] && n < ARRSZ(cmd) - 1;
+	     cmd[n] = strtok_r(NULL, " \t", &save))
+		n++;
+	cmd[n] = NULL;
+	if (n == 0)
+		return 1;
 	if (fork() == 0) {
 		debug("==@@@@@@==");
+		// signals watched by the event loop are blocked, don't pass
+		// it on
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
 		execvp(cmd[0], cmd);
 		perror("execvp");
 		exit(1);
@@ -630,12 +1315,15 @@ _change_workspace(struct amcs_compositor *ctx, int key, void *opaq)
 	int n;
 
 	n = (int) (intptr_t)opaq;
-	assert(ctx && n < NWORKSPACES + 1);
+	// comes from the bindings file
+	if (n < 1 || n > NWORKSPACES)
+		return 1;
 
 	n--;
 	debug("");
 	w = pvector_get(&ctx->workspaces, n);
 	ctx->cur_workspace = n;
+	amcs_output_set_workspace(ctx->output, w);
 	amcs_workspace_redraw(w);
 	return 0;
 }
@@ -666,65 +1354,72 @@ _move_window(struct amcs_compositor *ctx, int key, void *opaq)
 	return 0;
 }
 
+static const struct amcs_action actions[] = {
+	{"switch_layout", _switch_layout, BIND_ARG_NONE},
+	{"spawn", _spawn_proc, BIND_ARG_STRING},
+	{"kill_client", _kill_client, BIND_ARG_NONE},
+	{"split", _split_window, BIND_ARG_NONE},
+	{"focus", _change_window, BIND_ARG_DIR},
+	{"move", _move_window, BIND_ARG_DIR},
+	{"workspace", _change_workspace, BIND_ARG_INT},
+};
+
+/* Used if there is no bindings file, see bindings.h */
+static const char default_bindings[] =
+	"Alt+Shift+Meta_L	switch_layout\n"
+	"Alt+Shift+Shift_L	switch_layout\n"
+	"\n"
+	"Win+n		spawn ./wlclient\n"
+	"Win+Shift+q	kill_client\n"
+	"Win+s		split\n"
+	"Win+Return	spawn xfce4-terminal\n"
+	"\n"
+	"Win+h		focus left\n"
+	"Win+j		focus down\n"
+	"Win+k		focus up\n"
+	"Win+l		focus right\n"
+	"\n"
+	"Win+Shift+h	move left\n"
+	"Win+Shift+j	move down\n"
+	"Win+Shift+k	move up\n"
+	"Win+Shift+l	move right\n"
+	"\n"
+	"Win+1		workspace 1\n"
+	"Win+2		workspace 2\n"
+	"Win+3		workspace 3\n"
+	"Win+4		workspace 4\n"
+	"Win+5		workspace 5\n"
+	"Win+6		workspace 6\n"
+	"Win+7		workspace 7\n"
+	"Win+8		workspace 8\n"
+	"Win+9		workspace 9\n";
+
+static int
+keybindings_init(struct amcs_compositor *ctx)
+{
+	return amcs_bindings_init(ctx->evloop, actions, ARRSZ(actions),
+			default_bindings);
+}
+
 bool
 amcs_compositor_handle_key(struct amcs_compositor *ctx, struct amcs_key_info *ki)
 {
-	int i, sym;
-
-	struct {
-		int key;
-		int modifier;
-		int (*handler)(struct amcs_compositor *ctx, int key, void *opaq);
-		void *opaq;
-	} handlers[] = {
-		{XKB_KEY_Meta_L, KB_ALT | KB_SHIFT, _switch_layout, NULL},
-		{XKB_KEY_Shift_L, KB_ALT | KB_SHIFT, _switch_layout, NULL},
-
-		{XKB_KEY_n, KB_WIN, _spawn_proc, "./wlclient"},
-		{XKB_KEY_q, KB_WIN | KB_SHIFT, _kill_client, NULL},
-		{XKB_KEY_s, KB_WIN, _split_window, NULL},
-		{XKB_KEY_Return, KB_WIN, _spawn_proc, "xfce4-terminal"},
-
-		{XKB_KEY_h, KB_WIN, _change_window, (void *)WS_LEFT},
-		{XKB_KEY_j, KB_WIN, _change_window, (void *)WS_DOWN},
-		{XKB_KEY_k, KB_WIN, _change_window, (void *)WS_UP},
-		{XKB_KEY_l, KB_WIN, _change_window, (void *)WS_RIGHT},
-
-		{XKB_KEY_h, KB_WIN | KB_SHIFT, _move_window, (void *)WS_LEFT},
-		{XKB_KEY_j, KB_WIN | KB_SHIFT, _move_window, (void *)WS_DOWN},
-		{XKB_KEY_k, KB_WIN | KB_SHIFT, _move_window, (void *)WS_UP},
-		{XKB_KEY_l, KB_WIN | KB_SHIFT, _move_window, (void *)WS_RIGHT},
-
-		{XKB_KEY_1, KB_WIN, _change_workspace, (void *)1},
-		{XKB_KEY_2, KB_WIN, _change_workspace, (void *)2},
-		{XKB_KEY_3, KB_WIN, _change_workspace, (void *)3},
-		{XKB_KEY_4, KB_WIN, _change_workspace, (void *)4},
-		{XKB_KEY_5, KB_WIN, _change_workspace, (void *)5},
-		{XKB_KEY_6, KB_WIN, _change_workspace, (void *)6},
-		{XKB_KEY_7, KB_WIN, _change_workspace, (void *)7},
-		{XKB_KEY_8, KB_WIN, _change_workspace, (void *)8},
-		{XKB_KEY_9, KB_WIN, _change_workspace, (void *)9},
-	};
+	const struct amcs_binding *b;
+	int sym;
+
 	sym = ki->keysym;
-	debug("key = %d, modifiers %d arrsz %lu", sym, ki->modifiers, ARRSZ(handlers));
+	debug("key = %d, modifiers %d", sym, ki->modifiers);
 	/* try to canonicalize only latin letters */
 	if (sym < 0x7f && isupper(sym))
 		sym = tolower(sym);
 
-	for (i = 0; i < ARRSZ(handlers); i++) {
-		if (sym != handlers[i].key)
-			continue;
-		debug("key found");
-		if (ki->modifiers != handlers[i].modifier)
-			continue;
-		debug("modifiers match");
-		if (ki->state == WL_KEYBOARD_KEY_STATE_RELEASED)
-			return true;
-		debug("run handler");
-		handlers[i].handler(ctx, sym, handlers[i].opaq);
+	if ((b = amcs_bindings_find(sym, ki->modifiers)) == NULL)
+		return false;
+	if (ki->state == WL_KEYBOARD_KEY_STATE_RELEASED)
 		return true;
-	}
-	return false;
+	debug("run handler %s", b->action->name);
+	b->action->fn(ctx, sym, b->opaq);
+	return true;
 }
 
 struct amcs_client *
@@ -786,17 +1481,17 @@ main(int argc, const char *argv[])
 
 	debug("event loop dispatch");
 	while (1) {
-		rc = wl_event_loop_dispatch(compositor_ctx.evloop, 2000);
+		// repaints are driven by output frame scheduler
+		rc = wl_event_loop_dispatch(compositor_ctx.evloop, -1);
 
 		if (rc < 0 && errno != EINTR) {
 			warning("error at loop dispatch");
 			break;
 		}
-
-		wl_signal_emit(&compositor_ctx.redraw_sig, &compositor_ctx);
 		//debug("evloop rc = %d", rc);
 
 		wl_display_flush_clients(compositor_ctx.display);
+		amcs_lat_flushed();
 	}
 
 	amcs_compositor_deinit(&compositor_ctx);
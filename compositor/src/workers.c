@@ -0,0 +1,151 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "macro.h"
+#include "workers.h"
+
+struct amcs_workers {
+	pthread_t *threads;
+	int nthreads;		//spawned threads, caller isn't counted
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int gen;	//batch generation, bumped by run
+	int active;		//threads still working on the batch
+	bool stop;
+
+	amcs_job_fn fn;
+	void *opaq;
+	int njobs;
+	int next;		//next job index, atomic
+};
+
+static void
+run_jobs(struct amcs_workers *w)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->njobs)
+		w->fn(i, w->opaq);
+}
+
+static void *
+worker_main(void *data)
+{
+	struct amcs_workers *w = data;
+	unsigned int gen = 0;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (w->gen == gen && !w->stop)
+			pthread_cond_wait(&w->start, &w->lock);
+		if (w->stop)
+			break;
+		gen = w->gen;
+		pthread_mutex_unlock(&w->lock);
+
+		run_jobs(w);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->active == 0)
+			pthread_cond_signal(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+struct amcs_workers *
+amcs_workers_new(int nthreads)
+{
+	struct amcs_workers *w;
+	sigset_t set, old;
+	int i;
+
+	assert(nthreads > 0);
+	w = xmalloc(sizeof(*w));
+	memset(w, 0, sizeof(*w));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->threads = xmalloc(sizeof(pthread_t) * nthreads);
+
+	// asynchronous signals are handled by the main thread only,
+	// SIGBUS from client shm buffers must reach the faulting thread
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&w->threads[i], NULL, worker_main, w)) {
+			warning("can't create worker thread");
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	w->nthreads = i;
+	debug("%d worker threads", w->nthreads);
+	return w;
+}
+
+void
+amcs_workers_free(struct amcs_workers *w)
+{
+	int i;
+
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	pthread_cond_destroy(&w->done);
+	pthread_cond_destroy(&w->start);
+	pthread_mutex_destroy(&w->lock);
+	free(w->threads);
+	free(w);
+}
+
+int
+amcs_workers_nthreads(struct amcs_workers *w)
+{
+	return w->nthreads + 1;
+}
+
+void
+amcs_workers_run(struct amcs_workers *w, amcs_job_fn fn, void *opaq, int njobs)
+{
+	int i;
+
+	// nothing to share, don't wake anybody up
+	if (w->nthreads == 0 || njobs == 1) {
+		for (i = 0; i < njobs; i++)
+			fn(i, opaq);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	w->fn = fn;
+	w->opaq = opaq;
+	w->njobs = njobs;
+	w->next = 0;
+	w->active = w->nthreads;
+	w->gen++;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+
+	run_jobs(w);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->active > 0)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
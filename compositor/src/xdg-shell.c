@@ -9,6 +9,7 @@
 
 #include "common.h"
 #include "macro.h"
+#include "output.h"
 #include "seat.h"
 #include "wl-server.h"
 
@@ -139,6 +140,7 @@ window_update_cb(struct amcs_win *win, void *opaq)
 	uint32_t serial;
 	uint32_t *p;
 	struct wl_array arr;
+	int scale;
 
 	surf = opaq;
 	if (win->w != surf->w ||
@@ -153,14 +155,16 @@ window_update_cb(struct amcs_win *win, void *opaq)
 		p = wl_array_add(&arr, sizeof(*p));
 		*p = XDG_TOPLEVEL_STATE_MAXIMIZED;
 
-		xdg_toplevel_send_configure(surf->xdgtopres, win->w, win->h, &arr);
+		// window is in output pixels, client works in surface units
+		scale = compositor_ctx.output->scale;
+		xdg_toplevel_send_configure(surf->xdgtopres, win->w / scale,
+				win->h / scale, &arr);
 		wl_array_release(&arr);
 		serial = wl_display_next_serial(compositor_ctx.display);
 		surf->pending.xdg_serial = serial;
 		xdg_surface_send_configure(surf->xdgres, serial);
+		return WIN_UPD_CONFIGURE;
 	}
-	if (surf->redraw_cb)
-		wl_callback_send_done(surf->redraw_cb, get_time());
 	return 0;
 }
 
@@ -169,28 +173,14 @@ window_init(struct amcs_surface *mysurf)
 {
 	struct amcs_client *c;
 	struct amcs_workspace *ws;
-	uint32_t serial;
-	uint32_t *newst;
 
 	assert(mysurf);
 
-	serial = wl_display_next_serial(compositor_ctx.display);
-	mysurf->pending.xdg_serial = serial;
-	debug("generated serial = %d", serial);
-	//TODO: newst??????
-	newst = wl_array_add(&mysurf->surf_states, sizeof(*newst));
-	*newst = XDG_TOPLEVEL_STATE_ACTIVATED;
-
 	ws = pvector_get(&compositor_ctx.workspaces,
 			compositor_ctx.cur_workspace);
+	// initial configure is sent by window_update_cb from layout pass
 	mysurf->aw = amcs_workspace_new_win(ws, mysurf, window_update_cb);
-	mysurf->w = mysurf->aw->w;
-	mysurf->h = mysurf->aw->h;
-
-	xdg_toplevel_send_configure(mysurf->xdgtopres, mysurf->w, mysurf->h,
-			&mysurf->surf_states);
 
-	xdg_surface_send_configure(mysurf->xdgres, serial);
 	c = amcs_get_client(mysurf->res);
 	assert(c && "can't locate client");
 
@@ -232,11 +222,12 @@ static void
 surf_ack_configure(struct wl_client *client,
 	struct wl_resource *resource, uint32_t serial)
 {
-//	struct amcs_surface *mysurf;
-//	mysurf = wl_resource_get_user_data(resource);
+	struct amcs_surface *mysurf;
+	mysurf = wl_resource_get_user_data(resource);
 
 	debug("serial = %d", serial);
-	//assert(serial == mysurf->pending.xdg_serial);
+	// the next buffer commit is the answer to this configure
+	mysurf->acked_serial = serial;
 }
 
 
@@ -0,0 +1,193 @@
+/*
+ * Compare composition straight into a scanout buffer with composition
+ * into a cached shadow buffer followed by streaming flush.
+ *
+ * Scanout buffer is a DRM dumb buffer when /dev/dri/card0 (or the path
+ * from argv[1]) can be opened, it's usually write-combined memory.
+ * Otherwise plain heap memory is used and results show only the cost
+ * of the extra copy.
+ *
+ * AMCS_BLIT environment variable selects blitter, as in the compositor.
+ */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "blit.h"
+#include "macro.h"
+
+#define SCR_W 1920
+#define SCR_H 1080
+#define NFRAMES 200
+
+struct target {
+	uint8_t *buf;
+	int pitch;
+	size_t size;
+	bool dumb;
+};
+
+static bool
+dumb_alloc(struct target *t, const char *path)
+{
+	struct drm_mode_create_dumb creq = {0};
+	struct drm_mode_map_dumb mreq = {0};
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+		return false;
+	creq.width = SCR_W;
+	creq.height = SCR_H;
+	creq.bpp = 32;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0)
+		goto err;
+	mreq.handle = creq.handle;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) < 0)
+		goto err;
+	t->buf = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, mreq.offset);
+	if (t->buf == MAP_FAILED)
+		goto err;
+	// buffer stays alive until exit
+	t->pitch = creq.pitch;
+	t->size = creq.size;
+	t->dumb = true;
+	return true;
+err:
+	close(fd);
+	return false;
+}
+
+static void
+target_alloc(struct target *t, const char *path)
+{
+	if (dumb_alloc(t, path))
+		return;
+	t->pitch = SCR_W * 4;
+	t->size = t->pitch * SCR_H;
+	t->buf = xmalloc(t->size);
+	t->dumb = false;
+}
+
+static int64_t
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Opaque window covering the screen and translucent one on top */
+static uint32_t *bottom, *top;
+#define TOP_X 300
+#define TOP_Y 200
+#define TOP_W 800
+#define TOP_H 600
+
+static void
+scene_init(void)
+{
+	int i;
+
+	bottom = xmalloc(SCR_W * SCR_H * 4);
+	top = xmalloc(TOP_W * TOP_H * 4);
+	for (i = 0; i < SCR_W * SCR_H; i++)
+		bottom[i] = 0xff000000 | (i * 2654435761u >> 8);
+	// premultiplied, half transparent
+	for (i = 0; i < TOP_W * TOP_H; i++)
+		top[i] = 0x80000000 | ((i & 0x7f) << 16) | 0x4040;
+}
+
+/* Draw x, y, w, h part of the scene into *dst* */
+static void
+scene_draw(uint8_t *dst, int pitch, int x, int y, int w, int h)
+{
+	int x1, y1, x2, y2;
+
+	amcs_blit_rect(dst + pitch * y + 4 * x, pitch,
+		(uint8_t *)(bottom + SCR_W * y + x), SCR_W * 4,
+		w, h, BLIT_COPY, 0);
+	x1 = MAX(x, TOP_X);
+	y1 = MAX(y, TOP_Y);
+	x2 = MIN(x + w, TOP_X + TOP_W);
+	y2 = MIN(y + h, TOP_Y + TOP_H);
+	if (x2 <= x1 || y2 <= y1)
+		return;
+	amcs_blit_rect(dst + pitch * y1 + 4 * x1, pitch,
+		(uint8_t *)(top + TOP_W * (y1 - TOP_Y) + x1 - TOP_X), TOP_W * 4,
+		x2 - x1, y2 - y1, BLIT_BLEND, 0);
+}
+
+struct damage {
+	const char *name;
+	int x, y, w, h;
+};
+
+static const struct damage damages[] = {
+	{"full frame", 0, 0, SCR_W, SCR_H},
+	{"window", TOP_X, TOP_Y, TOP_W, TOP_H},
+	{"cursor-sized", TOP_X + 100, TOP_Y + 100, 64, 64},
+};
+
+static double
+bench_direct(struct target *t, const struct damage *d)
+{
+	int64_t start;
+	int i;
+
+	start = now_nsec();
+	for (i = 0; i < NFRAMES; i++)
+		scene_draw(t->buf, t->pitch, d->x, d->y, d->w, d->h);
+	return (now_nsec() - start) / 1e6 / NFRAMES;
+}
+
+static double
+bench_shadow(struct target *t, uint8_t *shadow, const struct damage *d)
+{
+	int64_t start;
+	int off, i;
+
+	off = t->pitch * d->y + 4 * d->x;
+	start = now_nsec();
+	for (i = 0; i < NFRAMES; i++) {
+		scene_draw(shadow, t->pitch, d->x, d->y, d->w, d->h);
+		amcs_blit_stream_rect(t->buf + off, t->pitch,
+			shadow + off, t->pitch, d->w, d->h);
+	}
+	return (now_nsec() - start) / 1e6 / NFRAMES;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct target t;
+	uint8_t *shadow;
+	int i;
+
+	amcs_blit_init();
+	target_alloc(&t, argc > 1 ? argv[1] : "/dev/dri/card0");
+	shadow = xmalloc(t.size);
+	scene_init();
+	// warm up, fault in all pages
+	scene_draw(t.buf, t.pitch, 0, 0, SCR_W, SCR_H);
+	scene_draw(shadow, t.pitch, 0, 0, SCR_W, SCR_H);
+
+	printf("blitter %s, target %s, %dx%d, ms per frame\n",
+		amcs_blit.name, t.dumb ? "dumb buffer" : "heap memory",
+		SCR_W, SCR_H);
+	printf("%-14s %10s %10s\n", "damage", "direct", "shadow");
+	for (i = 0; i < ARRSZ(damages); i++) {
+		printf("%-14s %10.3f %10.3f\n", damages[i].name,
+			bench_direct(&t, &damages[i]),
+			bench_shadow(&t, shadow, &damages[i]));
+	}
+	return 0;
+}